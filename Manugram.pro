@@ -24,13 +24,29 @@ SOURCES += \
     figurepainter.cpp \
     textpainter.cpp \
     build_info.cpp \
-    model_ops.cpp
+    model_ops.cpp \
+    model_index.cpp \
+    recognition_worker.cpp \
+    recognition_kernels.cpp \
+    track_filter.cpp \
+    tracing.cpp
 
 CONFIG(tests) {
     QT += testlib
     CONFIG += testlib
-    SOURCES += tests.cpp
+    SOURCES += tests.cpp track_corpus.cpp allocation_counter.cpp
+    HEADERS += track_corpus.h allocation_counter.h
     RESOURCES += resources-tests.qrc
+} else:CONFIG(benchmark) {
+    SOURCES += benchmark.cpp track_corpus.cpp allocation_counter.cpp
+    HEADERS += track_corpus.h allocation_counter.h
+    RESOURCES += resources-tests.qrc
+} else:CONFIG(batch) {
+    SOURCES += batch_recognition.cpp track_corpus.cpp
+    HEADERS += track_corpus.h
+} else:CONFIG(autotune) {
+    SOURCES += autotune.cpp track_corpus.cpp
+    HEADERS += track_corpus.h
 } else {
     SOURCES += main.cpp
 }
@@ -44,7 +60,13 @@ HEADERS  += mainwindow.h \
     model_io.h \
     textpainter.h \
     build_info.h \
-    model_ops.h
+    model_ops.h \
+    model_index.h \
+    persistent_map.h \
+    recognition_worker.h \
+    recognition_kernels.h \
+    track_filter.h \
+    tracing.h
 
 FORMS    += mainwindow.ui
 
@@ -58,8 +80,10 @@ DISTFILES += \
     android/res/values/libs.xml \
     android/build.gradle
 
-android:DEFINES += DEFAULT_RECOGNITION_PRESET=Touch DISABLE_SHOW_RECOGNITION_RESULT=1 ENABLE_FAST_REDRAW=1
+android:DEFINES += DEFAULT_RECOGNITION_PRESET=Touch DISABLE_SHOW_RECOGNITION_RESULT=1 ENABLE_FAST_REDRAW=1 DEFAULT_UNDO_MODE=Changes
 !android:DEFINES += DEFAULT_RECOGNITION_PRESET=Mouse
+# tracing costs an atomic load per scope while it is not recorded, remove to compile it out
+DEFINES += ENABLE_TRACING=1
 
 ANDROID_PACKAGE_SOURCE_DIR = $$PWD/android
 
@@ -0,0 +1,22 @@
+#include "allocation_counter.h"
+#include <cstdlib>
+#include <new>
+
+thread_local size_t allocationsCount = 0;
+thread_local long long liveAllocations = 0;
+
+void *operator new(size_t size) {
+    allocationsCount++;
+    liveAllocations++;
+    void *result = malloc(size ? size : 1);
+    if (!result) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+void operator delete(void *ptr) noexcept {
+    if (ptr) {
+        liveAllocations--;
+    }
+    free(ptr);
+}
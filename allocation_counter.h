@@ -0,0 +1,14 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+
+/*
+ * Counts allocations of the current thread by replacing global operator new and delete,
+ * allocation_counter.cpp is linked into tests and the benchmark only.
+ * 'Live' allocations are not freed yet, frees of other threads' memory are counted too.
+ */
+extern thread_local size_t allocationsCount;
+extern thread_local long long liveAllocations;
+
+#endif // ALLOCATION_COUNTER_H
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model.h"
+#include "recognition.h"
+#include "track_corpus.h"
+
+/*
+ * Searches for parameters of recognition (see RecognitionContext) which recognize
+ * a labelled corpus (see LabelledTrack) best, parameter sets are evaluated in parallel.
+ * Prints the Pareto front of accuracy and latency, parameters of the preset are always evaluated.
+ * Threads slow each other down, so the preset and the front are measured again in one thread
+ * after all evaluations, other latencies (-v) are comparable within one run only.
+ * Usage: Manugram [-j threads] [-m model.mgm] [-p mouse|touch] [-n samples | -g values]
+ *                 [-o parameter,...] [-r repeats] [-s seed] [-v] directory
+ * -n: random search over 'samples' parameter sets (200 by default)
+ * -g: grid search with 'values' values of each parameter
+ * -o: only these parameters are changed, each of them once
+ * -r: passes over the corpus for each parameter set (3 by default)
+ * -v: print all evaluated parameter sets
+ */
+
+struct Parameter {
+    const char *name;
+    double min, max;
+    bool isInteger;
+    double (*get)(const RecognitionContext &context);
+    void (*set)(RecognitionContext &context, double value);
+};
+
+#define PARAMETER(field, min, max, isInteger) { #field, min, max, isInteger, \
+    [](const RecognitionContext &context) -> double { return context.field; }, \
+    [](RecognitionContext &context, double value) { context.field = value; } }
+
+const Parameter PARAMETERS[] = {
+    PARAMETER(speedStopThreshold, 0.03, 0.15, false),
+    PARAMETER(curveSpeedStopThreshold, 0.01, 0.05, false),
+    PARAMETER(stopArea, 8, 25, false),
+    PARAMETER(trackFitGap, 5, 20, false),
+    PARAMETER(minFitPointsAmount, 0.6, 0.9, false),
+    PARAMETER(squaringMinRatio, 0.7, 0.95, false),
+    PARAMETER(deletionMoveMaxAngle, 15, 60, false),
+    PARAMETER(deletionMoveMinCount, 2, 6, true),
+    PARAMETER(deletionMaxTime, 500, 2000, true),
+};
+
+#undef PARAMETER
+
+struct Evaluation {
+    RecognitionContext context;
+    int correct;
+    double latency; // mean time of recognition of a track in microseconds
+
+    explicit Evaluation(const RecognitionContext &context) : context(context), correct(0), latency(0) {}
+};
+
+void setParameter(RecognitionContext &context, const Parameter &parameter, double value) {
+    if (parameter.isInteger) {
+        value = round(value);
+    }
+    parameter.set(context, value);
+}
+
+// latency is the one of the fastest of 'repeats' passes, as other ones are slowed down by noise
+void evaluate(const std::vector<LabelledTrack> &tracks, const Model &model, RecognitionScratch &scratch,
+              int repeats, Evaluation &evaluation) {
+    double bestTime = INFINITY;
+    for (int repeat = 0; repeat < repeats; repeat++) {
+        int correct = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const LabelledTrack &track : tracks) {
+            RecognizedEdit edit = recognizeEdit(evaluation.context, track.track, model, scratch);
+            correct += track.expected == recognizedType(edit);
+        }
+        double time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        bestTime = std::min(bestTime, time);
+        evaluation.correct = correct;
+    }
+    evaluation.latency = bestTime / tracks.size();
+}
+
+void printEvaluation(const Evaluation &evaluation, const std::vector<const Parameter*> &parameters, size_t tracksCount) {
+    printf("%d/%zu (%.1f%%)\t%.1f", evaluation.correct, tracksCount,
+           evaluation.correct * 100.0 / tracksCount, evaluation.latency);
+    for (const Parameter *parameter : parameters) {
+        printf("\t%s=%g", parameter->name, parameter->get(evaluation.context));
+    }
+    printf("\n");
+}
+
+// the fastest one for each accuracy which is better than accuracies of faster ones
+std::vector<Evaluation*> getParetoFront(std::vector<Evaluation*> evaluations) {
+    std::sort(evaluations.begin(), evaluations.end(), [](const Evaluation *a, const Evaluation *b) {
+        if (a->latency != b->latency) { return a->latency < b->latency; }
+        return a->correct > b->correct;
+    });
+    std::vector<Evaluation*> front;
+    int bestCorrect = -1;
+    for (Evaluation *evaluation : evaluations) {
+        if (evaluation->correct > bestCorrect) {
+            bestCorrect = evaluation->correct;
+            front.push_back(evaluation);
+        }
+    }
+    return front;
+}
+
+int usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-j threads] [-m model.mgm] [-p mouse|touch] [-n samples | -g values]\n"
+                    "       [-o parameter,...] [-r repeats] [-s seed] [-v] directory\n"
+                    "Parameters:", program);
+    for (const Parameter &parameter : PARAMETERS) {
+        fprintf(stderr, " %s", parameter.name);
+    }
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    const char *modelFileName = nullptr;
+    RecognitionPreset preset = RecognitionPreset::Mouse;
+    int samples = 200, gridValues = 0, repeats = 3;
+    unsigned seed = 1;
+    bool verbose = false;
+    std::vector<const Parameter*> parameters;
+    const char *directory = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threadsCount = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            modelFileName = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "mouse")) {
+                preset = RecognitionPreset::Mouse;
+            } else if (!strcmp(argv[i], "touch")) {
+                preset = RecognitionPreset::Touch;
+            } else {
+                return usage(argv[0]);
+            }
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+            gridValues = 0;
+        } else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+            gridValues = atoi(argv[++i]);
+            if (gridValues < 2) {
+                return usage(argv[0]);
+            }
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            std::string names = argv[++i];
+            for (size_t start = 0; start <= names.size();) {
+                size_t end = std::min(names.find(',', start), names.size());
+                std::string name = names.substr(start, end - start);
+                auto it = std::find_if(std::begin(PARAMETERS), std::end(PARAMETERS), [&name](const Parameter &parameter) {
+                    return name == parameter.name;
+                });
+                if (it == std::end(PARAMETERS)) {
+                    fprintf(stderr, "Unknown parameter %s\n", name.c_str());
+                    return usage(argv[0]);
+                }
+                // otherwise the grid would have the same values along several axes
+                if (std::find(parameters.begin(), parameters.end(), it) != parameters.end()) {
+                    fprintf(stderr, "Parameter %s is given twice\n", name.c_str());
+                    return usage(argv[0]);
+                }
+                parameters.push_back(it);
+                start = end + 1;
+            }
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            repeats = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else if (!directory && argv[i][0] != '-') {
+            directory = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!directory) {
+        return usage(argv[0]);
+    }
+    if (parameters.empty()) {
+        for (const Parameter &parameter : PARAMETERS) {
+            parameters.push_back(&parameter);
+        }
+    }
+
+    Model model;
+    if (modelFileName) {
+        std::string error = loadModel(modelFileName, model);
+        if (!error.empty()) {
+            fprintf(stderr, "%s: %s\n", modelFileName, error.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<LabelledTrack> tracks;
+    for (LabelledTrack &track : loadLabelledTracks(directory)) {
+        if (!track.error.empty()) {
+            fprintf(stderr, "%s: %s\n", track.path.c_str(), track.error.c_str());
+        } else {
+            tracks.push_back(std::move(track));
+        }
+    }
+    if (tracks.empty()) {
+        fprintf(stderr, "No tracks found in %s\n", directory);
+        return 1;
+    }
+
+    // the preset goes first
+    const RecognitionContext presetContext(preset);
+    std::vector<Evaluation> evaluations(1, Evaluation(presetContext));
+    if (gridValues > 0) {
+        double size = pow(gridValues, parameters.size());
+        if (size > 1e6) {
+            fprintf(stderr, "Grid of %g parameter sets is too large, choose less parameters with -o\n", size);
+            return 1;
+        }
+        std::vector<int> id(parameters.size(), 0);
+        for (;;) {
+            Evaluation evaluation(presetContext);
+            for (size_t i = 0; i < parameters.size(); i++) {
+                const Parameter &parameter = *parameters[i];
+                setParameter(evaluation.context, parameter, parameter.min + (parameter.max - parameter.min) * id[i] / (gridValues - 1));
+            }
+            evaluations.push_back(evaluation);
+
+            size_t i = 0;
+            while (i < id.size() && ++id[i] == gridValues) {
+                id[i++] = 0;
+            }
+            if (i == id.size()) {
+                break;
+            }
+        }
+    } else {
+        std::mt19937 generator(seed);
+        for (int sample = 0; sample < samples; sample++) {
+            Evaluation evaluation(presetContext);
+            for (const Parameter *parameter : parameters) {
+                std::uniform_real_distribution<double> valueGen(parameter->min, parameter->max);
+                setParameter(evaluation.context, *parameter, valueGen(generator));
+            }
+            evaluations.push_back(evaluation);
+        }
+    }
+
+    // all threads share the model, which is not changed by evaluations
+    auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> nextEvaluation(0);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadsCount; i++) {
+        threads.push_back(std::thread([&]() {
+            RecognitionScratch scratch;
+            // grows scratch buffers, so the first evaluation is not slower than others
+            Evaluation warmUp(presetContext);
+            evaluate(tracks, model, scratch, 1, warmUp);
+            for (size_t id; (id = nextEvaluation++) < evaluations.size();) {
+                evaluate(tracks, model, scratch, repeats, evaluations[id]);
+            }
+        }));
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("Evaluated %zu parameter sets on %zu tracks in %.1f s using %u threads\n\n",
+           evaluations.size(), tracks.size(), time, threadsCount);
+    printf("accuracy\tlatency_us\tparameters\n");
+    if (verbose) {
+        printf("All (latency with %u threads running):\n", threadsCount);
+        for (const Evaluation &evaluation : evaluations) {
+            printEvaluation(evaluation, parameters, tracks.size());
+        }
+    }
+
+    std::vector<Evaluation*> candidates;
+    for (Evaluation &evaluation : evaluations) {
+        candidates.push_back(&evaluation);
+    }
+    candidates = getParetoFront(candidates);
+    // the preset is measured again anyway, so it may get into the front
+    if (std::find(candidates.begin(), candidates.end(), &evaluations[0]) == candidates.end()) {
+        candidates.push_back(&evaluations[0]);
+    }
+    if (threadsCount > 1) {
+        // latency with other threads running depends on their number, so it is not comparable with other runs
+        RecognitionScratch scratch;
+        Evaluation warmUp(presetContext);
+        evaluate(tracks, model, scratch, 1, warmUp);
+        evaluate(tracks, model, scratch, repeats, evaluations[0]);
+        for (Evaluation *evaluation : candidates) {
+            if (evaluation != &evaluations[0]) {
+                evaluate(tracks, model, scratch, repeats, *evaluation);
+            }
+        }
+    }
+    printf("Preset (latency in one thread):\n");
+    printEvaluation(evaluations[0], parameters, tracks.size());
+    printf("Pareto front (latency in one thread):\n");
+    for (const Evaluation *evaluation : getParetoFront(candidates)) {
+        printEvaluation(*evaluation, parameters, tracks.size());
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model.h"
+#include "recognition.h"
+#include "track_corpus.h"
+
+/*
+ * Recognizes all .track files in a directory tree without GUI, in parallel.
+ * Tracks collected with 'Store tracks' and sorted by hand (see LabelledTrack)
+ * give a confusion matrix.
+ * Usage: Manugram [-j threads] [-m model.mgm] [-p mouse|touch] directory
+ */
+
+struct TrackResult {
+    std::string recognized;
+    double fit;  // see RecognizedEdit::fit
+    double time; // in microseconds
+
+    TrackResult() : fit(NAN), time(0) {}
+};
+
+void recognizeTrack(const RecognitionContext &context, const Model &model, RecognitionScratch &scratch,
+                    const LabelledTrack &labelled, TrackResult &result) {
+    auto start = std::chrono::steady_clock::now();
+    RecognizedEdit edit = recognizeEdit(context, labelled.track, model, scratch);
+    result.time = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    result.recognized = recognizedType(edit);
+    result.fit = edit.fit;
+}
+
+void printConfusionMatrix(const std::vector<LabelledTrack> &tracks, const std::vector<TrackResult> &results) {
+    std::map<std::string, std::map<std::string, int>> matrix;
+    std::vector<std::string> columns;
+    for (size_t i = 0; i < tracks.size(); i++) {
+        const TrackResult &result = results[i];
+        if (!tracks[i].error.empty()) {
+            continue;
+        }
+        matrix[tracks[i].expected][result.recognized]++;
+        if (std::find(columns.begin(), columns.end(), result.recognized) == columns.end()) {
+            columns.push_back(result.recognized);
+        }
+    }
+    std::sort(columns.begin(), columns.end());
+
+    printf("\nexpected \\ recognized");
+    for (const std::string &column : columns) {
+        printf("\t%s", column.c_str());
+    }
+    printf("\taccuracy\n");
+    int correct = 0, total = 0;
+    for (const auto &row : matrix) {
+        printf("%s", row.first.c_str());
+        int rowTotal = 0;
+        for (const std::string &column : columns) {
+            auto it = row.second.find(column);
+            int count = it == row.second.end() ? 0 : it->second;
+            printf("\t%d", count);
+            rowTotal += count;
+        }
+        auto it = row.second.find(row.first);
+        int rowCorrect = it == row.second.end() ? 0 : it->second;
+        printf("\t%.1f%%\n", rowCorrect * 100.0 / rowTotal);
+        correct += rowCorrect;
+        total += rowTotal;
+    }
+    if (total > 0) {
+        printf("total\t%d/%d (%.1f%%)\n", correct, total, correct * 100.0 / total);
+    }
+}
+
+int usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-j threads] [-m model.mgm] [-p mouse|touch] directory\n", program);
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    const char *modelFileName = nullptr;
+    RecognitionPreset preset = RecognitionPreset::Mouse;
+    const char *directory = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threadsCount = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            modelFileName = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "mouse")) {
+                preset = RecognitionPreset::Mouse;
+            } else if (!strcmp(argv[i], "touch")) {
+                preset = RecognitionPreset::Touch;
+            } else {
+                return usage(argv[0]);
+            }
+        } else if (!directory && argv[i][0] != '-') {
+            directory = argv[i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (!directory) {
+        return usage(argv[0]);
+    }
+
+    Model model;
+    if (modelFileName) {
+        std::string error = loadModel(modelFileName, model);
+        if (!error.empty()) {
+            fprintf(stderr, "%s: %s\n", modelFileName, error.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<LabelledTrack> tracks = loadLabelledTracks(directory);
+    std::vector<TrackResult> results(tracks.size());
+
+    // all threads share the model, which is not changed by recognizeEdit()
+    const RecognitionContext context(preset);
+    std::atomic<size_t> nextTrack(0);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < threadsCount; i++) {
+        threads.push_back(std::thread([&]() {
+            RecognitionScratch scratch;
+            for (size_t id; (id = nextTrack++) < tracks.size();) {
+                if (tracks[id].error.empty()) {
+                    recognizeTrack(context, model, scratch, tracks[id], results[id]);
+                }
+            }
+        }));
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    printf("file\texpected\trecognized\tfit\ttime_us\n");
+    int errors = 0;
+    for (size_t i = 0; i < tracks.size(); i++) {
+        const LabelledTrack &track = tracks[i];
+        if (!track.error.empty()) {
+            fprintf(stderr, "%s: %s\n", track.path.c_str(), track.error.c_str());
+            errors++;
+            continue;
+        }
+        printf("%s\t%s\t%s\t%.3f\t%.1f\n", track.path.c_str(), track.expected.c_str(),
+               results[i].recognized.c_str(), results[i].fit, results[i].time);
+    }
+    printConfusionMatrix(tracks, results);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "allocation_counter.h"
+#include "model.h"
+#include "recognition.h"
+#include "track_corpus.h"
+
+/*
+ * Replays all mouse tracks of the test corpus through recognition
+ * on models of different sizes and prints latency percentiles of each stage
+ * and allocations per stroke. Usage: Manugram [repeats]
+ */
+
+using namespace figures;
+
+// Figures of about the size of recorded tracks with the same density whatever the size is,
+// so tracks hit about the same amount of figures and only lookups get slower
+Model generateModel(size_t figuresCount) {
+    const double FIGURES_PER_SQUARE = 10;
+    const double SQUARE_SIZE = 400;
+    const double MAX_FIGURE_SIZE = 100;
+    double side = SQUARE_SIZE * sqrt(figuresCount / FIGURES_PER_SQUARE);
+
+    std::default_random_engine generator(figuresCount);
+    std::uniform_real_distribution<double> coordGen(0, side), sizeGen(-MAX_FIGURE_SIZE / 2, MAX_FIGURE_SIZE / 2);
+    std::uniform_int_distribution<int> typeGen(0, 4), curveLengthGen(3, 10);
+    auto genNear = [&](const Point &p) {
+        return p + Point(sizeGen(generator), sizeGen(generator));
+    };
+    Model model;
+    while (model.size() < figuresCount) {
+        Point a(coordGen(generator), coordGen(generator));
+        Point b = genNear(a);
+        int type = typeGen(generator);
+        if (type == 4 && model.size() + 3 > figuresCount) {
+            type = 0;
+        }
+        switch (type) {
+        case 0:
+            model.addFigure(std::make_shared<Segment>(a, b));
+            break;
+        case 1:
+            model.addFigure(std::make_shared<Ellipse>(BoundingBox({ a, b })));
+            break;
+        case 2:
+            model.addFigure(std::make_shared<Rectangle>(BoundingBox({ a, b })));
+            break;
+        case 3: {
+            std::vector<Point> points = { a };
+            for (int i = curveLengthGen(generator); i > 0; i--) {
+                points.push_back(genNear(points.back()));
+            }
+            model.addFigure(std::make_shared<Curve>(points));
+        }   break;
+        case 4: {
+            // two connected figures side by side
+            auto figA = std::make_shared<Rectangle>(BoundingBox({ a, genNear(a) }));
+            auto figB = std::make_shared<Ellipse>(BoundingBox({ b, genNear(b) }));
+            model.addFigure(figA);
+            model.addFigure(figB);
+            model.addFigure(std::make_shared<SegmentConnection>(figA, figB));
+        }   break;
+        }
+    }
+    return model;
+}
+
+double percentile(std::vector<long long> values, double p) {
+    if (values.empty()) {
+        return NAN;
+    }
+    size_t id = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + id, values.end());
+    return values[id];
+}
+
+void printRow(const char *name, const std::vector<long long> &values) {
+    if (values.empty()) {
+        printf("  %-18s %8d\n", name, 0);
+        return;
+    }
+    printf("  %-18s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, values.size(),
+           percentile(values, 0.5) / 1000, percentile(values, 0.9) / 1000,
+           percentile(values, 0.99) / 1000, *std::max_element(values.begin(), values.end()) / 1000.0);
+}
+
+void benchmark(const RecognitionContext &context, const std::vector<Track> &tracks, size_t figuresCount, int repeats) {
+    auto generationStart = std::chrono::steady_clock::now();
+    Model model = generateModel(figuresCount);
+    // the first recognition grows scratch buffers, so it is not measured
+    RecognitionScratch scratch;
+    recognizeEdit(context, tracks[0], model, scratch);
+    double generationTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - generationStart).count();
+
+    RecognitionStageTimes times;
+    scratch.stageTimes = &times;
+    const size_t STAGES_COUNT = (size_t)RecognitionStage::Count;
+    std::vector<long long> stageTimes[STAGES_COUNT], totalTimes;
+    std::vector<long long> allocations;
+    for (int repeat = 0; repeat < repeats; repeat++) {
+        for (const Track &track : tracks) {
+            size_t allocationsBefore = allocationsCount;
+            auto start = std::chrono::steady_clock::now();
+            RecognizedEdit edit = recognizeEdit(context, track, model, scratch);
+            auto end = std::chrono::steady_clock::now();
+            allocations.push_back(allocationsCount - allocationsBefore);
+            totalTimes.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+            for (size_t stage = 0; stage < STAGES_COUNT; stage++) {
+                if (times.time[stage] >= 0) {
+                    stageTimes[stage].push_back(times.time[stage]);
+                }
+            }
+        }
+    }
+
+    printf("Model of %zu figures (generated and indexed in %.2f s), %zu strokes x %d\n",
+           model.size(), generationTime, tracks.size(), repeats);
+    printf("  %-18s %8s %10s %10s %10s %10s\n", "stage", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (size_t stage = 0; stage < STAGES_COUNT; stage++) {
+        printRow(recognitionStageName((RecognitionStage)stage), stageTimes[stage]);
+    }
+    printRow("total", totalTimes);
+    long long allocationsSum = 0;
+    for (long long count : allocations) {
+        allocationsSum += count;
+    }
+    printf("  allocations per stroke: mean %.2f, p50 %.0f, max %lld\n\n",
+           allocationsSum * 1.0 / allocations.size(), percentile(allocations, 0.5),
+           *std::max_element(allocations.begin(), allocations.end()));
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = argc > 1 ? atoi(argv[1]) : 10;
+    if (repeats <= 0) {
+        fprintf(stderr, "Usage: %s [repeats]\n", argv[0]);
+        return 1;
+    }
+    std::vector<Track> tracks = loadCorpusTracks();
+    if (tracks.empty()) {
+        fprintf(stderr, "No tracks found\n");
+        return 1;
+    }
+    RecognitionContext context(RecognitionPreset::Mouse);
+    for (size_t figuresCount : { 0, 10, 1000, 100000 }) {
+        benchmark(context, tracks, figuresCount, repeats);
+    }
+    return 0;
+}
@@ -1,16 +1,17 @@
 #include "figurepainter.h"
 #include "textpainter.h"
+#include <algorithm>
 
 // ==================== STANDARD ====================
 
 std::vector<std::pair<Point, Point>> generateArrow(const Point &end, const Point &start);
 
 void FigurePainter::accept(figures::Segment &segm) {
-    painter.drawLine(scaler(segm.getA()), scaler(segm.getB()));
-    if (segm.getArrowedA()) {
+    drawLine(QLineF(scaler(segm.getA()), scaler(segm.getB())));
+    if (segm.getArrowedA() && arrowsAreVisible()) {
         drawArrow(segm.getA(), segm.getB());
     }
-    if (segm.getArrowedB()) {
+    if (segm.getArrowedB() && arrowsAreVisible()) {
         drawArrow(segm.getB(), segm.getA());
     }
     drawLabel(segm);
@@ -40,59 +41,66 @@ Point getControlPoint(Point a, Point b, Point c) {
     return b + perp * needLength;
 }
 
+// Control points of Bezier curve between points i and i + 1
+void getCurveControlPoints(const figures::Curve &fig, size_t i, Point &controlA, Point &controlB) {
+    Point a = fig.points[i], b = fig.points[i + 1];
+    controlA = b;
+    controlB = a;
+    if (i > 0 && !fig.isStop[i]) {
+        controlA = getControlPoint(fig.points[i - 1], a, b);
+    }
+    if (i + 2 < fig.points.size() && !fig.isStop[i + 1]) {
+        controlB = getControlPoint(fig.points[i + 2], b, a);
+    }
+}
+
 void FigurePainter::accept(figures::Curve &fig) {
     fig.selfCheck();
-    for (size_t i = 0; i + 1 < fig.points.size(); i++) {
-        Point a = fig.points[i], b = fig.points[i + 1];
-        if (a == b) {
-            continue;
-        }
-        Point controlA = b, controlB = a;
-        if (i > 0 && !fig.isStop[i]) {
-            controlA = getControlPoint(fig.points[i - 1], a, b);
-        }
-        if (i + 2 < fig.points.size() && !fig.isStop[i + 1]) {
-            controlB = getControlPoint(fig.points[i + 2], b, a);
-        }
-
-        QPainterPath path;
-        path.moveTo(scaler(a));
-        path.cubicTo(scaler(controlA), scaler(controlB), scaler(b));
-        painter.drawPath(path);
-        //painter.drawLine(scaler(a), scaler(b));
-        if (fig.arrowBegin[i]) {
-            for (auto segm : generateArrow(a, controlA)) {
-                painter.drawLine(scaler(segm.first), scaler(segm.second));
-            }
-        }
-        if (fig.arrowEnd[i]) {
-            for (auto segm : generateArrow(b, controlB)) {
-                painter.drawLine(scaler(segm.first), scaler(segm.second));
-            }
-        }
+    if (drawIfTiny(fig)) {
+        return;
     }
+    // zoom buckets are powers of two
+    int zoomBucket = (int)floor(log2(scaler.scaleFactor));
+    if (zoomBucket < 0) {
+        drawSimplifiedCurve(fig, zoomBucket);
+        return;
+    }
+    drawModelPath(getPaintCache(fig).path);
     drawLabel(fig);
 }
 
 void FigurePainter::accept(figures::Ellipse &fig) {
+    if (drawIfTiny(fig)) {
+        return;
+    }
     QRectF rect(scaler(fig.getBoundingBox().leftUp),
                 scaler(fig.getBoundingBox().rightDown)
                );
-    painter.drawEllipse(rect);
+    drawEllipse(rect);
     drawLabel(fig);
 }
 
 void FigurePainter::accept(figures::Rectangle &fig) {
+    if (drawIfTiny(fig)) {
+        return;
+    }
     QRectF rect(scaler(fig.getBoundingBox().leftUp),
                 scaler(fig.getBoundingBox().rightDown)
                );
-    painter.drawRect(rect);
+    drawRect(rect);
     drawLabel(fig);
 }
 
 const double ARROW_BRANCH_ANGLE = 25;
 const int ARROW_LENGTH = 12;
 
+const double TINY_FIGURE_SIZE = 2; // in pixels
+const double LOD_TOLERANCE = 0.5; // in pixels at the smallest scale of a zoom bucket
+const int MAX_BEZIER_STEPS = 64;
+const double MIN_LEGIBLE_LABEL_HEIGHT = 4; // height of a line in pixels
+const double MIN_VISIBLE_LABEL_HEIGHT = 0.5;
+const double LABEL_BAR_OPACITY = 0.3;
+
 std::vector<std::pair<Point, Point>> generateArrow(const Point &end, const Point &start) {
     std::vector<std::pair<Point, Point>> result;
     Point dir = start - end;
@@ -108,9 +116,128 @@ std::vector<std::pair<Point, Point>> generateArrow(const Point &end, const Point
     return result;
 }
 
+void FigurePainter::setColor(const QColor &color) {
+    if (color == this->color) {
+        return;
+    }
+    // figures of the previous color are drawn before the next ones
+    flush();
+    this->color = color;
+    if (!batching) {
+        QPen pen = painter.pen();
+        pen.setColor(color);
+        painter.setPen(pen);
+    }
+}
+
+void FigurePainter::flush() {
+    if (batchIsEmpty) {
+        return;
+    }
+    QPen oldPen = painter.pen();
+    QPen pen = oldPen;
+    pen.setColor(color);
+    painter.setPen(pen);
+    painter.drawLines(batch.lines);
+    painter.drawRects(batch.rects);
+    painter.drawPath(batch.outlines);
+    if (!batch.modelPaths.isEmpty()) {
+        painter.save();
+        pen.setWidthF(pen.widthF() / scaler.scaleFactor);
+        painter.setPen(pen);
+        painter.scale(scaler.scaleFactor, scaler.scaleFactor);
+        painter.translate(-scaler.zeroPoint.x, -scaler.zeroPoint.y);
+        painter.drawPath(batch.modelPaths);
+        painter.restore();
+    }
+    for (const Label &label : batch.labels) {
+        paintLabel(label);
+    }
+    painter.setPen(oldPen);
+    batch = Batch();
+    batchIsEmpty = true;
+}
+
+void FigurePainter::drawLine(const QLineF &line) {
+    if (batching) {
+        batch.lines.append(line);
+        batchIsEmpty = false;
+    } else {
+        painter.drawLine(line);
+    }
+}
+
+void FigurePainter::drawRect(const QRectF &rect) {
+    if (batching) {
+        batch.rects.append(rect);
+        batchIsEmpty = false;
+    } else {
+        painter.drawRect(rect);
+    }
+}
+
+void FigurePainter::drawEllipse(const QRectF &rect) {
+    if (batching) {
+        batch.outlines.addEllipse(rect);
+        batchIsEmpty = false;
+    } else {
+        painter.drawEllipse(rect);
+    }
+}
+
+void FigurePainter::drawPolyline(const QPolygonF &polyline) {
+    if (batching) {
+        batch.outlines.addPolygon(polyline);
+        batchIsEmpty = false;
+    } else {
+        painter.drawPolyline(polyline);
+    }
+}
+
+void FigurePainter::drawModelPath(const QPainterPath &path) {
+    if (batching) {
+        batch.modelPaths.addPath(path);
+        batchIsEmpty = false;
+        return;
+    }
+    // the path is in model coordinates, so the pen is scaled with it
+    painter.save();
+    QPen pen = painter.pen();
+    pen.setWidthF(pen.widthF() / scaler.scaleFactor);
+    painter.setPen(pen);
+    painter.scale(scaler.scaleFactor, scaler.scaleFactor);
+    painter.translate(-scaler.zeroPoint.x, -scaler.zeroPoint.y);
+    painter.drawPath(path);
+    painter.restore();
+}
+
+void FigurePainter::drawLabel(const Label &label) {
+    if (batching) {
+        batch.labels.push_back(label);
+        batchIsEmpty = false;
+    } else {
+        paintLabel(label);
+    }
+}
+
+void FigurePainter::paintLabel(const Label &label) {
+    painter.save();
+    painter.translate(label.leftUp);
+    painter.rotate(label.rotation);
+    if (label.text.isEmpty()) {
+        // nobody can read it anyway
+        QColor color = painter.pen().color();
+        color.setAlphaF(LABEL_BAR_OPACITY);
+        painter.fillRect(label.rect, color);
+    } else {
+        painter.drawText(label.rect, Qt::AlignLeft | Qt::AlignTop, label.text);
+    }
+    painter.restore();
+}
+
 void FigurePainter::drawArrow(const Point &end, const Point &start) {
     for (auto segment : generateArrow(end, start)) {
-        painter.drawLine(scaler(segment.first), scaler(segment.second));
+        drawLine(QLineF(scaler(segment.first), scaler(segment.second)));
     }
 }
 
@@ -120,11 +247,183 @@ void FigurePainter::drawLabel(Figure &figure) {
 
     TextPosition position = getTextPosition(figure);
     QRectF rect(QPointF(), QSizeF(position.width * scaler.scaleFactor, position.height * scaler.scaleFactor));
-    painter.save();
-    painter.translate(scaler(position.leftUp));
-    painter.rotate(position.rotation);
-    painter.drawText(rect, Qt::AlignLeft | Qt::AlignTop, QString::fromStdString(label));
-    painter.restore();
+    int linesCount = 1 + std::count(label.begin(), label.end(), '\n');
+    double lineHeight = rect.height() / linesCount;
+    if (lineHeight < MIN_VISIBLE_LABEL_HEIGHT) {
+        return;
+    }
+    // bars are drawn for labels which are too small to read
+    bool isLegible = lineHeight >= MIN_LEGIBLE_LABEL_HEIGHT;
+    drawLabel(Label { scaler(position.leftUp), position.rotation, rect,
+                      isLegible ? QString::fromStdString(label) : QString() });
+}
+
+bool FigurePainter::drawIfTiny(Figure &figure) {
+    BoundingBox box = figure.getBoundingBox();
+    if (std::max(box.width(), box.height()) * scaler.scaleFactor >= TINY_FIGURE_SIZE) {
+        return false;
+    }
+    drawLine(QLineF(scaler(box.leftUp), scaler(box.rightDown)));
+    drawLabel(figure);
+    return true;
+}
+
+bool FigurePainter::arrowsAreVisible() const {
+    return ARROW_LENGTH * scaler.scaleFactor >= TINY_FIGURE_SIZE;
+}
+
+double getDistanceToSegment(const Point &p, const Point &a, const Point &b) {
+    Point ab = b - a;
+    double squaredLength = Point::dotProduct(ab, ab);
+    double t = squaredLength > 0 ? Point::dotProduct(p - a, ab) / squaredLength : 0;
+    t = std::max(0.0, std::min(1.0, t));
+    return (a + ab * t - p).length();
+}
+
+// Douglas-Peucker, keeps points which are farther than tolerance from the simplified polyline
+std::vector<Point> simplifyPolyline(const std::vector<Point> &points, double tolerance) {
+    if (points.size() <= 2) {
+        return points;
+    }
+    std::vector<bool> keep(points.size(), false);
+    keep.front() = keep.back() = true;
+    std::vector<std::pair<size_t, size_t>> ranges = { { 0, points.size() - 1 } };
+    while (!ranges.empty()) {
+        size_t first = ranges.back().first, last = ranges.back().second;
+        ranges.pop_back();
+        size_t farthest = first;
+        double maxDistance = tolerance;
+        for (size_t i = first + 1; i < last; i++) {
+            double distance = getDistanceToSegment(points[i], points[first], points[last]);
+            if (distance > maxDistance) {
+                maxDistance = distance;
+                farthest = i;
+            }
+        }
+        if (farthest != first) {
+            keep[farthest] = true;
+            ranges.push_back({ first, farthest });
+            ranges.push_back({ farthest, last });
+        }
+    }
+    std::vector<Point> result;
+    for (size_t i = 0; i < points.size(); i++) {
+        if (keep[i]) {
+            result.push_back(points[i]);
+        }
+    }
+    return result;
+}
+
+Point getBezierPoint(const Point &a, const Point &controlA, const Point &controlB, const Point &b, double t) {
+    double s = 1 - t;
+    return a * (s * s * s) + controlA * (3 * s * s * t) + controlB * (3 * s * t * t) + b * (t * t * t);
+}
+
+CurvePaintCache &FigurePainter::getPaintCache(figures::Curve &fig) {
+    if (fig.paintCache.data) {
+        return *fig.paintCache.data;
+    }
+    fig.paintCache.data = std::make_shared<CurvePaintCache>();
+    QPainterPath &path = fig.paintCache.data->path;
+    // every segment is a subpath of its own, so there are no joins between them, as when they were drawn one by one
+    for (size_t i = 0; i + 1 < fig.points.size(); i++) {
+        Point a = fig.points[i], b = fig.points[i + 1];
+        if (a == b) {
+            continue;
+        }
+        Point controlA, controlB;
+        getCurveControlPoints(fig, i, controlA, controlB);
+        path.moveTo(a.x, a.y);
+        path.cubicTo(controlA.x, controlA.y, controlB.x, controlB.y, b.x, b.y);
+    }
+    for (size_t i = 0; i + 1 < fig.points.size(); i++) {
+        if ((!fig.arrowBegin[i] && !fig.arrowEnd[i]) || fig.points[i] == fig.points[i + 1]) {
+            continue;
+        }
+        Point controlA, controlB;
+        getCurveControlPoints(fig, i, controlA, controlB);
+        std::vector<std::pair<Point, Point>> arrows;
+        if (fig.arrowBegin[i]) {
+            arrows = generateArrow(fig.points[i], controlA);
+        }
+        if (fig.arrowEnd[i]) {
+            for (auto segm : generateArrow(fig.points[i + 1], controlB)) {
+                arrows.push_back(segm);
+            }
+        }
+        for (auto segm : arrows) {
+            path.moveTo(segm.first.x, segm.first.y);
+            path.lineTo(segm.second.x, segm.second.y);
+        }
+    }
+    return *fig.paintCache.data;
+}
+
+void FigurePainter::drawSimplifiedCurve(figures::Curve &fig, int zoomBucket) {
+    std::vector<Point> &simplified = getPaintCache(fig).simplified[zoomBucket];
+    if (simplified.empty()) {
+        // scale of the bucket is the smallest one, so the tolerance is kept for all of its scales
+        double tolerance = LOD_TOLERANCE / exp2(zoomBucket);
+        std::vector<Point> flattened = { fig.points[0] };
+        for (size_t i = 0; i + 1 < fig.points.size(); i++) {
+            Point a = fig.points[i], b = fig.points[i + 1];
+            if (a == b) {
+                continue;
+            }
+            Point controlA, controlB;
+            getCurveControlPoints(fig, i, controlA, controlB);
+            // a cubic curve deviates from its chords by about length / (8 * steps^2),
+            // which is kept below a quarter of the tolerance
+            double length = (controlA - a).length() + (controlB - controlA).length() + (b - controlB).length();
+            int steps = std::min(MAX_BEZIER_STEPS, 1 + (int)sqrt(length / (2 * tolerance)));
+            for (int step = 1; step <= steps; step++) {
+                flattened.push_back(getBezierPoint(a, controlA, controlB, b, step * 1.0 / steps));
+            }
+        }
+        simplified = simplifyPolyline(flattened, tolerance);
+    }
+
+    QPolygonF polyline;
+    for (const Point &p : simplified) {
+        polyline.append(scaler(p));
+    }
+    drawPolyline(polyline);
+    if (arrowsAreVisible()) {
+        for (size_t i = 0; i + 1 < fig.points.size(); i++) {
+            if (!fig.arrowBegin[i] && !fig.arrowEnd[i]) {
+                continue;
+            }
+            Point controlA, controlB;
+            getCurveControlPoints(fig, i, controlA, controlB);
+            if (fig.arrowBegin[i]) {
+                drawArrow(fig.points[i], controlA);
+            }
+            if (fig.arrowEnd[i]) {
+                drawArrow(fig.points[i + 1], controlB);
+            }
+        }
+    }
+    drawLabel(fig);
+}
+
+BoundingBox getPaintedBoundingBox(Figure &figure) {
+    BoundingBox box = figure.getBoundingBox();
+    // arrows and the pen stick out of the box
+    double gap = ARROW_LENGTH + 1;
+    // control points of a curve segment are a quarter of its length away from its ends at most,
+    // so its Bezier curve is too
+    if (dynamic_cast<figures::Curve*>(&figure)) {
+        gap += 0.25 * hypot(box.width(), box.height());
+    }
+    box.leftUp = box.leftUp - Point(gap, gap);
+    box.rightDown = box.rightDown + Point(gap, gap);
+    if (!figure.label().empty()) {
+        BoundingBox text = getBoundingBox(getTextPosition(figure));
+        box.addPoint(text.leftUp);
+        box.addPoint(text.rightDown);
+    }
+    return box;
 }
 
 // ==================== SVG ====================
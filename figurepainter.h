@@ -6,6 +6,8 @@
 #include <QFile>
 #include <QVector2D>
 #include <cmath>
+#include <map>
+#include <vector>
 
 struct Scaler {
     Scaler(
@@ -33,16 +35,41 @@ struct Scaler {
     double scaleFactor;
 };
 
+struct CurvePaintCache {
+    // Bezier curves and arrows in model coordinates
+    QPainterPath path;
+    // Polylines along the curve simplified for zoom buckets (see FigurePainter), in model coordinates
+    std::map<int, std::vector<Point>> simplified;
+};
+
+// Box of everything FigurePainter draws for the figure (labels and arrows included), may be larger
+BoundingBox getPaintedBoundingBox(Figure &figure);
+
+/*
+ * Draws figures with the pen of the painter in the current color.
+ * In batching mode primitives of consecutive figures of the same color are collected and drawn
+ * with a few QPainter calls when the color changes, by flush() or by the destructor.
+ * So figures of different colors are drawn in their order as without batching.
+ */
 class FigurePainter : public FigureVisitor {
 public:
     FigurePainter(
         QPainter &painter,
-        const Scaler &scaler = Scaler()
+        const Scaler &scaler = Scaler(),
+        bool batching = false
     )
         : painter(painter)
         , scaler(scaler)
+        , batching(batching)
+        , color(painter.pen().color())
+        , batchIsEmpty(true)
     {}
-    virtual ~FigurePainter() {}
+    virtual ~FigurePainter() {
+        flush();
+    }
+
+    void setColor(const QColor &color);
+    void flush();
 
     virtual void accept(figures::Segment &segm) override;
     virtual void accept(figures::SegmentConnection &segm) override;
@@ -54,8 +81,43 @@ private:
     QPainter &painter;
     Scaler scaler;
 
+    struct Label {
+        QPointF leftUp;
+        double rotation;
+        QRectF rect;
+        QString text; // a bar is drawn if it is empty
+    };
+    struct Batch {
+        QVector<QLineF> lines;
+        QVector<QRectF> rects;
+        QPainterPath outlines; // ellipses and polylines
+        QPainterPath modelPaths; // curves in model coordinates
+        std::vector<Label> labels;
+    };
+    bool batching;
+    QColor color;
+    // of the current color
+    Batch batch;
+    bool batchIsEmpty;
+
+    // Draw or add to the batch
+    void drawLine(const QLineF &line);
+    void drawRect(const QRectF &rect);
+    void drawEllipse(const QRectF &rect);
+    void drawPolyline(const QPolygonF &polyline);
+    void drawModelPath(const QPainterPath &path);
+    void drawLabel(const Label &label);
+    void paintLabel(const Label &label);
+
     void drawArrow(const Point &end, const Point &start);
     void drawLabel(Figure &figure);
+
+    // Level of detail: figures which are a few pixels large are drawn as a single line,
+    // curves are simplified when zoomed out, small labels are drawn as bars or skipped
+    bool drawIfTiny(Figure &figure);
+    bool arrowsAreVisible() const;
+    void drawSimplifiedCurve(figures::Curve &fig, int zoomBucket);
+    CurvePaintCache &getPaintCache(figures::Curve &fig);
 };
 
 class FigureSvgPainter : public FigureVisitor {
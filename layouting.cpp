@@ -11,10 +11,11 @@ void GridAlignLayouter::alignPoint(Point &p) {
     p.y = round(p.y / gridStep) * gridStep;
 }
 
-void GridAlignLayouter::updateLayout(Model &, PFigure changed) {
-    if (!changed) {
+void GridAlignLayouter::updateLayout(Model &model, PFigure changed) {
+    if (!changed || model.find(changed) == model.end()) {
         return;
     }
+    changed = model.modify(changed);
     if (auto boundedFigure = dynamic_pointer_cast<BoundedFigure>(changed)) {
         BoundingBox box = boundedFigure->getBoundingBox();
         alignPoint(box.leftUp);
@@ -25,6 +26,7 @@ void GridAlignLayouter::updateLayout(Model &, PFigure changed) {
         for (Point &p : curve->points) {
             alignPoint(p);
         }
+        curve->resetPaintCache();
     }
     if (typeid(*changed) == typeid(figures::Segment)) {
         auto segment = dynamic_pointer_cast<Segment>(changed);
@@ -35,4 +37,5 @@ void GridAlignLayouter::updateLayout(Model &, PFigure changed) {
         segment->setA(a);
         segment->setB(b);
     }
+    model.updateFigure(changed);
 }
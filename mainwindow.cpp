@@ -5,6 +5,7 @@
 #include "figurepainter.h"
 #include "build_info.h"
 #include "recognition.h"
+#include "tracing.h"
 #include <sstream>
 #include <QByteArray>
 #include <QFileDialog>
@@ -30,6 +31,8 @@ MainWindow::MainWindow(QWidget *parent) :
         openFile(QApplication::arguments()[i]);
     }
     connect(QApplication::clipboard(), &QClipboard::changed, this, &MainWindow::clipboard_changed);
+    ui->actionRecordTrace->setEnabled(tracing::isAvailable());
+    ui->actionRecordTrace->setChecked(tracing::isRecording());
 }
 
 MainWindow::~MainWindow() {
@@ -66,6 +69,7 @@ void MainWindow::setModelWidget(Ui::ModelWidget *newWidget) {
     });
     modelWidget->setGridStep(ui->actionShowGrid->isChecked() ? defaultGridStep : 0);
     modelWidget->setStoreTracks(ui->actionStoreTracks->isChecked());
+    on_actionSmoothTracks_triggered();
 
     QScreen *screen = QApplication::screens().at(0);
     modelWidget->setScaleFactor(screen->logicalDotsPerInch() / 96.0);
@@ -97,7 +101,7 @@ void MainWindow::openFile(const QString &filename) {
         try {
             Track track;
             data >> track;
-            recognize(track, this->modelWidget->getModel());
+            recognize(modelWidget->recognitionContext(), track, modelWidget->getModel());
             modelWidget->addModelExtraTrack(std::move(track));
         } catch (model_format_error &e) {
             QMessageBox::critical(this, "Error while opening track", e.what());
@@ -235,6 +239,35 @@ void MainWindow::on_actionStoreTracks_triggered() {
     modelWidget->setStoreTracks(ui->actionStoreTracks->isChecked());
 }
 
+void MainWindow::on_actionSmoothTracks_triggered() {
+    TrackFilterSettings settings = modelWidget->trackFilterSettings();
+    settings.smoothJitter = ui->actionSmoothTracks->isChecked();
+    modelWidget->setTrackFilterSettings(settings);
+}
+
+void MainWindow::on_actionRecordTrace_triggered() {
+    if (ui->actionRecordTrace->isChecked()) {
+        tracing::start();
+        return;
+    }
+    tracing::stop();
+    QString selectedFilter;
+    QString filename = QFileDialog::getSaveFileName(
+                           this,
+                           "Select file to save trace in",
+                           "",
+                           "Chrome trace (*.json)",
+                           &selectedFilter
+                       );
+    if (filename == "") {
+        return;
+    }
+    filename = forceFileExtension(filename, selectedFilter);
+    if (!tracing::writeTrace(filename.toStdString())) {
+        QMessageBox::critical(this, "Unable to save trace", "Cannot write data to file");
+    }
+}
+
 void MainWindow::on_actionCopy_triggered() {
     QMimeData *data = modelWidget->selectedMimeData();
     if (data) {
@@ -43,6 +43,8 @@ private slots:
     void on_actionExit_triggered();
     void on_actionAbout_triggered();
     void on_actionStoreTracks_triggered();
+    void on_actionSmoothTracks_triggered();
+    void on_actionRecordTrace_triggered();
     void on_actionCopy_triggered();
     void on_actionPaste_triggered();
 
@@ -4,50 +4,114 @@
 #include <map>
 
 #ifndef QT_NO_DEBUG
-size_t Figure::_figuresAlive = 0;
+std::atomic<size_t> Figure::_figuresAlive(0);
 #endif
 
 using std::pair;
 using std::make_pair;
 
+// Squared lengths are compared, which is the same as comparing lengths but without square roots
 void relaxNearestPoint(Point &res, const Point &a, const Point &p) {
-    double old = (res - p).length();
-    double cur = (a - p).length();
+    double old = (res - p).lengthSquared();
+    double cur = (a - p).lengthSquared();
     if (cur < old) {
         res = a;
     }
 }
 
+namespace {
+bool isFailed(double x, double y, double failDistanceX, double failDistanceY, double nearestX, double nearestY) {
+    return fabs(x - nearestX) > failDistanceX || fabs(y - nearestY) > failDistanceY;
+}
+
+// Number of points up to the first failed one inclusive
+size_t getProcessedCount(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, const double *nearestX, const double *nearestY) {
+    for (size_t i = 0; i < count; i++) {
+        if (isFailed(x[i], y[i], failDistanceX, failDistanceY, nearestX[i], nearestY[i])) {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+// Figures which calculate nearest points without branches do it by blocks of this size and check fail distances after each block
+const size_t NEAREST_POINTS_BLOCK_SIZE = 16;
+}
+
+size_t Figure::getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) {
+    for (size_t i = 0; i < count; i++) {
+        Point nearest = getApproximateNearestPointOnBorder(Point(x[i], y[i]));
+        nearestX[i] = nearest.x;
+        nearestY[i] = nearest.y;
+        if (isFailed(x[i], y[i], failDistanceX, failDistanceY, nearestX[i], nearestY[i])) {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+namespace {
+// Normalized equation A*x + B*y + C = 0 of the line through a segment, calculated once for many points
+struct SegmentLine {
+    Point a, b;
+    double A, B, C;
+    bool degenerate;
+
+    SegmentLine(const Point &a, const Point &b) : a(a), b(b) {
+        A = b.y - a.y;
+        B = a.x - b.x;
+        C = -A * a.x - B * a.y;
+
+        double D = sqrt(A * A + B * B);
+        degenerate = fabs(D) < 1e-8;
+        if (!degenerate) {
+            A /= D; B /= D; C /= D;
+        }
+    }
+
+    Point getNearestOnLine(const Point &p) const {
+        if (degenerate) { return Point(HUGE_VAL, HUGE_VAL); }
+        double dist = A * p.x + B * p.y + C;
+        Point res = p - Point(A, B) * dist;
+        assert(fabs(A * res.x + B * res.y + C) < 1e-6);
+        return res;
+    }
+
+    Point getNearestOnSegment(const Point &p) const {
+        Point res = a;
+        relaxNearestPoint(res, b, p);
+        // Please note that here we do not care about floatint-point error,
+        // as if 'start' falls near 'a' or 'b', we've already calculated it
+        if (Point::dotProduct(p - a, b - a) >= 0
+                && Point::dotProduct(p - b, a - b) >= 0) {
+            relaxNearestPoint(res, getNearestOnLine(p), p);
+        }
+        return res;
+    }
+};
+}
+
 Point figures::Segment::getApproximateNearestPointOnBorder(const Point &p) {
-    Point res = a;
-    relaxNearestPoint(res, b, p);
-    // Please note that here we do not care about floatint-point error,
-    // as if 'start' falls near 'a' or 'b', we've already calculated it
-    if (Point::dotProduct(p - a, b - a) >= 0
-            && Point::dotProduct(p - b, a - b) >= 0) {
-        relaxNearestPoint(res, getNearestOnLine(p), p);
+    return SegmentLine(a, b).getNearestOnSegment(p);
+}
+size_t figures::Segment::getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) {
+    SegmentLine line(a, b);
+    for (size_t i = 0; i < count; i++) {
+        Point nearest = line.getNearestOnSegment(Point(x[i], y[i]));
+        nearestX[i] = nearest.x;
+        nearestY[i] = nearest.y;
+        if (isFailed(x[i], y[i], failDistanceX, failDistanceY, nearestX[i], nearestY[i])) {
+            return i + 1;
+        }
     }
-    return res;
+    return count;
 }
 bool figures::Segment::isInsideOrOnBorder(const Point &p) {
     return getApproximateDistanceToBorder(p) < 1e-8;
 }
 
 Point figures::Segment::getNearestOnLine(const Point &p) {
-    // Coefficients of A*x + B*y + C = 0
-    double A = b.y - a.y;
-    double B = a.x - b.x;
-    double C = -A * a.x - B * a.y;
-
-    // normalization of the equation
-    double D = sqrt(A * A + B * B);
-    if (fabs(D) < 1e-8) { return Point(HUGE_VAL, HUGE_VAL); } // degenerate case
-
-    A /= D; B /= D; C /= D;
-    double dist = A * p.x + B * p.y + C;
-    Point res = p - Point(A, B) * dist;
-    assert(fabs(A * res.x + B * res.y + C) < 1e-6);
-    return res;
+    return SegmentLine(a, b).getNearestOnLine(p);
 }
 
 BoundingBox figures::Curve::getBoundingBox() const {
@@ -62,6 +126,7 @@ void figures::Curve::translate(const Point &diff) {
     for (Point &p : points) {
         p += diff;
     }
+    resetPaintCache();
 }
 
 std::string figures::Curve::str() const {
@@ -91,10 +156,27 @@ bool figures::Curve::isInsideOrOnBorder(const Point &p) {
 Point figures::Curve::getApproximateNearestPointOnBorder(const Point &p) {
     Point result(INFINITY, INFINITY);
     for (size_t i = 0; i + 1 < points.size(); i++) {
-        relaxNearestPoint(result, Segment(points[i], points[i + 1]).getApproximateNearestPointOnBorder(p), p);
+        relaxNearestPoint(result, SegmentLine(points[i], points[i + 1]).getNearestOnSegment(p), p);
     }
     return result;
 }
+// Segments are iterated in the outer loop, so each line equation is calculated once,
+// and fail distances can be checked only after all segments
+size_t figures::Curve::getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) {
+    std::fill(nearestX, nearestX + count, INFINITY);
+    std::fill(nearestY, nearestY + count, INFINITY);
+    for (size_t i = 0; i + 1 < points.size(); i++) {
+        SegmentLine line(points[i], points[i + 1]);
+        for (size_t j = 0; j < count; j++) {
+            Point p(x[j], y[j]);
+            Point result(nearestX[j], nearestY[j]);
+            relaxNearestPoint(result, line.getNearestOnSegment(p), p);
+            nearestX[j] = result.x;
+            nearestY[j] = result.y;
+        }
+    }
+    return getProcessedCount(x, y, count, failDistanceX, failDistanceY, nearestX, nearestY);
+}
 
 
 bool figures::Rectangle::isInsideOrOnBorder(const Point &p) {
@@ -102,26 +184,51 @@ bool figures::Rectangle::isInsideOrOnBorder(const Point &p) {
            box.leftUp.y - 1e-8 <= p.y && p.y <= box.rightDown.y + 1e-8;
 }
 
+namespace {
+// A point outside of the box is clamped to it, a point inside is moved to the nearest side,
+// the first one of top, bottom, left and right on ties. Selects only, so loops over points may be vectorized
+void getNearestOnBoxBorder(const BoundingBox &box, double x, double y, double &nearestX, double &nearestY) {
+    const double left = box.leftUp.x, top = box.leftUp.y, right = box.rightDown.x, bottom = box.rightDown.y;
+    double clampedX = std::min(std::max(x, left), right);
+    double clampedY = std::min(std::max(y, top), bottom);
+
+    // squared distances are compared as in relaxNearestPoint()
+    double toTop = (y - top) * (y - top), toBottom = (bottom - y) * (bottom - y);
+    double toLeft = (x - left) * (x - left), toRight = (right - x) * (right - x);
+    double best = toTop;
+    bool isBottom = toBottom < best;
+    best = isBottom ? toBottom : best;
+    bool isLeft = toLeft < best;
+    best = isLeft ? toLeft : best;
+    bool isRight = toRight < best;
+    bool isVertical = isLeft || isRight;
+    double sideX = isRight ? right : (isLeft ? left : x);
+    double sideY = isVertical ? y : (isBottom ? bottom : top);
+
+    bool inside = clampedX == x && clampedY == y;
+    nearestX = inside ? sideX : clampedX;
+    nearestY = inside ? sideY : clampedY;
+}
+}
+
 Point figures::Rectangle::getApproximateNearestPointOnBorder(const Point &p) {
-    bool inX = box.leftUp.x <= p.x && p.x <= box.rightDown.x;
-    bool inY = box.leftUp.y <= p.y && p.y <= box.rightDown.y;
-    Point res(HUGE_VAL, HUGE_VAL);
-    if (inX) { // Point lies in a vertical bar bounded by Left and Right
-        relaxNearestPoint(res, Point(p.x, box.leftUp.y), p);
-        relaxNearestPoint(res, Point(p.x, box.rightDown.y), p);
-    }
-    if (inY) { // Point lies in a horizontal bar
-        relaxNearestPoint(res, Point(box.leftUp.x, p.y), p);
-        relaxNearestPoint(res, Point(box.rightDown.x, p.y), p);
-    }
-    if (!inX && !inY) {
-        relaxNearestPoint(res, box.leftUp, p);
-        relaxNearestPoint(res, box.rightDown, p);
-        relaxNearestPoint(res, box.leftDown(), p);
-        relaxNearestPoint(res, box.rightUp(), p);
-    }
+    Point res;
+    getNearestOnBoxBorder(box, p.x, p.y, res.x, res.y);
     return res;
 }
+size_t figures::Rectangle::getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) {
+    for (size_t start = 0; start < count; start += NEAREST_POINTS_BLOCK_SIZE) {
+        size_t end = std::min(count, start + NEAREST_POINTS_BLOCK_SIZE);
+        for (size_t i = start; i < end; i++) {
+            getNearestOnBoxBorder(box, x[i], y[i], nearestX[i], nearestY[i]);
+        }
+        size_t processed = getProcessedCount(x + start, y + start, end - start, failDistanceX, failDistanceY, nearestX + start, nearestY + start);
+        if (processed < end - start) {
+            return start + processed;
+        }
+    }
+    return count;
+}
 
 bool figures::Ellipse::isInsideOrOnBorder(const Point &_p) {
     Point p = _p - box.center();
@@ -152,6 +259,35 @@ Point figures::Ellipse::getApproximateNearestPointOnBorder(const Point &_p) {
     res = res + box.center();
     return res;
 }
+// Same calculations as above without branches for common case, so the loop may be vectorized
+size_t figures::Ellipse::getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) {
+    const Point center = box.center();
+    const double a = box.width() / 2;
+    const double b = box.height() / 2;
+    for (size_t start = 0; start < count; start += NEAREST_POINTS_BLOCK_SIZE) {
+        size_t end = std::min(count, start + NEAREST_POINTS_BLOCK_SIZE);
+        for (size_t i = start; i < end; i++) {
+            double px = x[i] - center.x, py = y[i] - center.y;
+            double rx = px / a, ry = py / b;
+            double d = sqrt(rx * rx + ry * ry);
+            nearestX[i] = rx / d * a + center.x;
+            nearestY[i] = ry / d * b + center.y;
+        }
+        // points near the center are rare
+        for (size_t i = start; i < end; i++) {
+            if (Point(x[i] - center.x, y[i] - center.y).length() <= 1e-7) {
+                Point nearest = Ellipse::getApproximateNearestPointOnBorder(Point(x[i], y[i]));
+                nearestX[i] = nearest.x;
+                nearestY[i] = nearest.y;
+            }
+        }
+        size_t processed = getProcessedCount(x + start, y + start, end - start, failDistanceX, failDistanceY, nearestX + start, nearestY + start);
+        if (processed < end - start) {
+            return start + processed;
+        }
+    }
+    return count;
+}
 
 /*
  * Consider a segment from figure's center to point b
@@ -253,6 +389,299 @@ private:
     PFigure result;
 };
 
+size_t Model::nextVersion() {
+    static std::atomic<size_t> lastVersion(0);
+    return ++lastVersion;
+}
+
+size_t Model::nextGeneration() {
+    static std::atomic<size_t> lastGeneration(0);
+    return ++lastGeneration;
+}
+
+Model Model::snapshot() {
+    Model result;
+    result._figures = _figures;
+    result._entries = _entries;
+    result._dependents = _dependents;
+    result._index = _index;
+    result._nextSerial = _nextSerial;
+    result._version = _version;
+    result.selectedFigure = selectedFigure;
+    // all figures which are present now become shared, the snapshot has a new generation already
+    _generation = nextGeneration();
+    return result;
+}
+
+void Model::addToIndices(const PFigure &figure, size_t generation, size_t serial) {
+    for (PFigure dependency : figure->getDependencies()) {
+        addDependent(dependency, figure);
+    }
+    _figures.set(serial, figure);
+    _index.insert(figure, serial);
+    _entries.set(figure.get(), Entry { serial, generation });
+}
+
+// Dependents of the figure are left untouched
+void Model::removeFromIndices(const PFigure &figure) {
+    const Entry *entry = _entries.get(figure.get());
+    assert(entry);
+    _figures.erase(entry->serial);
+    _entries.erase(figure.get());
+    _index.erase(figure);
+
+    for (PFigure dependency : figure->getDependencies()) {
+        removeDependent(dependency, figure);
+    }
+}
+
+void Model::addDependent(const PFigure &dependency, const PFigure &figure) {
+    const FigureSet *dependents = _dependents.get(dependency.get());
+    FigureSet changed = dependents ? *dependents : FigureSet();
+    changed.set(figure.get(), figure);
+    _dependents.set(dependency.get(), changed);
+}
+
+void Model::removeDependent(const PFigure &dependency, const PFigure &figure) {
+    // dependency may be already replaced or removed itself
+    const FigureSet *dependents = _dependents.get(dependency.get());
+    if (!dependents) {
+        return;
+    }
+    FigureSet changed = *dependents;
+    changed.erase(figure.get());
+    if (changed.empty()) {
+        _dependents.erase(dependency.get());
+    } else {
+        _dependents.set(dependency.get(), changed);
+    }
+}
+
+Model::iterator Model::addFigure(PFigure a) {
+    _version = nextVersion();
+    size_t serial = _nextSerial++;
+    addToIndices(a, _generation, serial);
+    record(ModelChange::Kind::Added, a, nullptr, serial);
+    return iterator(_figures.find(serial));
+}
+
+void Model::removeFigure(iterator it) {
+    _version = nextVersion();
+    std::vector<PFigure> toRemove { *it };
+    while (!toRemove.empty()) {
+        PFigure current = toRemove.back();
+        toRemove.pop_back();
+
+        const Entry *entry = _entries.get(current.get());
+        if (!entry) { continue; } // already removed
+        record(ModelChange::Kind::Removed, current, nullptr, entry->serial);
+        removeFromIndices(current);
+
+        const FigureSet *dependents = _dependents.get(current.get());
+        if (dependents) {
+            for (const auto &dependent : *dependents) {
+                toRemove.push_back(dependent.second);
+            }
+            _dependents.erase(current.get());
+        }
+        if (current == selectedFigure) {
+            selectedFigure.reset();
+        }
+    }
+}
+
+PFigure Model::modify(const PFigure &figure) {
+    // the figure is going to be changed in place even if it is not copied
+    _version = nextVersion();
+    const Entry *entry = _entries.get(figure.get());
+    assert(entry);
+    if (entry->generation == _generation) {
+        return figure;
+    }
+    std::map<PFigure, PFigure> mapping;
+    for (PFigure dependency : figure->getDependencies()) {
+        mapping[dependency] = dependency;
+    }
+    PFigure result = clone(figure, mapping);
+    replaceFigure(figure, result);
+    return result;
+}
+
+/*
+ * Puts newFigure in place of oldFigure. Dependents of oldFigure
+ * reference it directly, so they are replaced with their copies too.
+ */
+void Model::replaceFigure(PFigure oldFigure, PFigure newFigure) {
+    replaceRaw(oldFigure, newFigure);
+    Entry entry = *_entries.get(newFigure.get());
+    entry.generation = _generation;
+    _entries.set(newFigure.get(), entry);
+    record(ModelChange::Kind::Replaced, oldFigure, newFigure, entry.serial);
+    if (selectedFigure == oldFigure) {
+        selectedFigure = newFigure;
+    }
+
+    const FigureSet *dependents = _dependents.get(oldFigure.get());
+    if (!dependents) { return; }
+    FigureSet oldDependents = *dependents;
+    _dependents.erase(oldFigure.get());
+
+    for (const auto &item : oldDependents) {
+        const PFigure &dependent = item.second;
+        std::map<PFigure, PFigure> mapping;
+        for (PFigure dependency : dependent->getDependencies()) {
+            mapping[dependency] = dependency == oldFigure ? newFigure : dependency;
+        }
+        replaceFigure(dependent, clone(dependent, mapping));
+    }
+}
+
+void Model::updateFigure(const PFigure &figure) {
+    _version = nextVersion();
+    figure->recalculate();
+    _index.update(figure);
+    const FigureSet *dependents = _dependents.get(figure.get());
+    if (dependents) {
+        // dependents are never older than the figure, so they are owned by the model too
+        for (const auto &dependent : *dependents) {
+            dependent.second->recalculate();
+            _index.update(dependent.second);
+        }
+    }
+}
+
+void Model::recalculate() {
+    // figures are replaced while iterating, so their current versions are looked up by serials
+    FigureMap figures = _figures;
+    for (const auto &item : figures) {
+        PFigure figure = *_figures.get(item.first);
+        if (!figure->getDependencies().empty()) {
+            updateFigure(modify(figure));
+        }
+    }
+}
+
+std::vector<PFigure> Model::getDependents(const PFigure &figure) const {
+    std::vector<PFigure> result;
+    const FigureSet *dependents = _dependents.get(figure.get());
+    if (dependents) {
+        for (const auto &dependent : *dependents) {
+            result.push_back(dependent.second);
+        }
+    }
+    return result;
+}
+
+void Model::record(ModelChange::Kind kind, const PFigure &figure, const PFigure &other, size_t serial) {
+    if (_recording) {
+        _recording->operations.push_back(ModelChange::Operation { kind, figure, other, serial });
+    }
+}
+
+void Model::beginRecording() {
+    assert(!_recording);
+    _recording.reset(new ModelChange());
+    _recording->selectedBefore = selectedFigure;
+    // figures referenced by the change should never be modified in place
+    _generation = nextGeneration();
+}
+
+ModelChange Model::endRecording() {
+    assert(_recording);
+    ModelChange result = std::move(*_recording);
+    _recording.reset();
+    result.selectedAfter = selectedFigure;
+    _generation = nextGeneration();
+    return result;
+}
+
+void Model::insertRaw(const PFigure &figure, size_t serial) {
+    addToIndices(figure, SHARED_GENERATION, serial);
+}
+
+void Model::eraseRaw(const PFigure &figure) {
+    removeFromIndices(figure);
+}
+
+void Model::replaceRaw(PFigure oldFigure, PFigure newFigure) {
+    const Entry *oldEntry = _entries.get(oldFigure.get());
+    assert(oldEntry);
+    Entry entry = *oldEntry;
+    _entries.erase(oldFigure.get());
+    entry.generation = SHARED_GENERATION;
+    _entries.set(newFigure.get(), entry);
+    _figures.set(entry.serial, newFigure);
+    _index.replace(oldFigure, newFigure);
+
+    for (PFigure dependency : oldFigure->getDependencies()) {
+        removeDependent(dependency, oldFigure);
+    }
+    for (PFigure dependency : newFigure->getDependencies()) {
+        addDependent(dependency, newFigure);
+    }
+}
+
+void Model::undo(const ModelChange &change) {
+    assert(!_recording);
+    _version = nextVersion();
+    for (auto it = change.operations.rbegin(); it != change.operations.rend(); it++) {
+        switch (it->kind) {
+        case ModelChange::Kind::Added:
+            eraseRaw(it->figure);
+            break;
+        case ModelChange::Kind::Removed:
+            insertRaw(it->figure, it->serial);
+            break;
+        case ModelChange::Kind::Replaced:
+            replaceRaw(it->other, it->figure);
+            break;
+        }
+    }
+    selectedFigure = change.selectedBefore;
+}
+
+void Model::redo(const ModelChange &change) {
+    assert(!_recording);
+    _version = nextVersion();
+    for (const ModelChange::Operation &op : change.operations) {
+        switch (op.kind) {
+        case ModelChange::Kind::Added:
+            insertRaw(op.figure, op.serial);
+            break;
+        case ModelChange::Kind::Removed:
+            eraseRaw(op.figure);
+            break;
+        case ModelChange::Kind::Replaced:
+            replaceRaw(op.figure, op.other);
+            break;
+        }
+    }
+    selectedFigure = change.selectedAfter;
+}
+
+size_t getMemoryUsage(const PFigure &figure) {
+    if (!figure) {
+        return 0;
+    }
+    size_t result = sizeof(figures::SegmentConnection) + figure->label().capacity();
+    if (auto curve = std::dynamic_pointer_cast<figures::Curve>(figure)) {
+        result += curve->points.capacity() * sizeof(Point);
+        result += (curve->arrowBegin.capacity() + curve->arrowEnd.capacity() + curve->isStop.capacity()) / 8;
+    }
+    return result;
+}
+
+size_t ModelChange::memoryUsage() const {
+    size_t result = sizeof(ModelChange) + operations.capacity() * sizeof(Operation);
+    for (const Operation &op : operations) {
+        // figures which are not removed are shared with the model itself
+        if (op.kind == Kind::Removed || op.kind == Kind::Replaced) {
+            result += getMemoryUsage(op.figure);
+        }
+    }
+    return result;
+}
+
 PFigure clone(PFigure figure, const std::map<PFigure, PFigure> &othersMapping) {
     CloningVisitor visitor(othersMapping);
     figure->visit(visitor);
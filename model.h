@@ -10,8 +10,12 @@
 #include <map>
 #include <stdexcept>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include <cmath>
 #include <cassert>
+#include <atomic>
+#include "model_index.h"
 
 const double PI = atan(1.0) * 4;
 struct Point {
@@ -78,6 +82,11 @@ struct BoundingBox {
     bool operator==(const BoundingBox &other) const {
         return leftUp == other.leftUp && rightDown == other.rightDown;
     }
+    // Touching boxes intersect too
+    bool intersects(const BoundingBox &other) const {
+        return leftUp.x <= other.rightDown.x && other.leftUp.x <= rightDown.x
+            && leftUp.y <= other.rightDown.y && other.leftUp.y <= rightDown.y;
+    }
 
     Point rightUp()  const { return Point(rightDown.x, leftUp.y); }
     Point leftDown() const { return Point(leftUp.x, rightDown.y); }
@@ -107,9 +116,17 @@ public:
     virtual void visit(FigureVisitor &) = 0;
     virtual bool isInsideOrOnBorder(const Point &p) = 0;
     virtual Point getApproximateNearestPointOnBorder(const Point &p) = 0;
+    // Same as getApproximateNearestPointOnBorder() for 'count' points given by coordinates,
+    // figures override it to avoid a virtual call and repeated calculations for every point.
+    // A point is failed if its nearest point is further than failDistanceX or failDistanceY by the coordinate,
+    // figures may stop after the first failed point. Returns the number of calculated points,
+    // it is less than 'count' only if the last calculated point is failed
+    virtual size_t getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY);
     double getApproximateDistanceToBorder(const Point &p) { return (p - getApproximateNearestPointOnBorder(p)).length(); }
     virtual void recalculate() {}
     virtual bool dependsOn(const PFigure &) { return false; }
+    // Figures which should be deleted together with this one, see Model::removeFigure
+    virtual std::vector<PFigure> getDependencies() const { return {}; }
     std::string label() const {
         return _label;
     }
@@ -123,11 +140,15 @@ protected:
     std::string _label;
 #ifndef QT_NO_DEBUG
 private:
-    static size_t _figuresAlive;
+    // figures may be created and destroyed by background recognition
+    static std::atomic<size_t> _figuresAlive;
 #endif
 };
 PFigure clone(PFigure figure, const std::map<PFigure, PFigure> &othersMapping);
 
+// Defined by painters, see figures::Curve::PaintCache
+struct CurvePaintCache;
+
 namespace figures {
 class Segment;
 class SegmentConnection;
@@ -186,6 +207,7 @@ public:
 
     bool isInsideOrOnBorder(const Point &p) override;
     Point getApproximateNearestPointOnBorder(const Point &p) override;
+    size_t getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) override;
 
 protected:
     Segment() : arrowedA(false), arrowedB(false) {}
@@ -196,17 +218,35 @@ protected:
 };
 class Curve : public Figure {
 public:
-    Curve(const std::vector<Point> _points) : points(_points), arrowBegin(std::max(1u, points.size()) - 1), arrowEnd(std::max(1u, points.size()) - 1), isStop(points.size()) {}
+    Curve(const std::vector<Point> &_points) : points(_points), arrowBegin(std::max(1u, points.size()) - 1), arrowEnd(std::max(1u, points.size()) - 1), isStop(points.size()) {}
     virtual BoundingBox getBoundingBox() const override;
     virtual void translate(const Point &diff) override;
     virtual std::string str() const override;
     virtual void visit(FigureVisitor &v) override { v.accept(*this); }
     virtual bool isInsideOrOnBorder(const Point &p) override;
     virtual Point getApproximateNearestPointOnBorder(const Point &p) override;
+    virtual size_t getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) override;
     std::vector<Point> points;
     std::vector<bool> arrowBegin, arrowEnd;
     std::vector<bool> isStop;
 
+    // Painters keep data calculated from points, arrows and stops here,
+    // it is not copied with the curve and should be reset whenever they change
+    class PaintCache {
+    public:
+        PaintCache() {}
+        PaintCache(const PaintCache&) {}
+        PaintCache &operator=(const PaintCache&) {
+            data.reset();
+            return *this;
+        }
+        std::shared_ptr<CurvePaintCache> data;
+    };
+    PaintCache paintCache;
+    void resetPaintCache() {
+        paintCache.data.reset();
+    }
+
     void selfCheck() {
         assert(arrowBegin.size() == arrowEnd.size());
         assert(std::max(1u, points.size()) - 1 == arrowBegin.size());
@@ -245,6 +285,9 @@ public:
     virtual bool dependsOn(const PFigure &other) {
         return other == figA || other == figB;
     }
+    std::vector<PFigure> getDependencies() const override {
+        return { figA, figB };
+    }
 
 protected:
     PBoundedFigure figA, figB;
@@ -261,6 +304,7 @@ public:
     }
     bool isInsideOrOnBorder(const Point &p) override;
     Point getApproximateNearestPointOnBorder(const Point &) override;
+    size_t getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) override;
 };
 class Rectangle : public BoundedFigure {
 public:
@@ -273,22 +317,94 @@ public:
     }
     bool isInsideOrOnBorder(const Point &p) override;
     Point getApproximateNearestPointOnBorder(const Point &p) override;
+    size_t getApproximateNearestPointsOnBorder(const double *x, const double *y, size_t count, double failDistanceX, double failDistanceY, double *nearestX, double *nearestY) override;
 };
 } // namespace figures
 
+/*
+ * Reversible description of changes made to a model between Model::beginRecording()
+ * and Model::endRecording(). Holds removed and replaced figures, but not the whole model.
+ */
+struct ModelChange {
+    enum class Kind {
+        Added,
+        Removed,
+        Replaced // figure was replaced with its modified copy
+    };
+    struct Operation {
+        Kind kind;
+        PFigure figure;
+        // Replaced: the new version of the figure
+        PFigure other;
+        // position of the figure in the model
+        size_t serial;
+    };
+    std::vector<Operation> operations;
+    PFigure selectedBefore, selectedAfter;
+
+    bool empty() const {
+        return operations.empty() && selectedBefore == selectedAfter;
+    }
+    // Approximate amount of memory held by the change, in bytes
+    size_t memoryUsage() const;
+};
+
+/*
+ * Figures may be shared between a model and its snapshots (see snapshot()),
+ * so figures which are already in the model should not be modified in place directly.
+ * Use modify() to get a version of the figure which is owned by the model exclusively,
+ * change it and then call updateFigure().
+ * Const methods do not change anything (there are no lazily built indices),
+ * so they may be called from several threads while nobody changes the model.
+ */
 class Model {
+    typedef PersistentMap<size_t, PFigure> FigureMap;
+
 public:
-    Model() {}
-    Model(const Model &other) {
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef PFigure value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const PFigure *pointer;
+        typedef const PFigure &reference;
+
+        const_iterator() {}
+        reference operator*() const { return it->second; }
+        pointer operator->() const { return &it->second; }
+        const_iterator &operator++() {
+            ++it;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator result = *this;
+            ++it;
+            return result;
+        }
+        bool operator==(const const_iterator &other) const { return it == other.it; }
+        bool operator!=(const const_iterator &other) const { return it != other.it; }
+
+    private:
+        friend class Model;
+        explicit const_iterator(const FigureMap::const_iterator &it) : it(it) {}
+        FigureMap::const_iterator it;
+    };
+    // Figures are changed with modify() only, iterators see the model as it was when they were taken
+    typedef const_iterator iterator;
+
+    Model() : _nextSerial(0), _generation(nextGeneration()), _version(nextVersion()) {}
+    Model(const Model &other) : Model() {
         std::map<PFigure, PFigure> mapping;
-        for (PFigure figure : other._figures) {
+        for (PFigure figure : other) {
             mapping.insert(std::make_pair(figure, *addFigure(clone(figure, mapping))));
         }
         if (other.selectedFigure) {
             selectedFigure = mapping.at(other.selectedFigure);
         }
     }
-    Model(Model &&other) : _figures(std::move(other._figures)), selectedFigure(std::move(other.selectedFigure)) {}
+    Model(Model &&other) : Model() {
+        swap(other);
+    }
     Model &operator=(Model other) {
         swap(other);
         return *this;
@@ -296,52 +412,133 @@ public:
 
     void swap(Model &other) {
         _figures.swap(other._figures);
+        _entries.swap(other._entries);
+        _dependents.swap(other._dependents);
+        std::swap(_index, other._index);
+        std::swap(_nextSerial, other._nextSerial);
+        std::swap(_generation, other._generation);
+        std::swap(_version, other._version);
+        std::swap(_recording, other._recording);
         std::swap(selectedFigure, other.selectedFigure);
     }
 
-    typedef std::list<PFigure>::iterator iterator;
-    typedef std::list<PFigure>::const_iterator const_iterator;
-
-    iterator addFigure(PFigure a) {
-        _figures.push_back(std::move(a));
-        return --_figures.end();
-    }
-    iterator begin() {
-        return _figures.begin();
-    }
-    iterator end() {
-        return _figures.end();
-    }
+    /*
+     * Returns a model with the same figures which shares them with this one
+     * instead of cloning. Figures are copied later on the first modification
+     * by either of models (copy-on-write). The order of figures and indices
+     * are persistent structures shared by both models, so a snapshot takes O(1)
+     * and a change copies O(log N) of their nodes besides the changed figures.
+     */
+    Model snapshot();
+
+    /*
+     * Alternative to snapshots: all changes between these calls are recorded
+     * and can be reverted and reapplied later. Cost of a change depends only
+     * on the number of figures changed.
+     */
+    void beginRecording();
+    ModelChange endRecording();
+    // The model should be in the state right after (for undo) or before (for redo) the change
+    void undo(const ModelChange &change);
+    void redo(const ModelChange &change);
+
+    iterator addFigure(PFigure a);
     const_iterator begin() const {
-        return _figures.begin();
+        return const_iterator(_figures.begin());
     }
     const_iterator end() const {
-        return _figures.end();
-    }
-    void removeFigure(iterator it) {
-        PFigure old = *it;
-        _figures.erase(it);
-        for (auto it2 = _figures.begin(); it2 != _figures.end(); it2++) {
-            if ((*it2)->dependsOn(old)) {
-                removeFigure(it2);
-                it2 = _figures.begin();
-            }
-        }
-        if (old == selectedFigure) {
-            selectedFigure.reset();
-        }
+        return const_iterator(_figures.end());
+    }
+    const_iterator find(const PFigure &figure) const {
+        const Entry *entry = _entries.get(figure.get());
+        return entry ? const_iterator(_figures.find(entry->serial)) : end();
     }
+    // Removes the figure and all figures which depend on it (recursively)
+    void removeFigure(iterator it);
     size_t size() const {
         return _figures.size();
     }
-    void recalculate() {
-        for (PFigure fig : *this) {
-            fig->recalculate();
-        }
-    }
+
+    /*
+     * Changes on every addFigure(), removeFigure(), modify(), updateFigure(),
+     * undo() and redo(). Versions are unique among all models (except that a snapshot
+     * has the version of its source until either is changed), so (unlike the address
+     * of the model) the version may be used as a key for data calculated from the model.
+     * Changes of selectedFigure are not tracked.
+     */
+    size_t version() const {
+        return _version;
+    }
+
+    /*
+     * Returns a version of the figure (which should belong to the model) that can be
+     * modified in place. If the figure is shared with a snapshot, it is replaced
+     * with its copy (as well as its dependents) and selectedFigure is updated.
+     */
+    PFigure modify(const PFigure &figure);
+    template<typename T>
+    std::shared_ptr<T> modify(const std::shared_ptr<T> &figure) {
+        return std::static_pointer_cast<T>(modify(PFigure(figure)));
+    }
+
+    // Returns the modified figure (see modify())
+    PFigure translate(const PFigure &figure, const Point &diff) {
+        PFigure result = modify(figure);
+        result->translate(diff);
+        updateFigure(result);
+        return result;
+    }
+    // Should be called after the figure was modified in place
+    void updateFigure(const PFigure &figure);
+    void recalculate();
+
+    /*
+     * Returns figures (in model's order) which bounding boxes are no further than 'radius'
+     * from the point. Those are the only ones which can have border or interior within 'radius'.
+     */
+    std::vector<PFigure> figuresNear(const Point &p, double radius) const {
+        return _index.query(p, radius);
+    }
+    // Same, but puts figures to 'result' (replacing its contents), so a reused buffer is not reallocated
+    void figuresNear(const Point &p, double radius, std::vector<PFigure> &result) const {
+        _index.query(p, radius, result);
+    }
+    // Figures which have the figure among their getDependencies(), in no particular order
+    std::vector<PFigure> getDependents(const PFigure &figure) const;
 
 private:
-    std::list<PFigure> _figures;
+    struct Entry {
+        size_t serial;
+        // figure is owned exclusively iff it was added or copied in the current generation
+        size_t generation;
+    };
+    static const size_t SHARED_GENERATION = (size_t)-1;
+    typedef PersistentMap<const Figure*, PFigure> FigureSet;
+
+    FigureMap _figures; // by serials
+    PersistentMap<const Figure*, Entry> _entries;
+    PersistentMap<const Figure*, FigureSet> _dependents;
+    SpatialIndex _index;
+    size_t _nextSerial;
+    // generations are unique among all models, like versions
+    size_t _generation;
+    size_t _version;
+    std::unique_ptr<ModelChange> _recording;
+
+    static size_t nextVersion();
+    static size_t nextGeneration();
+    void addToIndices(const PFigure &figure, size_t generation, size_t serial);
+    void removeFromIndices(const PFigure &figure);
+    void addDependent(const PFigure &dependency, const PFigure &figure);
+    void removeDependent(const PFigure &dependency, const PFigure &figure);
+    // Arguments are taken by value as they may refer to the figure being replaced
+    void replaceFigure(PFigure oldFigure, PFigure newFigure);
+    void record(ModelChange::Kind kind, const PFigure &figure, const PFigure &other, size_t serial);
+
+    // These do not touch dependents and are used for replaying changes only
+    void insertRaw(const PFigure &figure, size_t serial);
+    void eraseRaw(const PFigure &figure);
+    void replaceRaw(PFigure oldFigure, PFigure newFigure);
 public:
     PFigure selectedFigure;
 };
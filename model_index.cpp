@@ -0,0 +1,178 @@
+#include "model.h"
+#include "model_index.h"
+#include <algorithm>
+#include <cmath>
+
+constexpr double SpatialIndex::CELL_SIZE;
+constexpr long long SpatialIndex::MAX_CELLS_PER_FIGURE;
+
+SpatialIndex::CellRange SpatialIndex::getCellRange(const BoundingBox &box) {
+    CellRange result;
+    result.isLarge = true;
+    result.x1 = result.y1 = result.x2 = result.y2 = 0;
+    // this also catches empty boxes (infinities) and NaNs
+    if (!(box.width() >= 0 && box.height() >= 0)) {
+        return result;
+    }
+    const double LIMIT = 1e9;
+    if (!(fabs(box.leftUp.x) < LIMIT && fabs(box.leftUp.y) < LIMIT &&
+          fabs(box.rightDown.x) < LIMIT && fabs(box.rightDown.y) < LIMIT)) {
+        return result;
+    }
+    result.x1 = (long long)floor(box.leftUp.x / CELL_SIZE);
+    result.y1 = (long long)floor(box.leftUp.y / CELL_SIZE);
+    result.x2 = (long long)floor(box.rightDown.x / CELL_SIZE);
+    result.y2 = (long long)floor(box.rightDown.y / CELL_SIZE);
+    result.isLarge = (result.x2 - result.x1 + 1) * (result.y2 - result.y1 + 1) > MAX_CELLS_PER_FIGURE;
+    return result;
+}
+
+long long SpatialIndex::cellKey(long long x, long long y) {
+    return (long long)(((unsigned long long)x << 32) ^ ((unsigned long long)y & 0xFFFFFFFFULL));
+}
+
+void SpatialIndex::addToCells(const Entry &entry) {
+    if (entry.cells.isLarge) {
+        largeItems.set(entry.item.serial, entry.item);
+        return;
+    }
+    for (long long x = entry.cells.x1; x <= entry.cells.x2; x++) {
+        for (long long y = entry.cells.y1; y <= entry.cells.y2; y++) {
+            long long key = cellKey(x, y);
+            const PCell *cell = cells.get(key);
+            std::shared_ptr<std::vector<Item>> items = cell ? std::make_shared<std::vector<Item>>(**cell)
+                                                            : std::make_shared<std::vector<Item>>();
+            items->push_back(entry.item);
+            cells.set(key, items);
+        }
+    }
+}
+
+void SpatialIndex::removeFromCells(const Entry &entry) {
+    if (entry.cells.isLarge) {
+        bool erased = largeItems.erase(entry.item.serial);
+        assert(erased);
+        (void)erased;
+        return;
+    }
+    for (long long x = entry.cells.x1; x <= entry.cells.x2; x++) {
+        for (long long y = entry.cells.y1; y <= entry.cells.y2; y++) {
+            long long key = cellKey(x, y);
+            const PCell *cell = cells.get(key);
+            assert(cell);
+            if ((*cell)->size() == 1) {
+                assert((*cell)->front().figure == entry.item.figure);
+                cells.erase(key);
+                continue;
+            }
+            // cells are shared with copies of the index, so they are copied on change
+            auto items = std::make_shared<std::vector<Item>>();
+            items->reserve((*cell)->size() - 1);
+            for (const Item &item : **cell) {
+                if (item.figure != entry.item.figure) {
+                    items->push_back(item);
+                }
+            }
+            assert(items->size() + 1 == (*cell)->size());
+            cells.set(key, items);
+        }
+    }
+}
+
+void SpatialIndex::insert(const std::shared_ptr<Figure> &figure, size_t serial) {
+    assert(!entries.get(figure.get()));
+    Entry entry { Item { serial, figure }, getCellRange(figure->getBoundingBox()) };
+    entries.set(figure.get(), entry);
+    addToCells(entry);
+}
+
+void SpatialIndex::erase(const std::shared_ptr<Figure> &figure) {
+    const Entry *entry = entries.get(figure.get());
+    assert(entry);
+    removeFromCells(*entry);
+    entries.erase(figure.get());
+}
+
+void SpatialIndex::update(const std::shared_ptr<Figure> &figure) {
+    const Entry *oldEntry = entries.get(figure.get());
+    assert(oldEntry);
+    CellRange newCells = getCellRange(figure->getBoundingBox());
+    const CellRange &oldCells = oldEntry->cells;
+    if (newCells.isLarge == oldCells.isLarge &&
+            newCells.x1 == oldCells.x1 && newCells.y1 == oldCells.y1 &&
+            newCells.x2 == oldCells.x2 && newCells.y2 == oldCells.y2) {
+        return;
+    }
+    Entry entry = *oldEntry;
+    removeFromCells(entry);
+    entry.cells = newCells;
+    entries.set(figure.get(), entry);
+    addToCells(entry);
+}
+
+void SpatialIndex::replace(const std::shared_ptr<Figure> &oldFigure, const std::shared_ptr<Figure> &newFigure) {
+    const Entry *entry = entries.get(oldFigure.get());
+    assert(entry);
+    size_t serial = entry->item.serial;
+    erase(oldFigure);
+    insert(newFigure, serial);
+}
+
+void SpatialIndex::clear() {
+    entries.clear();
+    cells.clear();
+    largeItems.clear();
+}
+
+std::vector<std::shared_ptr<Figure>> SpatialIndex::query(const BoundingBox &area) const {
+    std::vector<std::shared_ptr<Figure>> result;
+    query(area, result);
+    return result;
+}
+
+void SpatialIndex::query(const BoundingBox &area, std::vector<std::shared_ptr<Figure>> &result) const {
+    // kept by every thread between queries, so queries into callers' buffers do not allocate
+    static thread_local std::vector<Item> found;
+    found.clear();
+    for (const auto &large : largeItems) {
+        found.push_back(large.second);
+    }
+    CellRange range = getCellRange(area);
+    if (range.isLarge) {
+        // it's cheaper to look through all figures
+        for (const auto &entry : entries) {
+            if (!entry.second.cells.isLarge) {
+                found.push_back(entry.second.item);
+            }
+        }
+    } else {
+        for (long long x = range.x1; x <= range.x2; x++) {
+            for (long long y = range.y1; y <= range.y2; y++) {
+                const PCell *cell = cells.get(cellKey(x, y));
+                if (cell) {
+                    found.insert(found.end(), (*cell)->begin(), (*cell)->end());
+                }
+            }
+        }
+    }
+    std::sort(found.begin(), found.end(), [](const Item &a, const Item &b) {
+        return a.serial < b.serial;
+    });
+
+    result.clear();
+    for (size_t i = 0; i < found.size(); i++) {
+        if (i == 0 || found[i].serial != found[i - 1].serial) {
+            result.push_back(found[i].figure);
+        }
+    }
+    // figures are not kept alive by the buffer
+    found.clear();
+}
+
+std::vector<std::shared_ptr<Figure>> SpatialIndex::query(const Point &center, double radius) const {
+    return query(BoundingBox({ center - Point(radius, radius), center + Point(radius, radius) }));
+}
+
+void SpatialIndex::query(const Point &center, double radius, std::vector<std::shared_ptr<Figure>> &result) const {
+    query(BoundingBox({ center - Point(radius, radius), center + Point(radius, radius) }), result);
+}
@@ -0,0 +1,71 @@
+#ifndef MODEL_INDEX_H
+#define MODEL_INDEX_H
+
+#include <vector>
+#include <memory>
+#include "persistent_map.h"
+
+struct Point;
+struct BoundingBox;
+class Figure;
+
+/*
+ * Uniform grid over figures' bounding boxes.
+ * Every figure is stored in all cells which its bounding box covers,
+ * figures which are too big (or degenerate) are stored in a separate list
+ * and are returned by every query.
+ * Each figure has a serial number, query results are sorted by it,
+ * so Model can keep its figures order for callers.
+ * Copies share their structure (see PersistentMap), so a copy takes O(1)
+ * and a change of a figure copies O(log N + figures in its cells) data.
+ */
+class SpatialIndex {
+public:
+    static constexpr double CELL_SIZE = 64;
+    static constexpr long long MAX_CELLS_PER_FIGURE = 256;
+
+    SpatialIndex() {}
+
+    void insert(const std::shared_ptr<Figure> &figure, size_t serial);
+    void erase(const std::shared_ptr<Figure> &figure);
+    // Should be called after figure's bounding box was changed
+    void update(const std::shared_ptr<Figure> &figure);
+    // Puts newFigure in place of oldFigure, serial is kept
+    void replace(const std::shared_ptr<Figure> &oldFigure, const std::shared_ptr<Figure> &newFigure);
+    void clear();
+
+    // Returns candidates (in order of serials) which bounding boxes may intersect with area,
+    // exact checks are up to the caller
+    std::vector<std::shared_ptr<Figure>> query(const BoundingBox &area) const;
+    // Same for the square with the given center and 'radius'
+    std::vector<std::shared_ptr<Figure>> query(const Point &center, double radius) const;
+    // Same, but the result is put to the buffer, which keeps its capacity
+    void query(const BoundingBox &area, std::vector<std::shared_ptr<Figure>> &result) const;
+    void query(const Point &center, double radius, std::vector<std::shared_ptr<Figure>> &result) const;
+
+private:
+    struct CellRange {
+        long long x1, y1, x2, y2;
+        bool isLarge;
+    };
+    struct Item {
+        size_t serial;
+        std::shared_ptr<Figure> figure;
+    };
+    struct Entry {
+        Item item;
+        CellRange cells;
+    };
+    typedef std::shared_ptr<const std::vector<Item>> PCell;
+
+    PersistentMap<const Figure*, Entry> entries;
+    PersistentMap<long long, PCell> cells;
+    PersistentMap<size_t, Item> largeItems; // by serial
+
+    static CellRange getCellRange(const BoundingBox &box);
+    static long long cellKey(long long x, long long y);
+    void addToCells(const Entry &entry);
+    void removeFromCells(const Entry &entry);
+};
+
+#endif // MODEL_INDEX_H
@@ -1,9 +1,11 @@
 #include "model_io.h"
 #include "figurepainter.h"
 #include "textpainter.h"
+#include "tracing.h"
 #include <QImage>
 
 std::istream &operator>>(std::istream &in, Model &model) {
+    TRACE_SCOPE("readModel");
     int count;
     if (!(in >> count)) {
         throw model_format_error("unable to read number of figures");
@@ -215,6 +217,7 @@ private:
 };
 
 std::ostream &operator<<(std::ostream &out, Model &model) {
+    TRACE_SCOPE("writeModel");
     size_t operations = 0;
     operations += model.size();
     operations += !!model.selectedFigure;
@@ -254,16 +257,9 @@ BoundingBox getImageBox(Model &model) {
         imageBox.addPoint(box.leftUp);
         imageBox.addPoint(box.rightDown);
         if (!fig->label().empty()) {
-            TextPosition text = getTextPosition(*fig);
-            Point width(text.width, 0);
-            Point height(0, text.height);
-            width.rotateBy(text.rotation * PI / 180);
-            height.rotateBy(text.rotation * PI / 180);
-            for (int dx = 0; dx < 2; dx++)
-                for (int dy = 0; dy < 2; dy++) {
-                    Point corner = text.leftUp + width * dx + height * dy;
-                    imageBox.addPoint(corner);
-                }
+            BoundingBox text = getBoundingBox(getTextPosition(*fig));
+            imageBox.addPoint(text.leftUp);
+            imageBox.addPoint(text.rightDown);
         }
     }
     if (imageBox.leftUp.x > imageBox.rightDown.x) {
@@ -281,6 +277,7 @@ BoundingBox getImageBox(Model &model) {
 }
 
 void exportModelToSvg(Model &m, std::ostream &out) {
+    TRACE_SCOPE("exportModelToSvg");
     FigureSvgPainter painter(out);
     painter.printHeader(getImageBox(m));
     for (PFigure figure : m) {
@@ -290,6 +287,7 @@ void exportModelToSvg(Model &m, std::ostream &out) {
 }
 
 void exportModelToTikz(Model &m, std::ostream &out) {
+    TRACE_SCOPE("exportModelToTikz");
     FigureTikzPainter painter(out);
     painter.printHeader(getImageBox(m));
     for (PFigure figure : m) {
@@ -299,6 +297,7 @@ void exportModelToTikz(Model &m, std::ostream &out) {
 }
 
 void exportModelToImageFile(Model &model, const QString &filename) {
+    TRACE_SCOPE("exportModelToImageFile");
     BoundingBox imageBox = getImageBox(model);
 
     QImage img(imageBox.width(), imageBox.height(), QImage::Format_ARGB32);
@@ -308,10 +307,11 @@ void exportModelToImageFile(Model &model, const QString &filename) {
     painter.setFont(font);
     painter.fillRect(QRect(QPoint(), img.size()), Qt::white);
     painter.setPen(Qt::black);
-    FigurePainter fpainter(painter, imageBox.leftUp);
+    FigurePainter fpainter(painter, imageBox.leftUp, true);
     for (PFigure fig : model) {
         fig->visit(fpainter);
     }
+    fpainter.flush();
     painter.end();
     if (!img.save(filename)) {
         throw io_error("Unable to save to PNG file");
@@ -11,6 +11,7 @@ void makeVerticallySymmetric(std::shared_ptr<figures::Curve> curve) {
     for (Point &p : curve->points) {
         std::swap(p.x, p.y);
     }
+    curve->resetPaintCache();
 }
 
 bool getVerticalIntersection(Point a, Point b, double x, Point &result) {
@@ -69,6 +70,7 @@ void makeHorizontallySymmetric(std::shared_ptr<figures::Curve> curve) {
             curve->arrowEnd.push_back(curve->arrowBegin[i - 1]);
         }
     }
+    curve->resetPaintCache();
     curve->selfCheck();
 }
 
@@ -163,7 +165,7 @@ void makeTopBottomTree(Model &model, figures::PBoundedFigure root) {
         const double NODES_GAP = vBox.height() * NODES_GAP_K;
 
         BoundingBox sumBox = boxes[v];
-        v->translate(getNodeOffset(vBox, sumBox));
+        model.translate(v, getNodeOffset(vBox, sumBox));
         Point currentCorner = sumBox.leftUp;
         currentCorner.y += vBox.height() + NODES_GAP;
         for (Node child : children[v]) {
@@ -172,5 +174,4 @@ void makeTopBottomTree(Model &model, figures::PBoundedFigure root) {
             currentCorner.x += childBox.width() + NODES_GAP;
         }
     }
-    model.recalculate();
 }
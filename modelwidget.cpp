@@ -3,8 +3,10 @@
 #include "modelwidget.h"
 #include "figurepainter.h"
 #include "recognition.h"
+#include "recognition_worker.h"
 #include "layouting.h"
 #include "model_ops.h"
+#include "tracing.h"
 #include <QPainter>
 #include <QMouseEvent>
 #include <QInputDialog>
@@ -15,10 +17,18 @@
 #include <QTimer>
 #include <QMenu>
 
+#ifndef DEFAULT_RECOGNITION_PRESET
+#error Default recognition preset is not specified (can be Mouse or Touch)
+#endif
+
 const char *MIME_TYPE_MODEL = "application/x-manugram-model";
+const size_t DEFAULT_UNDO_MEMORY_BUDGET = 64 * 1024 * 1024;
 
 Ui::ModelWidget::ModelWidget(QWidget *parent) :
-    QWidget(parent), mouseAction(MouseAction::None), _gridStep(0), _showTrack(true), _showRecognitionResult(true), _storeTracks(false) {
+    QWidget(parent), _recognitionContext(RecognitionPreset::DEFAULT_RECOGNITION_PRESET),
+    trackFilter(TrackFilterSettings()), trackRecognizer(_recognitionContext),
+    mouseAction(MouseAction::None), _gridStep(0), _showTrack(true), _showRecognitionResult(true), _storeTracks(false),
+    _undoMode(UndoMode::Snapshots), _undoMemoryBudget(DEFAULT_UNDO_MEMORY_BUDGET), undoChangesMemory(0), modelCacheKey() {
     setFocusPolicy(Qt::FocusPolicy::StrongFocus);
     grabGesture(Qt::PinchGesture);
     setContextMenuPolicy(Qt::CustomContextMenu);
@@ -26,11 +36,19 @@ Ui::ModelWidget::ModelWidget(QWidget *parent) :
 #if DISABLE_SHOW_RECOGNITION_RESULT == 1
     setShowRecognitionResult(false);
 #endif
+#ifdef DEFAULT_UNDO_MODE
+    setUndoMode(UndoMode::DEFAULT_UNDO_MODE);
+#endif
+    connect(&recognitionWorker, &RecognitionWorker::previewReady, this, [this]() {
+        TrackPreview preview;
+        if (recognitionWorker.takePreview(preview) && trackRecognizer.setPreview(std::move(preview))) {
+            update();
+        }
+    });
 }
 
-void drawTrack(QPainter &painter, Scaler &scaler, const Track &track) {
+void drawTrack(QPainter &painter, Scaler &scaler, const Track &track, const std::vector<double> &speeds, const std::vector<int> &stops) {
     QPen oldPen = painter.pen();
-    std::vector<double> speeds = calculateRelativeSpeeds(track);
     for (size_t i = 0; i + 1 < track.size(); i++) {
         double k = speeds[i] * 510;
         QColor color;
@@ -41,7 +59,6 @@ void drawTrack(QPainter &painter, Scaler &scaler, const Track &track) {
         painter.setPen(pen);
         painter.drawLine(scaler(track[i]), scaler(track[i + 1]));
     }
-    std::vector<int> stops = getSpeedBreakpoints(track);
     for (int stop : stops) {
         QPen pen = oldPen;
         pen.setColor(QColor(0, 255, 255));
@@ -51,6 +68,11 @@ void drawTrack(QPainter &painter, Scaler &scaler, const Track &track) {
     painter.setPen(oldPen);
 }
 
+void drawTrack(QPainter &painter, Scaler &scaler, const RecognitionContext &context, const Track &track) {
+    TrackFeatures features(track);
+    drawTrack(painter, scaler, track, features.relativeSpeeds(), features.stops(context.speedStopThreshold, context.stopArea));
+}
+
 int Ui::ModelWidget::gridStep() {
     return _gridStep;
 }
@@ -97,11 +119,21 @@ void Ui::ModelWidget::setStoreTracks(bool newStoreTracks) {
     _storeTracks = newStoreTracks;
 }
 
+const TrackFilterSettings &Ui::ModelWidget::trackFilterSettings() {
+    return trackFilter.settings();
+}
+void Ui::ModelWidget::setTrackFilterSettings(const TrackFilterSettings &newTrackFilterSettings) {
+    trackFilter.setSettings(newTrackFilterSettings);
+}
+
 
 void Ui::ModelWidget::setModel(Model model) {
     commitedModel = std::move(model);
     previousModels.clear();
     redoModels.clear();
+    undoChanges.clear();
+    redoChanges.clear();
+    undoChangesMemory = 0;
     emit canUndoChanged();
     emit canRedoChanged();
     emit canGetSelectedMimeDataChanged();
@@ -111,21 +143,31 @@ Model &Ui::ModelWidget::getModel() {
     return commitedModel;
 }
 
+const RecognitionContext &Ui::ModelWidget::recognitionContext() {
+    return _recognitionContext;
+}
+
 void Ui::ModelWidget::addModelExtraTrack(Track track) {
     extraTracks.push_back(std::move(track));
 }
 
 bool Ui::ModelWidget::canUndo() {
-    return !previousModels.empty();
+    return _undoMode == UndoMode::Snapshots ? !previousModels.empty() : !undoChanges.empty();
 }
 
 void Ui::ModelWidget::undo() {
     if (!canUndo()) {
         throw std::runtime_error("Cannot undo");
     }
-    redoModels.push_front(std::move(commitedModel));
-    commitedModel = std::move(previousModels.back());
-    previousModels.pop_back();
+    if (_undoMode == UndoMode::Snapshots) {
+        redoModels.push_front(std::move(commitedModel));
+        commitedModel = std::move(previousModels.back());
+        previousModels.pop_back();
+    } else {
+        undoChangesMemory -= undoChanges.back().memoryUsage();
+        commitedModel.undo(undoChanges.back());
+        redoChanges.splice(redoChanges.begin(), undoChanges, --undoChanges.end());
+    }
     if (!canUndo()) {
         emit canUndoChanged();
     }
@@ -135,16 +177,23 @@ void Ui::ModelWidget::undo() {
 }
 
 bool Ui::ModelWidget::canRedo() {
-    return !redoModels.empty();
+    return _undoMode == UndoMode::Snapshots ? !redoModels.empty() : !redoChanges.empty();
 }
 
 void Ui::ModelWidget::redo() {
     if (!canRedo()) {
         throw std::runtime_error("Cannot redo");
     }
-    previousModels.push_back(std::move(commitedModel));
-    commitedModel = std::move(redoModels.front());
-    redoModels.pop_front();
+    if (_undoMode == UndoMode::Snapshots) {
+        previousModels.push_back(std::move(commitedModel));
+        commitedModel = std::move(redoModels.front());
+        redoModels.pop_front();
+    } else {
+        commitedModel.redo(redoChanges.front());
+        undoChangesMemory += redoChanges.front().memoryUsage();
+        undoChanges.splice(undoChanges.end(), redoChanges, redoChanges.begin());
+        shrinkUndoChanges();
+    }
     if (!canRedo()) {
         emit canRedoChanged();
     }
@@ -153,6 +202,39 @@ void Ui::ModelWidget::redo() {
     update();
 }
 
+UndoMode Ui::ModelWidget::undoMode() {
+    return _undoMode;
+}
+
+void Ui::ModelWidget::setUndoMode(UndoMode newUndoMode) {
+    _undoMode = newUndoMode;
+    previousModels.clear();
+    redoModels.clear();
+    undoChanges.clear();
+    redoChanges.clear();
+    undoChangesMemory = 0;
+    emit canUndoChanged();
+    emit canRedoChanged();
+}
+
+size_t Ui::ModelWidget::undoMemoryBudget() {
+    return _undoMemoryBudget;
+}
+
+void Ui::ModelWidget::setUndoMemoryBudget(size_t newUndoMemoryBudget) {
+    _undoMemoryBudget = newUndoMemoryBudget;
+    shrinkUndoChanges();
+    emit canUndoChanged();
+}
+
+void Ui::ModelWidget::shrinkUndoChanges() {
+    // the last change is always kept, so at least one step can be undone
+    while (undoChanges.size() > 1 && undoChangesMemory > _undoMemoryBudget) {
+        undoChangesMemory -= undoChanges.front().memoryUsage();
+        undoChanges.pop_front();
+    }
+}
+
 bool Ui::ModelWidget::canGetSelectedMimeData() {
     PFigure selection = commitedModel.selectedFigure;
     if (!selection) {
@@ -201,12 +283,42 @@ void Ui::ModelWidget::pasteMimeData(const QMimeData *mimeData) {
     });
 }
 
+void Ui::ModelWidget::beginCommit() {
+    TRACE_SCOPE("beginCommit");
+    if (_undoMode == UndoMode::Snapshots) {
+        uncommitedSnapshot = commitedModel.snapshot();
+    } else {
+        commitedModel.beginRecording();
+    }
+}
+
+void Ui::ModelWidget::endCommit(bool modified) {
+    if (_undoMode == UndoMode::Snapshots) {
+        if (modified) {
+            previousModels.push_back(std::move(uncommitedSnapshot));
+        }
+        uncommitedSnapshot = Model();
+    } else {
+        ModelChange change = commitedModel.endRecording();
+        if (modified) {
+            undoChangesMemory += change.memoryUsage();
+            undoChanges.push_back(std::move(change));
+            shrinkUndoChanges();
+        }
+    }
+    if (modified) {
+        redoModels.clear();
+        redoChanges.clear();
+        emit canUndoChanged();
+        emit canRedoChanged();
+    }
+}
+
 void Ui::ModelWidget::modifyModelAndCommit(std::function<void()> action) {
-    previousModels.push_back(commitedModel);
-    redoModels.clear();
+    TRACE_SCOPE("modifyModelAndCommit");
+    beginCommit();
     action();
-    emit canUndoChanged();
-    emit canRedoChanged();
+    endCommit(true);
     emit canGetSelectedMimeDataChanged();
     update();
 }
@@ -216,10 +328,23 @@ double roundDownToMultiple(double x, double multiple) {
     return floor(x / multiple) * multiple;
 }
 
-void Ui::ModelWidget::paintEvent(QPaintEvent *) {
-    QPainter painter(this);
-    painter.fillRect(QRect(QPoint(), size()), Qt::white);
+QColor getFigureColor(const EditPreview &preview, const PFigure &fig) {
+    if (fig == preview.modified) {
+        return Qt::magenta;
+    } else if (fig == preview.selectedFigure) {
+        return Qt::blue;
+    } else {
+        return Qt::black;
+    }
+}
 
+bool isModelUnchanged(const EditPreview &preview, const Model &model) {
+    // previews of moves, deletions and clicks change figures of the model
+    return preview.replaced.empty() && (!preview.modified || preview.modified == preview.added)
+            && preview.selectedFigure == model.selectedFigure;
+}
+
+void setUpFigurePainter(QPainter &painter, const Scaler &scaler) {
     QFont font;
     font.setPointSizeF(10 * scaler.scaleFactor);
     painter.setFont(font);
@@ -227,21 +352,34 @@ void Ui::ModelWidget::paintEvent(QPaintEvent *) {
     QPen pen(Qt::black);
     pen.setWidthF(scaler.scaleFactor);
     painter.setPen(pen);
+}
 
-    FigurePainter fpainter(painter, scaler);
+Ui::ModelWidget::ModelCacheKey Ui::ModelWidget::currentModelCacheKey() {
+    return { commitedModel.version(), commitedModel.selectedFigure.get(), scaler.zeroPoint, scaler.scaleFactor,
+             size(), devicePixelRatioF(), gridStep() };
+}
+
+const PaintStatistics &Ui::ModelWidget::paintStatistics() {
+    return _paintStatistics;
+}
+
+void Ui::ModelWidget::drawModel(QPainter &painter, const EditPreview &preview) {
+    painter.fillRect(QRect(QPoint(), size()), Qt::white);
+    setUpFigurePainter(painter, scaler);
+
+    // Calculating visible area
+    const BoundingBox visible({ scaler(QPointF(0, 0)), scaler(QPointF(width(), height())) });
     if (gridStep() > 0) {
         int step = gridStep();
-        // Calculating visible area
-        Point p1 = scaler(QPointF(0, 0));
-        Point p2 = scaler(QPointF(width(), height()));
-        if (p1.x > p2.x) { std::swap(p1.x, p2.x); }
-        if (p1.y > p2.y) { std::swap(p1.y, p2.y); }
+        Point p1 = visible.leftUp;
+        Point p2 = visible.rightDown;
 
         // Finding starting point for the grid
         p1.x = roundDownToMultiple(p1.x, step);
         p1.y = roundDownToMultiple(p1.y, step);
 
         // Drawing
+        QPen oldPen = painter.pen();
         QPen pen(QColor(192, 192, 192, 255));
         pen.setStyle(Qt::DashLine);
         painter.setPen(pen);
@@ -251,55 +389,101 @@ void Ui::ModelWidget::paintEvent(QPaintEvent *) {
         for (int y = p1.y; y <= p2.y; y += step) {
             painter.drawLine(scaler(Point(p1.x, y)), scaler(Point(p2.x, y)));
         }
+        painter.setPen(oldPen);
     }
 
-    Model copiedModel;
-    Model &modelToDraw = (lastTrack.empty() || !showRecognitionResult()) ? commitedModel : (copiedModel = commitedModel);
-    PFigure modified = showRecognitionResult() ? recognize(lastTrack, modelToDraw) : nullptr;
-    for (PFigure fig : modelToDraw) {
-        if (fig == modified) {
-            pen.setColor(Qt::magenta);
-        } else if (fig == modelToDraw.selectedFigure) {
-            pen.setColor(Qt::blue);
-        } else {
-            pen.setColor(Qt::black);
+    _paintStatistics = PaintStatistics();
+    // batches are flushed on color changes, so overlapping figures are drawn in the model order
+    FigurePainter fpainter(painter, scaler, true);
+    for (PFigure fig : commitedModel) {
+        auto replaced = preview.replaced.find(fig);
+        if (replaced != preview.replaced.end()) {
+            fig = replaced->second;
         }
-        painter.setPen(pen);
+        if (!fig) {
+            continue;
+        }
+        if (!getPaintedBoundingBox(*fig).intersects(visible)) {
+            _paintStatistics.culledFigures++;
+            continue;
+        }
+        _paintStatistics.drawnFigures++;
+        fpainter.setColor(getFigureColor(preview, fig));
         fig->visit(fpainter);
     }
+    fpainter.flush();
+}
 
+void Ui::ModelWidget::paintEvent(QPaintEvent *) {
+    TRACE_SCOPE("paintEvent");
+    EditPreview noEdit;
+    noEdit.selectedFigure = commitedModel.selectedFigure;
+    const EditPreview *lastPreview = showRecognitionResult() ? trackRecognizer.lastPreview(commitedModel) : nullptr;
+    const EditPreview &preview = lastPreview ? *lastPreview : noEdit;
+
+    QPainter painter(this);
+    // otherwise figures in the cache are changed, so everything is drawn
+    if (isModelUnchanged(preview, commitedModel)) {
+        ModelCacheKey key = currentModelCacheKey();
+        if (modelCache.isNull() || !(modelCacheKey == key)) {
+            TRACE_SCOPE("drawModelCache");
+            modelCache = QPixmap(size() * key.devicePixelRatio);
+            modelCache.setDevicePixelRatio(key.devicePixelRatio);
+            QPainter cachePainter(&modelCache);
+            drawModel(cachePainter, noEdit);
+            modelCacheKey = key;
+        } else {
+            _paintStatistics.fromCache = true;
+        }
+        painter.drawPixmap(0, 0, modelCache);
+        setUpFigurePainter(painter, scaler);
+    } else {
+        drawModel(painter, preview);
+    }
+
+    if (preview.added) {
+        FigurePainter fpainter(painter, scaler);
+        fpainter.setColor(getFigureColor(preview, preview.added));
+        preview.added->visit(fpainter);
+    }
+
+    QPen pen = painter.pen();
     pen.setColor(QColor(255, 0, 0, 16));
     pen.setWidth(3 * scaler.scaleFactor);
     painter.setPen(pen);
     if (showTrack()) {
-        drawTrack(painter, scaler, lastTrack);
+        drawTrack(painter, scaler, trackRecognizer.track(), trackRecognizer.relativeSpeeds(), trackRecognizer.stops());
         for (const Track &track : visibleTracks) {
-            drawTrack(painter, scaler, track);
+            drawTrack(painter, scaler, _recognitionContext, track);
         }
     }
     for (const Track &track : extraTracks) {
-        drawTrack(painter, scaler, track);
+        drawTrack(painter, scaler, _recognitionContext, track);
     }
 }
 
 void Ui::ModelWidget::customContextMenuRequested(const QPoint &pos) {
-    PFigure figure = findClickedFigure(commitedModel, scaler(pos));
+    PFigure figure = findClickedFigure(_recognitionContext, commitedModel, scaler(pos));
     if (figure) {
         std::shared_ptr<figures::Curve> curve = std::dynamic_pointer_cast<figures::Curve>(figure);
         if (curve) {
             QMenu contextMenu;
             QAction verticalSymmetry("Make vertically symmetric", this);
             connect(&verticalSymmetry, &QAction::triggered, [this, curve]() {
-                modifyModelAndCommit([curve]() {
-                    makeVerticallySymmetric(curve);
+                modifyModelAndCommit([this, curve]() {
+                    auto modified = commitedModel.modify(curve);
+                    makeVerticallySymmetric(modified);
+                    commitedModel.updateFigure(modified);
                 });
             });
             contextMenu.addAction(&verticalSymmetry);
 
             QAction horizontalSymmetry("Make horizontally symmetric", this);
             connect(&horizontalSymmetry, &QAction::triggered, [this, curve]() {
-                modifyModelAndCommit([curve]() {
-                    makeHorizontallySymmetric(curve);
+                modifyModelAndCommit([this, curve]() {
+                    auto modified = commitedModel.modify(curve);
+                    makeHorizontallySymmetric(modified);
+                    commitedModel.updateFigure(modified);
                 });
             });
             contextMenu.addAction(&horizontalSymmetry);
@@ -323,8 +507,41 @@ void Ui::ModelWidget::customContextMenuRequested(const QPoint &pos) {
     }
 }
 
+void Ui::ModelWidget::resetTrack() {
+    trackFilter.reset();
+    trackRecognizer.reset();
+    recognitionWorker.cancel();
+}
+
+void Ui::ModelWidget::addTrackPoints(const std::vector<TrackPoint> &points) {
+    for (const TrackPoint &point : points) {
+        trackRecognizer.addPoint(point);
+    }
+}
+
+void Ui::ModelWidget::requestRecognitionPreview(bool wholeTrack) {
+    if (showRecognitionResult() && trackRecognizer.requestPreview(commitedModel, wholeTrack)) {
+        if (!recognitionSnapshot || recognitionSnapshot->version() != commitedModel.version()
+                || recognitionSnapshot->selectedFigure != commitedModel.selectedFigure) {
+            recognitionSnapshot = std::make_shared<const Model>(commitedModel.snapshot());
+        }
+        recognitionWorker.request(_recognitionContext, recognitionSnapshot, trackRecognizer.trackId(), trackRecognizer.track(),
+                                  trackRecognizer.streamedFeatures());
+    }
+}
+
+void Ui::ModelWidget::finishRecognitionPreview() {
+    requestRecognitionPreview(true);
+    TrackPreview preview;
+    if (recognitionWorker.waitPreview(trackRecognizer.trackId(), trackRecognizer.track().size(), preview)) {
+        trackRecognizer.setPreview(std::move(preview));
+    }
+    // otherwise the edit is recognized right away and the requests are not needed anymore
+    recognitionWorker.cancel();
+}
+
 void Ui::ModelWidget::mousePressEvent(QMouseEvent *event) {
-    lastTrack = Track();
+    resetTrack();
 
     if (event->modifiers().testFlag(Qt::ShiftModifier) || event->buttons().testFlag(Qt::MiddleButton)) {
         mouseAction = MouseAction::ViewpointMove;
@@ -334,7 +551,8 @@ void Ui::ModelWidget::mousePressEvent(QMouseEvent *event) {
     } else if (event->buttons().testFlag(Qt::LeftButton)) {
         mouseAction = MouseAction::TrackActive;
         trackTimer.start();
-        lastTrack.points.push_back(TrackPoint(scaler(event->pos()), trackTimer.elapsed()));
+        addTrackPoints(trackFilter.addPoint(TrackPoint(scaler(event->pos()), trackTimer.elapsed()), scaler.scaleFactor));
+        requestRecognitionPreview();
     }
     update();
 }
@@ -344,17 +562,24 @@ void Ui::ModelWidget::mouseMoveEvent(QMouseEvent *event) {
         scaler.zeroPoint = scaler.zeroPoint + scaler(viewpointMoveStart) - scaler(event->pos());
         update();
     } else if (mouseAction == MouseAction::TrackActive) {
-        lastTrack.points.push_back(TrackPoint(scaler(event->pos()), trackTimer.elapsed()));
+        const std::vector<TrackPoint> &points = trackFilter.addPoint(TrackPoint(scaler(event->pos()), trackTimer.elapsed()), scaler.scaleFactor);
+        if (points.empty()) {
+            return;
+        }
+        addTrackPoints(points);
+        requestRecognitionPreview();
         #if ENABLE_FAST_REDRAW == 1
         if (showTrack() && !showRecognitionResult()) {
-            QPoint a = scaler(lastTrack[lastTrack.size() - 2]).toPoint();
-            QPoint b = event->pos();
+            const Track &track = trackRecognizer.track();
+            QPoint a = scaler(track[track.size() - 1 - points.size()]).toPoint();
+            QPoint b = scaler(track[track.size() - 1]).toPoint();
             QRect r = QRect(a, a).united(QRect(b, b));
             r.adjust(-2, -2, +2, +2);
             update(r);
         } else
         #endif
-        if (showTrack() || showRecognitionResult()) {
+        // recognition result is repainted when it is ready
+        if (showTrack()) {
             update();
         }
     } else {
@@ -376,29 +601,29 @@ void Ui::ModelWidget::mouseReleaseEvent(QMouseEvent *event) {
     }
     assert(mouseAction == MouseAction::TrackActive);
     mouseAction = MouseAction::None;
-    lastTrack.points.push_back(TrackPoint(scaler(event->pos()), trackTimer.elapsed()));
+    addTrackPoints(trackFilter.finish(TrackPoint(scaler(event->pos()), trackTimer.elapsed()), scaler.scaleFactor));
     if (storeTracks()) {
         QFile file(QDateTime::currentDateTime().toString("yyyy-MM-dd-hh-mm-ss") + ".track");
         if (!file.open(QFile::WriteOnly | QFile::Text)) {
             QMessageBox::critical(this, "Error while saving track", "Unable to open file for writing");
         } else {
             std::stringstream stream;
-            stream << lastTrack;
+            stream << trackRecognizer.track();
             std::string data = stream.str();
             if (file.write(data.data(), data.length()) != data.length()) {
                 QMessageBox::critical(this, "Error while saving track", "Unable to write to opened file");
             }
         }
     }
-    Model previousModel = commitedModel;
-    PFigure modifiedFigure = recognize(lastTrack, commitedModel);
+    finishRecognitionPreview();
+    beginCommit();
+    PFigure modifiedFigure = trackRecognizer.recognize(commitedModel);
     if (_gridStep > 0 && modifiedFigure) {
         GridAlignLayouter layouter(_gridStep);
         layouter.updateLayout(commitedModel, modifiedFigure);
-        commitedModel.recalculate();
     }
 
-    visibleTracks.push_back(lastTrack);
+    visibleTracks.push_back(trackRecognizer.track());
     auto iterator = --visibleTracks.end();
     QTimer *timer = new QTimer(this);
 
@@ -411,13 +636,8 @@ void Ui::ModelWidget::mouseReleaseEvent(QMouseEvent *event) {
     timer->setSingleShot(true);
     timer->start();
 
-    lastTrack = Track();
-    if (modifiedFigure) {
-        previousModels.push_back(previousModel);
-        redoModels.clear();
-        emit canUndoChanged();
-        emit canRedoChanged();
-    }
+    resetTrack();
+    endCommit(!!modifiedFigure);
     emit canGetSelectedMimeDataChanged();
     update();
 }
@@ -425,7 +645,7 @@ void Ui::ModelWidget::keyReleaseEvent(QKeyEvent *event) {
     event->ignore();
     if (event->key() == Qt::Key_Escape && mouseAction == MouseAction::TrackActive) {
         event->accept();
-        lastTrack = Track();
+        resetTrack();
         mouseAction = MouseAction::None;
         update();
     }
@@ -433,12 +653,7 @@ void Ui::ModelWidget::keyReleaseEvent(QKeyEvent *event) {
         if (commitedModel.selectedFigure) {
             event->accept();
             modifyModelAndCommit([this]() {
-                for (auto it = commitedModel.begin(); it != commitedModel.end(); it++) {
-                    if (*it == commitedModel.selectedFigure) {
-                        commitedModel.removeFigure(it);
-                        break;
-                    }
-                }
+                commitedModel.removeFigure(commitedModel.find(commitedModel.selectedFigure));
             });
         }
     }
@@ -452,7 +667,7 @@ void Ui::ModelWidget::mouseDoubleClickEvent(QMouseEvent *event) {
     Point eventPos = scaler(event->pos());
     bool hit = false;
     hit |= figure->isInsideOrOnBorder(eventPos);
-    hit |= figure->getApproximateDistanceToBorder(eventPos) <= figureSelectGap();
+    hit |= figure->getApproximateDistanceToBorder(eventPos) <= _recognitionContext.figureSelectGap;
     if (!hit) { return; }
 
     event->accept();
@@ -461,8 +676,8 @@ void Ui::ModelWidget::mouseDoubleClickEvent(QMouseEvent *event) {
                                              QString::fromStdString(figure->label()),
                                                       &ok);
     if (ok) {
-        modifyModelAndCommit([figure, &newLabel]() {
-            figure->setLabel(newLabel.toStdString());
+        modifyModelAndCommit([this, &newLabel]() {
+            commitedModel.modify(commitedModel.selectedFigure)->setLabel(newLabel.toStdString());
         });
     }
 }
@@ -486,7 +701,7 @@ bool Ui::ModelWidget::event(QEvent *event) {
         if (gesture) {
             gevent->accept(gesture);
 
-            lastTrack = Track();
+            resetTrack();
             mouseAction = MouseAction::None;
 
             scaler.zeroPoint = scaler.zeroPoint + scaler(gesture->lastCenterPoint()) - scaler(gesture->centerPoint());
@@ -4,9 +4,31 @@
 #include <QWidget>
 #include <QElapsedTimer>
 #include <QMimeData>
+#include <QPixmap>
 #include <list>
 #include "model.h"
 #include "figurepainter.h"
+#include "recognition.h"
+#include "recognition_worker.h"
+#include "track_filter.h"
+
+enum class UndoMode {
+    Snapshots, // snapshot of the whole model is stored for each step (unchanged figures are shared)
+    Changes    // only changes are stored, oldest ones are dropped when memory budget is exceeded
+};
+
+// Figures of the model drawn last time, the others were out of the widget
+struct PaintStatistics {
+    size_t drawnFigures, culledFigures;
+    // the model was taken from the cache drawn earlier, the numbers above are of that drawing
+    bool fromCache;
+
+    PaintStatistics() : drawnFigures(0), culledFigures(0), fromCache(false) {}
+};
+
+// Figures of the model look the same with the preview applied, so they may be taken from a cache
+// (the added figure is drawn over them)
+bool isModelUnchanged(const EditPreview &preview, const Model &model);
 
 namespace Ui {
 class ModelWidget : public QWidget {
@@ -16,6 +38,7 @@ public:
     void setModel(Model model);
     void addModelExtraTrack(Track extraTrack);
     Model &getModel();
+    const RecognitionContext &recognitionContext();
 
     bool canUndo();
     void undo();
@@ -23,6 +46,14 @@ public:
     bool canRedo();
     void redo();
 
+    UndoMode undoMode();
+    // Clears undo/redo history
+    void setUndoMode(UndoMode newUndoMode);
+
+    // In bytes, applies to UndoMode::Changes only
+    size_t undoMemoryBudget();
+    void setUndoMemoryBudget(size_t newUndoMemoryBudget);
+
     int gridStep();
     void setGridStep(int newGridStep);
 
@@ -38,11 +69,17 @@ public:
     bool storeTracks();
     void setStoreTracks(bool newStoreTracks);
 
+    // Applies to the next track
+    const TrackFilterSettings &trackFilterSettings();
+    void setTrackFilterSettings(const TrackFilterSettings &newTrackFilterSettings);
+
     bool canGetSelectedMimeData();
     QMimeData *selectedMimeData();
     bool canPasteMimeData(const QMimeData *mimeData);
     void pasteMimeData(const QMimeData *mimeData);
 
+    const PaintStatistics &paintStatistics();
+
 protected:
     void paintEvent(QPaintEvent *event) override;
     void mousePressEvent(QMouseEvent *event) override;
@@ -55,6 +92,8 @@ protected:
     Model commitedModel;
     std::list<Model> previousModels;
     std::list<Model> redoModels;
+    std::list<ModelChange> undoChanges;
+    std::list<ModelChange> redoChanges;
 
 private:
     enum MouseAction {
@@ -63,7 +102,12 @@ private:
         ViewpointMove
     };
 
-    Track lastTrack;
+    RecognitionContext _recognitionContext;
+    TrackFilter trackFilter;
+    StreamingRecognizer trackRecognizer;
+    RecognitionWorker recognitionWorker;
+    // Snapshot of commitedModel passed to recognitionWorker, taken once per its version and selection
+    std::shared_ptr<const Model> recognitionSnapshot;
     std::vector<Track> extraTracks;
     QElapsedTimer trackTimer;
 
@@ -78,8 +122,45 @@ private:
     bool _showRecognitionResult;
     bool _storeTracks;
 
+    UndoMode _undoMode;
+    size_t _undoMemoryBudget;
+    size_t undoChangesMemory;
+    Model uncommitedSnapshot;
+
+    // Everything which changes the look of modelCache
+    struct ModelCacheKey {
+        size_t modelVersion;
+        const Figure *selectedFigure;
+        Point zeroPoint;
+        double scaleFactor;
+        QSize size;
+        qreal devicePixelRatio;
+        int gridStep;
+
+        bool operator==(const ModelCacheKey &other) const {
+            return modelVersion == other.modelVersion && selectedFigure == other.selectedFigure
+                    && zeroPoint == other.zeroPoint && scaleFactor == other.scaleFactor
+                    && size == other.size && devicePixelRatio == other.devicePixelRatio && gridStep == other.gridStep;
+        }
+    };
+    // Grid and figures of commitedModel, so strokes repaint the image and the track only
+    QPixmap modelCache;
+    ModelCacheKey modelCacheKey;
+    PaintStatistics _paintStatistics;
+
+    void resetTrack();
+    void addTrackPoints(const std::vector<TrackPoint> &points);
+    void requestRecognitionPreview(bool wholeTrack = false);
+    // Lets the worker calculate the edit for the finished track if it is not busy with an older one
+    void finishRecognitionPreview();
+    void beginCommit();
+    void endCommit(bool modified);
+    void shrinkUndoChanges();
     void modifyModelAndCommit(std::function<void()> action);
     void customContextMenuRequested(const QPoint &pos);
+    ModelCacheKey currentModelCacheKey();
+    // Draws background, grid and figures of commitedModel changed by the preview
+    void drawModel(QPainter &painter, const EditPreview &preview);
 
 signals:
     void canUndoChanged();
@@ -0,0 +1,247 @@
+#ifndef PERSISTENT_MAP_H
+#define PERSISTENT_MAP_H
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/*
+ * Ordered map with cheap copies: a copy shares all nodes with the original and takes O(1),
+ * a change of either copies only the O(log N) nodes on the path to the changed key
+ * (treap with path copying). Nodes are never changed after construction, so a copy
+ * may be read from other threads while the original is changed.
+ * Priorities are hashes of keys, so the shape of the tree depends on its keys only.
+ */
+template<typename Key, typename Value, typename Compare = std::less<Key>, typename Hash = std::hash<Key>>
+class PersistentMap {
+public:
+    typedef std::pair<Key, Value> value_type;
+
+private:
+    struct Node;
+    typedef std::shared_ptr<const Node> PNode;
+    struct Node {
+        value_type item;
+        size_t priority;
+        PNode left, right;
+
+        Node(const value_type &item, size_t priority, PNode left, PNode right)
+            : item(item), priority(priority), left(std::move(left)), right(std::move(right)) {}
+    };
+
+public:
+    /*
+     * Iterates in order of keys. The iterator keeps the version of the map it was taken from,
+     * so it stays valid (and does not see changes) when the map is changed.
+     */
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename PersistentMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef const value_type &reference;
+
+        const_iterator() {}
+
+        reference operator*() const { return path.back()->item; }
+        pointer operator->() const { return &path.back()->item; }
+        const_iterator &operator++() {
+            const Node *node = path.back();
+            path.pop_back();
+            pushLeftmost(node->right.get());
+            if (path.empty()) {
+                root.reset();
+            }
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator result = *this;
+            ++*this;
+            return result;
+        }
+        bool operator==(const const_iterator &other) const {
+            return path.empty() ? other.path.empty() : !other.path.empty() && path.back() == other.path.back();
+        }
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        friend class PersistentMap;
+        PNode root;
+        // nodes which are not visited yet and whose left subtrees are visited (or being visited)
+        std::vector<const Node*> path;
+
+        void pushLeftmost(const Node *node) {
+            for (; node; node = node->left.get()) {
+                path.push_back(node);
+            }
+        }
+    };
+
+    PersistentMap() : count(0) {}
+    PersistentMap(const PersistentMap &other) = default;
+    PersistentMap(PersistentMap &&other) : root(std::move(other.root)), count(other.count) {
+        other.count = 0;
+    }
+    PersistentMap &operator=(const PersistentMap &other) = default;
+    PersistentMap &operator=(PersistentMap &&other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap(PersistentMap &other) {
+        root.swap(other.root);
+        std::swap(count, other.count);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() {
+        root.reset();
+        count = 0;
+    }
+
+    const_iterator begin() const {
+        const_iterator result;
+        result.pushLeftmost(root.get());
+        if (!result.path.empty()) {
+            result.root = root;
+        }
+        return result;
+    }
+    const_iterator end() const {
+        return const_iterator();
+    }
+    const_iterator find(const Key &key) const {
+        const_iterator result;
+        for (const Node *node = root.get(); node;) {
+            if (compare(key, node->item.first)) {
+                result.path.push_back(node);
+                node = node->left.get();
+            } else if (compare(node->item.first, key)) {
+                node = node->right.get();
+            } else {
+                result.path.push_back(node);
+                result.root = root;
+                return result;
+            }
+        }
+        return end();
+    }
+    // Returns nullptr if there is no such key, the pointer is valid till the map is changed
+    const Value *get(const Key &key) const {
+        for (const Node *node = root.get(); node;) {
+            if (compare(key, node->item.first)) {
+                node = node->left.get();
+            } else if (compare(node->item.first, key)) {
+                node = node->right.get();
+            } else {
+                return &node->item.second;
+            }
+        }
+        return nullptr;
+    }
+
+    // Inserts the key or replaces its value
+    void set(const Key &key, const Value &value) {
+        bool inserted = false;
+        root = set(root, value_type(key, value), getPriority(key), inserted);
+        count += inserted;
+    }
+    // Returns false if there is no such key
+    bool erase(const Key &key) {
+        bool erased = false;
+        root = erase(root, key, erased);
+        count -= erased;
+        return erased;
+    }
+
+private:
+    PNode root;
+    size_t count;
+
+    static bool compare(const Key &a, const Key &b) {
+        return Compare()(a, b);
+    }
+    static size_t getPriority(const Key &key) {
+        // splitmix64 finalizer, as standard hashes of integers and pointers are identities
+        unsigned long long x = Hash()(key);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return (size_t)(x ^ (x >> 31));
+    }
+    static PNode makeNode(const value_type &item, size_t priority, PNode left, PNode right) {
+        return std::make_shared<const Node>(item, priority, std::move(left), std::move(right));
+    }
+
+    // Splits keys into ones less than 'key' and the other ones
+    static void split(const PNode &node, const Key &key, PNode &less, PNode &notLess) {
+        if (!node) {
+            less.reset();
+            notLess.reset();
+        } else if (compare(node->item.first, key)) {
+            PNode right;
+            split(node->right, key, right, notLess);
+            less = makeNode(node->item, node->priority, node->left, std::move(right));
+        } else {
+            PNode left;
+            split(node->left, key, less, left);
+            notLess = makeNode(node->item, node->priority, std::move(left), node->right);
+        }
+    }
+    // All keys of 'a' should be less than keys of 'b'
+    static PNode merge(const PNode &a, const PNode &b) {
+        if (!a) { return b; }
+        if (!b) { return a; }
+        if (a->priority > b->priority) {
+            return makeNode(a->item, a->priority, a->left, merge(a->right, b));
+        } else {
+            return makeNode(b->item, b->priority, merge(a, b->left), b->right);
+        }
+    }
+
+    static PNode set(const PNode &node, const value_type &item, size_t priority, bool &inserted) {
+        if (!node) {
+            inserted = true;
+            return makeNode(item, priority, nullptr, nullptr);
+        }
+        const Key &key = item.first;
+        bool isLess = compare(key, node->item.first), isGreater = compare(node->item.first, key);
+        // the key is not in the subtree, as priorities of nodes are not greater than their parents' ones
+        if ((isLess || isGreater) && priority > node->priority) {
+            inserted = true;
+            PNode less, notLess;
+            split(node, key, less, notLess);
+            return makeNode(item, priority, std::move(less), std::move(notLess));
+        }
+        if (isLess) {
+            return makeNode(node->item, node->priority, set(node->left, item, priority, inserted), node->right);
+        } else if (isGreater) {
+            return makeNode(node->item, node->priority, node->left, set(node->right, item, priority, inserted));
+        } else {
+            return makeNode(item, node->priority, node->left, node->right);
+        }
+    }
+
+    static PNode erase(const PNode &node, const Key &key, bool &erased) {
+        if (!node) {
+            return nullptr;
+        }
+        if (compare(key, node->item.first)) {
+            PNode left = erase(node->left, key, erased);
+            return erased ? makeNode(node->item, node->priority, std::move(left), node->right) : node;
+        } else if (compare(node->item.first, key)) {
+            PNode right = erase(node->right, key, erased);
+            return erased ? makeNode(node->item, node->priority, node->left, std::move(right)) : node;
+        }
+        erased = true;
+        return merge(node->left, node->right);
+    }
+};
+
+#endif // PERSISTENT_MAP_H
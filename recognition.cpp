@@ -1,88 +1,48 @@
 #include "model.h"
 #include "recognition.h"
+#include "tracing.h"
 #include <memory>
 #include <algorithm>
 #include <vector>
 #include <cmath>
+#include <atomic>
+#include <chrono>
 
 using std::min;
 using std::max;
 using std::make_shared;
 using std::dynamic_pointer_cast;
 
-int FIGURE_SELECT_GAP = -1;
-int MIN_CLOSED_FIGURE_GAP = -1;
-const int TRACK_FIT_GAP = 10;
-const int DELETION_MOVE_MAX_ANGLE = 30;
-const int DELETION_MOVE_MIN_COUNT = 3;
-const int DELETION_MAX_TIME = 1000;
-const double SQUARING_MIN_RATIO = 0.8;
-const double MIN_FIT_POINTS_AMOUNT = 0.75;
+const double INSIDE_QUERY_GAP = 1e-6; // isInsideOrOnBorder() allows small errors
 
-void setRecognitionPreset(RecognitionPreset preset) {
+RecognitionContext::RecognitionContext(RecognitionPreset preset)
+    : preset(preset), speedStopThreshold(0.07), curveSpeedStopThreshold(0.02), stopArea(15)
+    , trackFitGap(10), minFitPointsAmount(0.75), squaringMinRatio(0.8)
+    , deletionMoveMaxAngle(30), deletionMoveMinCount(3), deletionMaxTime(1000) {
     switch (preset) {
     case RecognitionPreset::Mouse:
-        FIGURE_SELECT_GAP = 10;
-        MIN_CLOSED_FIGURE_GAP = 10;
+        figureSelectGap = 10;
+        minClosedFigureGap = 10;
         break;
     case RecognitionPreset::Touch:
-        FIGURE_SELECT_GAP = 30;
-        MIN_CLOSED_FIGURE_GAP = 50;
+        figureSelectGap = 30;
+        minClosedFigureGap = 50;
         break;
     };
 }
 
-int figureSelectGap() {
-    return FIGURE_SELECT_GAP;
-}
-
-BoundingBox getBoundingBox(const Track &track) {
-    BoundingBox res;
-    res.leftUp = res.rightDown = track[0];
-    for (Point p : track.points) {
-        res.leftUp.x = min(res.leftUp.x, p.x);
-        res.leftUp.y = min(res.leftUp.y, p.y);
-        res.rightDown.x = max(res.rightDown.x, p.x);
-        res.rightDown.y = max(res.rightDown.y, p.y);
-    }
-    return res;
-}
-
-double getClosedFigureGap(const BoundingBox &box) {
+double getClosedFigureGap(const RecognitionContext &context, const BoundingBox &box) {
     return std::max(
-                (double)MIN_CLOSED_FIGURE_GAP,
+                (double)context.minClosedFigureGap,
                 std::max(box.width(), box.height()) * 0.1
                 );
 }
 
-double getClosedFigureGap(const Track &track) {
-    return getClosedFigureGap(getBoundingBox(track));
-}
-double getClosedFigureGap(const std::vector<Point> &points) {
-    BoundingBox box;
-    for (Point p : points) {
-        box.addPoint(p);
-    }
-    return getClosedFigureGap(box);
-}
 
-double getCircumference(const Track &track) {
-    double res = 0;
-    for (size_t i = 0; i + 1 < track.size(); i++) {
-        res += (track[i + 1] - track[i]).length();
-    }
-    return res;
-}
-double getClosedCircumference(const Track &track) {
-    double res = getCircumference(track);
-    res += (track[0] - track[track.size() - 1]).length();
-    return res;
-}
 
-bool cutToClosedFromEnd(Track &track) {
+bool cutToClosedFromEnd(const double CLOSED_FIGURE_GAP, Track &track) {
     auto &points = track.points;
     auto it = points.begin();
-    const double CLOSED_FIGURE_GAP = getClosedFigureGap(track);
     if ((points[0] - points.back()).length() > CLOSED_FIGURE_GAP * 3) {
         return false;
     }
@@ -102,36 +62,48 @@ bool cutToClosedFromEnd(Track &track) {
     return true;
 }
 
-bool cutToClosed(Track &track) {
-    if (cutToClosedFromEnd(track)) return true;
+// Closed figure gap is the one of the whole track, it does not change while cutting
+bool cutToClosed(const double closedFigureGap, Track &track) {
+    if (cutToClosedFromEnd(closedFigureGap, track)) return true;
 
     reverse(track.points.begin(), track.points.end());
-    bool result = cutToClosedFromEnd(track);
+    bool result = cutToClosedFromEnd(closedFigureGap, track);
     reverse(track.points.begin(), track.points.end());
     return result;
 }
 
 // (amount of point fitted, -(average error))
-std::pair<double, double> fitsToTrack(const Track &track, const PFigure &figure) {
-    BoundingBox box = getBoundingBox(track);
-    double maxDistanceX = std::max((double)TRACK_FIT_GAP, box.width() * 0.1);
-    double maxDistanceY = std::max((double)TRACK_FIT_GAP, box.height() * 0.1);
+std::pair<double, double> fitsToTrack(const RecognitionContext &context, TrackFeatures &features, Figure &figure) {
+    const Track &track = features.track();
+    const BoundingBox &box = features.boundingBox();
+    double maxDistanceX = std::max(context.trackFitGap, box.width() * 0.1);
+    double maxDistanceY = std::max(context.trackFitGap, box.height() * 0.1);
     double failDistanceX = maxDistanceX * 2;
     double failDistanceY = maxDistanceY * 2;
 
+    // nearest points are requested by chunks into buffers on the stack, figures stop after the first failed point
+    const size_t CHUNK_SIZE = 64;
+    const TrackColumns &columns = features.columns();
+    double nearestX[CHUNK_SIZE], nearestY[CHUNK_SIZE];
+
     int goodCount = 0;
     double averageError = 0;
-    for (Point p : track.points) {
-        Point p2 = figure->getApproximateNearestPointOnBorder(p);
-        double dx = fabs(p.x - p2.x);
-        double dy = fabs(p.y - p2.y);
-        if (dx > failDistanceX || dy > failDistanceY) { return std::make_pair(0, 0); }
-        goodCount += dx <= maxDistanceX && dy <= maxDistanceY;
+    for (size_t start = 0; start < columns.size(); start += CHUNK_SIZE) {
+        size_t count = std::min(CHUNK_SIZE, columns.size() - start);
+        const double *x = columns.x.data() + start, *y = columns.y.data() + start;
+        size_t processed = figure.getApproximateNearestPointsOnBorder(x, y, count, failDistanceX, failDistanceY, nearestX, nearestY);
+        for (size_t i = 0; i < processed; i++) {
+            double dx = fabs(x[i] - nearestX[i]);
+            double dy = fabs(y[i] - nearestY[i]);
+            if (dx > failDistanceX || dy > failDistanceY) { return std::make_pair(0, 0); }
+            goodCount += dx <= maxDistanceX && dy <= maxDistanceY;
 
-        dx /= maxDistanceX;
-        dy /= maxDistanceY;
-        double error = dx * dx + dy * dy;
-        averageError += error;
+            dx /= maxDistanceX;
+            dy /= maxDistanceY;
+            double error = dx * dx + dy * dy;
+            averageError += error;
+        }
+        assert(processed == count);
     }
     averageError /= track.size();
     averageError = sqrt(averageError);
@@ -147,9 +119,8 @@ double getAngle(Point v1, Point v2) {
     return atan2(v.y, v.x);
 }
 
-bool isDeletionTrack(const Track &track) {
-    std::vector<int> stops = getSpeedBreakpoints(track);
-    if (track.points.back().time > DELETION_MAX_TIME) {
+bool isDeletionTrack(const RecognitionContext &context, const Track &track) {
+    if (track.points.back().time > context.deletionMaxTime) {
         return false;
     }
     int cnt = 0;
@@ -159,62 +130,59 @@ bool isDeletionTrack(const Track &track) {
         double ang = fabs(getAngle(v1, v2));
         if (std::isnan(ang)) continue;
         ang = std::min(ang, 2 * PI - ang);
-        if (ang < DELETION_MOVE_MAX_ANGLE * PI / 180) {
+        if (ang < context.deletionMoveMaxAngle * PI / 180) {
             cnt++;
         }
     }
-    return cnt >= DELETION_MOVE_MIN_COUNT;
+    return cnt >= context.deletionMoveMinCount;
 }
 
-PFigure recognizeConnections(const Track &track, Model &model) {
+RecognizedEdit recognizeConnections(const Track &track, const Model &model, RecognitionScratch &scratch) {
     Point start = track[0];
     Point end = track[track.size() - 1];
 
-    for (auto it = model.begin(); it != model.end(); it++) {
-        PFigure figure = *it;
+    model.figuresNear(start, INSIDE_QUERY_GAP, scratch.figuresNearStart);
+    model.figuresNear(end, INSIDE_QUERY_GAP, scratch.figuresNearEnd);
+    for (const PFigure &figure : scratch.figuresNearStart) {
         auto figA = dynamic_pointer_cast<BoundedFigure>(figure);
         if (!figA) { continue; }
         if (!figure->isInsideOrOnBorder(start)) { continue; }
-        for (PFigure figure2 : model) {
+        for (const PFigure &figure2 : scratch.figuresNearEnd) {
             if (figure == figure2) {
                 continue;
             }
             auto figB = dynamic_pointer_cast<BoundedFigure>(figure2);
             if (figB && figB->isInsideOrOnBorder(end)) {
-                auto result = make_shared<SegmentConnection>(figA, figB);
-                model.addFigure(result);
-                return result;
+                return RecognizedEdit(RecognizedEdit::Action::Add, make_shared<SegmentConnection>(figA, figB));
             }
         }
     }
-    return nullptr;
+    return RecognizedEdit();
 }
 
-PFigure recognizeGrabs(const Track &track, Model &model) {
+RecognizedEdit recognizeGrabs(const RecognitionContext &context, const Track &track, const Model &model, RecognitionScratch &scratch) {
     Point start = track[0];
     Point end = track[track.size() - 1];
 
-    for (auto it = model.begin(); it != model.end(); it++) {
-        PFigure figure = *it;
-        if (figure->getApproximateDistanceToBorder(start) <= FIGURE_SELECT_GAP) { // grabbed
+    model.figuresNear(start, context.figureSelectGap, scratch.figuresNearStart);
+    for (const PFigure &figure : scratch.figuresNearStart) {
+        if (figure->getApproximateDistanceToBorder(start) <= context.figureSelectGap) { // grabbed
             // recognize deletion
-            if (isDeletionTrack(track)) {
-                model.removeFigure(it);
-                return figure;
+            if (isDeletionTrack(context, track)) {
+                return RecognizedEdit(RecognizedEdit::Action::Remove, figure);
             }
 
             // try connection
             auto figA = dynamic_pointer_cast<BoundedFigure>(figure);
             if (figA) {
-                for (PFigure figure2 : model) {
+                model.figuresNear(end, context.figureSelectGap, scratch.figuresNearEnd);
+                for (const PFigure &figure2 : scratch.figuresNearEnd) {
                     if (figure == figure2) {
                         continue;
                     }
                     auto figB = dynamic_pointer_cast<BoundedFigure>(figure2);
-                    if (figB && figB->getApproximateDistanceToBorder(end) <= FIGURE_SELECT_GAP) {
-                        auto result = make_shared<SegmentConnection>(figA, figB);
-                        model.addFigure(result);
-                        return result;
+                    if (figB && figB->getApproximateDistanceToBorder(end) <= context.figureSelectGap) {
+                        return RecognizedEdit(RecognizedEdit::Action::Add, make_shared<SegmentConnection>(figA, figB));
                     }
                 }
             }
@@ -222,23 +190,23 @@ PFigure recognizeGrabs(const Track &track, Model &model) {
             // now we try translation
             // but only if figure was selected previously (#65)
             if (figure == model.selectedFigure) {
-                figure->translate(end - start);
-                model.recalculate();
-                return figure;
+                RecognizedEdit result(RecognizedEdit::Action::Translate, figure);
+                result.translation = end - start;
+                return result;
             }
         }
     }
-    return nullptr;
+    return RecognizedEdit();
 }
 
-void squareBoundedFigure(PBoundedFigure figure) {
+void squareBoundedFigure(const RecognitionContext &context, PBoundedFigure figure) {
     BoundingBox box = figure->getBoundingBox();
     double siz1 = box.width();
     double siz2 = box.height();
     if (siz1 > siz2) {
         std::swap(siz1, siz2);
     }
-    if (siz1 / siz2 < SQUARING_MIN_RATIO) { return; }
+    if (siz1 / siz2 < context.squaringMinRatio) { return; }
 
     double siz = (siz1 + siz2) / 2;
     box.rightDown = box.leftUp + Point(siz, siz);
@@ -256,43 +224,34 @@ struct SelectionFit {
         return distance < other.distance;
     }
 };
-PFigure recognizeClicks(const Point &click, Model &model) {
+RecognizedEdit recognizeClicks(const RecognitionContext &context, const Point &click, const Model &model, RecognitionScratch &scratch) {
     SelectionFit bestFit;
-    for (PFigure figure : model) {
+    model.figuresNear(click, context.figureSelectGap, scratch.figuresNearStart);
+    for (const PFigure &figure : scratch.figuresNearStart) {
         SelectionFit currentFit;
         currentFit.isArrowable = !!dynamic_pointer_cast<Segment>(figure) || !!dynamic_pointer_cast<Curve>(figure);
         currentFit.distance = figure->getApproximateDistanceToBorder(click);
         currentFit.figure = figure;
-        if (currentFit.distance >= FIGURE_SELECT_GAP) { continue; }
+        if (currentFit.distance >= context.figureSelectGap) { continue; }
         bestFit = min(bestFit, currentFit);
     }
-    if (bestFit.figure) {
-        model.selectedFigure = bestFit.figure;
-    } else {
-        bool found = false;
-        for (PFigure figure : model) {
+    RecognizedEdit result(RecognizedEdit::Action::Click, bestFit.figure);
+    if (!bestFit.figure) {
+        model.figuresNear(click, INSIDE_QUERY_GAP, scratch.figuresNearStart);
+        for (const PFigure &figure : scratch.figuresNearStart) {
             if (figure->isInsideOrOnBorder(click)) {
-                model.selectedFigure = figure;
-                found = true;
+                result.figure = figure;
             }
         }
-        if (!found) {
-            model.selectedFigure = nullptr;
-        }
     }
 
-    std::shared_ptr<Segment> segm = dynamic_pointer_cast<Segment>(model.selectedFigure);
+    std::shared_ptr<Segment> segm = dynamic_pointer_cast<Segment>(result.figure);
     if (segm) {
-        if ((click - segm->getA()).length() <= FIGURE_SELECT_GAP) {
-            segm->setArrowedA(!segm->getArrowedA());
-        }
-        if ((click - segm->getB()).length() <= FIGURE_SELECT_GAP) {
-            segm->setArrowedB(!segm->getArrowedB());
-        }
-        return segm;
+        result.toggleA = (click - segm->getA()).length() <= context.figureSelectGap;
+        result.toggleB = (click - segm->getB()).length() <= context.figureSelectGap;
     }
 
-    std::shared_ptr<Curve> curve = dynamic_pointer_cast<Curve>(model.selectedFigure);
+    std::shared_ptr<Curve> curve = dynamic_pointer_cast<Curve>(result.figure);
     if (curve) {
         std::pair<double, size_t> nearestSegment(INFINITY, 0);
         for (size_t i = 0; i < curve->arrowBegin.size(); i++) {
@@ -300,19 +259,131 @@ PFigure recognizeClicks(const Point &click, Model &model) {
             double currentDistance = s.getApproximateDistanceToBorder(click);
             nearestSegment = std::min(nearestSegment, std::make_pair(currentDistance, i));
         }
-        if (nearestSegment.first <= FIGURE_SELECT_GAP) {
+        if (nearestSegment.first <= context.figureSelectGap) {
             size_t i = nearestSegment.second;
             Point a = curve->points[i], b = curve->points[i + 1];
-            if ((click - a).length() <= FIGURE_SELECT_GAP) {
-                curve->arrowBegin[i] = !curve->arrowBegin[i];
+            result.curveSegment = i;
+            result.toggleA = (click - a).length() <= context.figureSelectGap;
+            result.toggleB = (click - b).length() <= context.figureSelectGap;
+        }
+    }
+    return result;
+}
+
+// Toggles arrows of the figure in place
+void toggleArrows(const RecognizedEdit &edit, const PFigure &figure) {
+    if (auto segm = dynamic_pointer_cast<Segment>(figure)) {
+        if (edit.toggleA) {
+            segm->setArrowedA(!segm->getArrowedA());
+        }
+        if (edit.toggleB) {
+            segm->setArrowedB(!segm->getArrowedB());
+        }
+    } else if (auto curve = dynamic_pointer_cast<Curve>(figure)) {
+        if (edit.toggleA) {
+            curve->arrowBegin[edit.curveSegment] = !curve->arrowBegin[edit.curveSegment];
+        }
+        if (edit.toggleB) {
+            curve->arrowEnd[edit.curveSegment] = !curve->arrowEnd[edit.curveSegment];
+        }
+        curve->resetPaintCache();
+    }
+}
+
+// Only segments and curves are reported as modified by clicks
+bool isArrowable(const PFigure &figure) {
+    return !!dynamic_pointer_cast<Segment>(figure) || !!dynamic_pointer_cast<Curve>(figure);
+}
+
+PFigure RecognizedEdit::apply(Model &model) const {
+    switch (action) {
+    case Action::None:
+        return nullptr;
+    case Action::Click: {
+        model.selectedFigure = figure;
+        if (!isArrowable(figure)) {
+            return nullptr;
+        }
+        if (!toggleA && !toggleB) {
+            return figure;
+        }
+        PFigure result = model.modify(figure);
+        toggleArrows(*this, result);
+        return result;
+    }
+    case Action::Add:
+        model.addFigure(figure);
+        return figure;
+    case Action::Remove:
+        model.removeFigure(model.find(figure));
+        return figure;
+    case Action::Translate:
+        return model.translate(figure, translation);
+    }
+    return nullptr;
+}
+
+// Same as cloning by Model::modify()
+PFigure cloneForPreview(const PFigure &figure, const PFigure &replacedDependency, const PFigure &replacement) {
+    std::map<PFigure, PFigure> mapping;
+    for (PFigure dependency : figure->getDependencies()) {
+        mapping[dependency] = dependency == replacedDependency ? replacement : dependency;
+    }
+    return clone(figure, mapping);
+}
+
+EditPreview previewEdit(const RecognizedEdit &edit, const Model &model) {
+    EditPreview result;
+    result.selectedFigure = model.selectedFigure;
+    switch (edit.action) {
+    case RecognizedEdit::Action::None:
+        break;
+    case RecognizedEdit::Action::Click:
+        result.selectedFigure = edit.figure;
+        if (isArrowable(edit.figure)) {
+            result.modified = edit.figure;
+            if (edit.toggleA || edit.toggleB) {
+                result.modified = cloneForPreview(edit.figure, nullptr, nullptr);
+                toggleArrows(edit, result.modified);
+                result.replaced[edit.figure] = result.modified;
+                result.selectedFigure = result.modified;
+            }
+        }
+        break;
+    case RecognizedEdit::Action::Add:
+        result.added = result.modified = edit.figure;
+        break;
+    case RecognizedEdit::Action::Remove: {
+        result.modified = edit.figure;
+        std::vector<PFigure> toRemove { edit.figure };
+        while (!toRemove.empty()) {
+            PFigure current = toRemove.back();
+            toRemove.pop_back();
+            if (!result.replaced.insert(std::make_pair(current, nullptr)).second) { continue; }
+            if (current == result.selectedFigure) {
+                result.selectedFigure = nullptr;
             }
-            if ((click - b).length() <= FIGURE_SELECT_GAP) {
-                curve->arrowEnd[i] = !curve->arrowEnd[i];
+            for (PFigure dependent : model.getDependents(current)) {
+                toRemove.push_back(dependent);
             }
         }
-        return curve;
+    }   break;
+    case RecognizedEdit::Action::Translate: {
+        PFigure translated = cloneForPreview(edit.figure, nullptr, nullptr);
+        translated->translate(edit.translation);
+        translated->recalculate();
+        result.replaced[edit.figure] = result.modified = translated;
+        if (result.selectedFigure == edit.figure) {
+            result.selectedFigure = translated;
+        }
+        for (PFigure dependent : model.getDependents(edit.figure)) {
+            PFigure moved = cloneForPreview(dependent, edit.figure, translated);
+            moved->recalculate();
+            result.replaced[dependent] = moved;
+        }
+    }   break;
     }
-    return nullptr;
+    return result;
 }
 
 /*
@@ -320,18 +391,17 @@ PFigure recognizeClicks(const Point &click, Model &model) {
  * Please note that this differs from center of mass of all points of track,
  * we calculate weighted sum of segments' centers (weight == length of segment)
  */
-Point getWeightedCenter(const Track &track) {
-    Point result;
-    double summaryLength = 0;
-    for (size_t i = 0; i < track.size(); i++) {
-        Point a = track[i];
-        Point b = track[(i + 1) % track.size()];
-        Point middle = (a + b) * 0.5;
-        double length = (b - a).length();
-        result += middle * length;
-        summaryLength += length;
-    }
-    result = result * (1.0 / summaryLength);
+Point getWeightedCenter(TrackFeatures &features) {
+    const Track &track = features.track();
+    const TrackColumns &columns = features.columns();
+    const std::vector<double> &lengths = features.segmentLengths();
+    Point result(kernels::segmentMiddlesDot(columns.x.data(), lengths.data(), lengths.size()),
+                 kernels::segmentMiddlesDot(columns.y.data(), lengths.data(), lengths.size()));
+    // the closing segment
+    Point a = track[track.size() - 1];
+    Point b = track[0];
+    result += (a + b) * 0.5 * (b - a).length();
+    result = result * (1.0 / features.closedCircumference());
     return result;
 }
 
@@ -344,11 +414,12 @@ Point getWeightedCenter(const Track &track) {
  * Points which differ from the center no more than width/4 are
  * considered 'horizontal segments' and vice-versa for vertical.
  */
-BoundingBox getBestFitRectangle(const Track &track) {
-    BoundingBox total = getBoundingBox(track);
+BoundingBox getBestFitRectangle(TrackFeatures &features) {
+    const Track &track = features.track();
+    const BoundingBox &total = features.boundingBox();
     double maxDx = total.width() / 4;
     double maxDy = total.height() / 4;
-    Point center = getWeightedCenter(track);
+    Point center = getWeightedCenter(features);
 
     double sumDx = 0, sumDy = 0;
     int countDx = 0, countDy = 0;
@@ -371,38 +442,92 @@ BoundingBox getBestFitRectangle(const Track &track) {
     return BoundingBox({ center - diff, center + diff });
 }
 
-std::vector<Point> smoothCurve(std::vector<Point> current) {
-    assert(!current.empty());
-    const double CLOSED_FIGURE_GAP = getClosedFigureGap(current);
-
-    Point start = current[0];
-    Point end = current.back();
-    if ((start - end).length() <= CLOSED_FIGURE_GAP) {
-        end = current.back() = start;
+/*
+ * Same as Segment(a, b).getApproximateDistanceToBorder(p) up to the last bit,
+ * but without constructing a figure, virtual calls and with the line equation normalized once.
+ */
+class SegmentDistance {
+public:
+    SegmentDistance(const Point &a, const Point &b) : a(a), b(b), hasLine(false) {
+        // Coefficients of A*x + B*y + C = 0
+        A = b.y - a.y;
+        B = a.x - b.x;
+        C = -A * a.x - B * a.y;
+        double D = sqrt(A * A + B * B);
+        if (fabs(D) >= 1e-8) { // otherwise the segment is degenerate
+            A /= D; B /= D; C /= D;
+            hasLine = true;
+        }
     }
-    Segment segment(start, end);
 
-    std::pair<double, size_t> maxDistance(0, 0);
-    for (size_t i = 0; i < current.size(); i++) {
-        double d = segment.getApproximateDistanceToBorder(current[i]);
-        maxDistance = max(maxDistance, std::make_pair(d, i));
+    double operator()(const Point &p) const {
+        double result = (a - p).length();
+        result = std::min(result, (b - p).length());
+        if (hasLine && Point::dotProduct(p - a, b - a) >= 0 && Point::dotProduct(p - b, a - b) >= 0) {
+            double dist = A * p.x + B * p.y + C;
+            Point nearest = p - Point(A, B) * dist;
+            result = std::min(result, (nearest - p).length());
+        }
+        return result;
     }
 
-    std::vector<Point> result;
-    if (maxDistance.first > TRACK_FIT_GAP) {
-        auto part1 = smoothCurve(std::vector<Point>(current.begin(), current.begin() + maxDistance.second + 1));
-        auto part2 = smoothCurve(std::vector<Point>(current.begin() + maxDistance.second, current.end()));
-        result.insert(result.end(), part1.begin(), part1.end());
-        result.insert(result.end(), part2.begin() + 1, part2.end());
-    } else {
-        result.push_back(start);
-        result.push_back(end);
+private:
+    Point a, b;
+    double A, B, C;
+    bool hasLine;
+};
+
+/*
+ * Douglas-Peucker simplification of points first..last of the track, appends the result.
+ * Each range is smoothed as a separate curve: if its ends are close, the last point
+ * is moved to the first one, which affects this range and ranges split from it only.
+ * Ranges left to smooth are kept in 'ranges' instead of recursion and copies of points.
+ */
+void smoothCurve(const RecognitionContext &context, const Track &track, size_t first, size_t last,
+                 std::vector<RecognitionScratch::SmoothingRange> &ranges, std::vector<Point> &result) {
+    assert(first <= last);
+    ranges.clear();
+    ranges.push_back(RecognitionScratch::SmoothingRange(first, last, track[last]));
+    result.push_back(track[first]);
+    while (!ranges.empty()) {
+        RecognitionScratch::SmoothingRange range = ranges.back();
+        ranges.pop_back();
+
+        BoundingBox box;
+        for (size_t i = range.first; i < range.last; i++) {
+            box.addPoint(track[i]);
+        }
+        box.addPoint(range.lastPoint);
+        const double CLOSED_FIGURE_GAP = getClosedFigureGap(context, box);
+
+        Point start = range.first < range.last ? (Point)track[range.first] : range.lastPoint;
+        Point end = range.lastPoint;
+        if ((start - end).length() <= CLOSED_FIGURE_GAP) {
+            end = start;
+        }
+        SegmentDistance distance(start, end);
+
+        // the last one of the farthest points
+        std::pair<double, size_t> maxDistance(0, 0);
+        for (size_t i = range.first; i < range.last; i++) {
+            maxDistance = max(maxDistance, std::make_pair(distance(track[i]), i - range.first));
+        }
+        maxDistance = max(maxDistance, std::make_pair(distance(end), range.last - range.first));
+
+        if (maxDistance.first > context.trackFitGap) {
+            size_t middle = range.first + maxDistance.second;
+            // the first half is processed first
+            ranges.push_back(RecognitionScratch::SmoothingRange(middle, range.last, end));
+            ranges.push_back(RecognitionScratch::SmoothingRange(range.first, middle, track[middle]));
+        } else {
+            result.push_back(end);
+        }
     }
-    return result;
 }
 
-bool hasStopNear(const Track &track, const std::vector<int> &stops, const Point &goal) {
-    const double MAX_STOP_DISTANCE = getClosedFigureGap(track) * 2;
+bool hasStopNear(const RecognitionContext &context, TrackFeatures &features, const std::vector<int> &stops, const Point &goal) {
+    const Track &track = features.track();
+    const double MAX_STOP_DISTANCE = getClosedFigureGap(context, features.boundingBox()) * 2;
     for (int id : stops) {
         Point p = track[id];
         if ((p - goal).length() <= MAX_STOP_DISTANCE) {
@@ -412,115 +537,216 @@ bool hasStopNear(const Track &track, const std::vector<int> &stops, const Point
     return false;
 }
 
-std::vector<int> getSpeedBreakpoints(const Track &track, const double SPEED_STOP_THRESHOLD);
+const char *recognitionStageName(RecognitionStage stage) {
+    switch (stage) {
+    case RecognitionStage::Clicks: return "clicks";
+    case RecognitionStage::Grabs: return "grabs";
+    case RecognitionStage::Connections: return "connections";
+    case RecognitionStage::CutToClosed: return "cutToClosed";
+    case RecognitionStage::CandidateFitting: return "candidate fitting";
+    case RecognitionStage::CurveSmoothing: return "curve smoothing";
+    case RecognitionStage::Count: break;
+    }
+    return "unknown";
+}
+
+// Measures time till stop() or destruction if 'times' is set, the stage is traced too
+class StageTimer {
+public:
+    StageTimer(RecognitionStageTimes *times, RecognitionStage stage) : times(times), stage(stage), trace(recognitionStageName(stage)) {
+        if (times) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~StageTimer() { stop(); }
 
-PFigure recognize(const Track &_track, Model &model) {
-    if (FIGURE_SELECT_GAP < 0 || MIN_CLOSED_FIGURE_GAP < 0) {
-        throw std::logic_error("Recognition preset is not selected");
+    void stop() {
+        trace.end();
+        if (times) {
+            (*times)[stage] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            times = nullptr;
+        }
     }
 
-    // this is to preserve the API (const Track&) and make future optimizations possible
-    // i.e. avoid copying if it's not necessary
-    Track track = _track;
-    if (track.empty()) { return nullptr; }
+private:
+    RecognitionStageTimes *times;
+    RecognitionStage stage;
+    tracing::Scope trace;
+    std::chrono::steady_clock::time_point start;
+};
 
-    const double CLOSED_FIGURE_GAP = getClosedFigureGap(track);
+// scratch.features should be reset to the track by the caller, as StreamingRecognizer already knows some of them
+RecognizedEdit recognizeEdit(const RecognitionContext &context, RecognitionScratch &scratch, const Model &model) {
+    TRACE_SCOPE("recognizeEdit");
+    TrackFeatures &features = scratch.features;
+    const Track &track = features.track();
+    if (scratch.stageTimes) {
+        scratch.stageTimes->clear();
+    }
+
+    const double CLOSED_FIGURE_GAP = getClosedFigureGap(context, features.boundingBox());
     // Very small tracks are clicks
-    if (getClosedCircumference(track) <= CLOSED_FIGURE_GAP) {
-        return recognizeClicks(track[0], model);
+    if (features.closedCircumference() <= CLOSED_FIGURE_GAP) {
+        StageTimer timer(scratch.stageTimes, RecognitionStage::Clicks);
+        return recognizeClicks(context, track[0], model, scratch);
     }
 
     // Moving and connecting
-    if (PFigure result = recognizeGrabs(track, model)) {
+    RecognizedEdit result;
+    {
+        StageTimer timer(scratch.stageTimes, RecognitionStage::Grabs);
+        result = recognizeGrabs(context, track, model, scratch);
+    }
+    if (result.action != RecognizedEdit::Action::None) {
         return result;
     }
 
     // Connecting interior-->interior
-    if (PFigure result = recognizeConnections(track, model)) {
+    {
+        StageTimer timer(scratch.stageTimes, RecognitionStage::Connections);
+        result = recognizeConnections(track, model, scratch);
+    }
+    if (result.action != RecognizedEdit::Action::None) {
         return result;
     }
 
     // Drawing new figures
-    std::vector<PFigure> candidates;
-    Track uncuttedTrack = track;
-    if (!cutToClosed(track))  {
-        std::vector<int> stops = getSpeedBreakpoints(track);
+    // candidates are fitted on stack, only the recognized one is allocated
+    Segment segment(track[0], track[track.size() - 1]);
+    Ellipse ellipse((BoundingBox()));
+    Rectangle rectangle((BoundingBox()));
+    Figure *candidates[2];
+    size_t candidatesCount = 0;
+
+    Track &cuttedTrack = scratch.cuttedTrack;
+    TrackFeatures &cuttedFeatures = scratch.cuttedFeatures;
+    bool isClosed;
+    {
+        StageTimer timer(scratch.stageTimes, RecognitionStage::CutToClosed);
+        cuttedTrack.points.assign(track.points.begin(), track.points.end());
+        isClosed = cutToClosed(CLOSED_FIGURE_GAP, cuttedTrack);
+        cuttedFeatures.reset(cuttedTrack);
+    }
+    // features of the whole track are still used for curves below
+    TrackFeatures &figureFeatures = isClosed ? cuttedFeatures : features;
+
+    StageTimer fittingTimer(scratch.stageTimes, RecognitionStage::CandidateFitting);
+    if (!isClosed)  {
+        const std::vector<int> &stops = features.stops(context.speedStopThreshold, context.stopArea);
         if (stops.size() >= 2) {
             Point start = track[0], end = track[track.size() - 1];
             bool ok = true;
             for (Point p : { start, end }) {
-                ok &= hasStopNear(track, stops, p);
+                ok &= hasStopNear(context, features, stops, p);
             }
             if (ok) {
-                candidates.push_back(make_shared<Segment>(track[0], track[track.size() - 1]));
+                candidates[candidatesCount++] = &segment;
             }
         }
     } else {
-        candidates.push_back(make_shared<Ellipse>(getBoundingBox(track)));
+        BoundingBox box = cuttedFeatures.boundingBox();
+        ellipse.setBoundingBox(box);
+        candidates[candidatesCount++] = &ellipse;
 
-        std::vector<int> stops = getSpeedBreakpoints(track);
+        const std::vector<int> &stops = cuttedFeatures.stops(context.speedStopThreshold, context.stopArea);
         // check that there were stops in corners
-        BoundingBox rect = getBestFitRectangle(track);
+        BoundingBox rect = getBestFitRectangle(cuttedFeatures);
         bool ok = stops.size() >= 4;
         for (Point corner : { rect.leftUp, rect.rightDown, rect.leftDown(), rect.rightUp() }) {
-            ok &= hasStopNear(track, stops, corner);
+            ok &= hasStopNear(context, cuttedFeatures, stops, corner);
         }
         if (ok) {
-            candidates.push_back(make_shared<Rectangle>(rect));
+            rectangle.setBoundingBox(rect);
+            candidates[candidatesCount++] = &rectangle;
         }
     }
 
-    if (candidates.empty()) { return nullptr; }
+    if (candidatesCount == 0) { return RecognizedEdit(); }
 
-    std::vector<std::pair<double, double> > fits;
-    for (PFigure figure : candidates) {
-        fits.push_back(fitsToTrack(track, figure));
+    // the first one of the best fits wins
+    size_t id = 0;
+    std::pair<double, double> bestFit = fitsToTrack(context, figureFeatures, *candidates[0]);
+    for (size_t i = 1; i < candidatesCount; i++) {
+        std::pair<double, double> fit = fitsToTrack(context, figureFeatures, *candidates[i]);
+        if (bestFit < fit) {
+            bestFit = fit;
+            id = i;
+        }
     }
-    size_t id = max_element(fits.begin(), fits.end()) - fits.begin();
-    if (fits[id].first >= MIN_FIT_POINTS_AMOUNT) { // we allow some of points to fall out of our track
-        auto boundedFigure = dynamic_pointer_cast<BoundedFigure>(candidates[id]);
-        if (boundedFigure) {
-            squareBoundedFigure(boundedFigure);
+    if (bestFit.first >= context.minFitPointsAmount) { // we allow some of points to fall out of our track
+        PFigure figure;
+        if (candidates[id] == &segment) {
+            figure = make_shared<Segment>(segment);
+        } else {
+            PBoundedFigure boundedFigure;
+            if (candidates[id] == &ellipse) {
+                boundedFigure = make_shared<Ellipse>(ellipse);
+            } else {
+                boundedFigure = make_shared<Rectangle>(rectangle);
+            }
+            squareBoundedFigure(context, boundedFigure);
+            figure = boundedFigure;
         }
-        model.addFigure(candidates[id]);
-        return candidates[id];
+        RecognizedEdit edit(RecognizedEdit::Action::Add, figure);
+        edit.fit = bestFit.first;
+        return edit;
     }
 
+    fittingTimer.stop();
+
+    StageTimer smoothingTimer(scratch.stageTimes, RecognitionStage::CurveSmoothing);
     // custom speed threshold for stops breakpoints
-    std::vector<int> stops = getSpeedBreakpoints(uncuttedTrack, 0.02);
-    stops.insert(stops.begin(), 0);
-    stops.push_back(uncuttedTrack.size() - 1);
+    std::vector<int> &stops = scratch.stops;
+    stops.clear();
+    stops.push_back(0);
+    const std::vector<int> &curveBreakpoints = features.stops(context.curveSpeedStopThreshold, context.stopArea);
+    stops.insert(stops.end(), curveBreakpoints.begin(), curveBreakpoints.end());
+    stops.push_back(track.size() - 1);
     stops.erase(unique(stops.begin(), stops.end()), stops.end());
 
-    std::vector<Point> points;
-    std::vector<int> curveStops;
+    std::vector<Point> &points = scratch.points;
+    std::vector<int> &curveStops = scratch.curveStops;
+    std::vector<Point> &currentSegment = scratch.smoothed;
+    points.clear();
+    curveStops.clear();
     for (size_t i = 0; i + 1 < stops.size(); i++) {
         int a = stops[i], b = stops[i + 1];
-        std::vector<Point> currentSegment;
-        for (int i2 = a; i2 <= b; i2++) {
-            currentSegment.push_back(uncuttedTrack[i2]);
-        }
-        currentSegment = smoothCurve(currentSegment);
+        currentSegment.clear();
+        smoothCurve(context, track, a, b, scratch.smoothingRanges, currentSegment);
         currentSegment.erase(unique(currentSegment.begin(), currentSegment.end()), currentSegment.end());
 
         // there is no need to add first point on all iterations except the very first
         points.insert(points.end(), currentSegment.begin() + (i > 0), currentSegment.end());
         curveStops.push_back(points.size() - currentSegment.size());
     }
-    auto result = make_shared<Curve>(points);
+    auto curve = make_shared<Curve>(points);
     for (int stop : curveStops) {
-        result->isStop.at(stop) = true;
+        curve->isStop.at(stop) = true;
     }
-    model.addFigure(result);
-    return result;
+    return RecognizedEdit(RecognizedEdit::Action::Add, curve);
 }
 
-PFigure findClickedFigure(const Model &model, const Point &click) {
+RecognizedEdit recognizeEdit(const RecognitionContext &context, const Track &track, const Model &model, RecognitionScratch &scratch) {
+    if (track.empty()) { return RecognizedEdit(); }
+    scratch.features.reset(track);
+    return recognizeEdit(context, scratch, model);
+}
+
+RecognizedEdit recognizeEdit(const RecognitionContext &context, const Track &track, const Model &model) {
+    RecognitionScratch scratch;
+    return recognizeEdit(context, track, model, scratch);
+}
+
+PFigure recognize(const RecognitionContext &context, const Track &track, Model &model) {
+    return recognizeEdit(context, track, model).apply(model);
+}
+
+PFigure findClickedFigure(const RecognitionContext &context, const Model &model, const Point &click) {
     double nearest = INFINITY;
     PFigure answer;
-    for (PFigure figure : model) {
+    for (PFigure figure : model.figuresNear(click, context.figureSelectGap)) {
         double distance = figure->getApproximateDistanceToBorder(click);
-        if (distance <= FIGURE_SELECT_GAP && distance < nearest) {
+        if (distance <= context.figureSelectGap && distance < nearest) {
             nearest = distance;
             answer = figure;
         }
@@ -529,42 +755,137 @@ PFigure findClickedFigure(const Model &model, const Point &click) {
 }
 
 std::vector<double> calculateRelativeSpeeds(const Track &track) {
-    std::vector<double> res;
-    for (size_t i = 0; i + 1 < track.size(); i++) {
-        double len = (track[i + 1] - track[i]).length();
-        double speed = len / (track[i + 1].time - track[i].time);
-        if (std::isinf(speed) || std::isnan(speed)) { speed = INFINITY; }
-        res.push_back(speed);
+    return TrackFeatures(track).relativeSpeeds();
+}
+
+std::vector<int> getSpeedBreakpoints(const RecognitionContext &context, const Track &track) {
+    return TrackFeatures(track).stops(context.speedStopThreshold, context.stopArea);
+}
+
+void TrackFeatures::reset(const Track &track) {
+    _track = &track;
+    _hasColumns = _hasBoundingBox = _hasSegmentLengths = _hasCircumference = _hasSpeeds = _hasRelativeSpeeds = _hasStopCandidates = false;
+    _circumference = 0;
+    _speeds.clear();
+    _speedPercentile90 = 0;
+    _stopCandidatesArea = 0;
+    for (auto &cached : _stops) {
+        cached.second.valid = false;
     }
-    if (res.empty()) { return res; }
+}
+
+void TrackFeatures::reset(const Track &track, const StreamedTrackFeatures &streamed) {
+    reset(track);
+    _hasBoundingBox = _hasCircumference = _hasSpeeds = _hasStopCandidates = true;
+    _boundingBox = streamed.boundingBox;
+    _circumference = streamed.circumference;
+    _speeds.assign(streamed.speeds.begin(), streamed.speeds.end());
+    _speedPercentile90 = streamed.speedPercentile90;
+    _stopCandidatesArea = streamed.stopArea;
+    _stopCandidates.assign(streamed.stopCandidates.begin(), streamed.stopCandidates.end());
+}
 
-    auto percentiles = res;
-    sort(percentiles.begin(), percentiles.end());
-    double p90 = percentiles[percentiles.size() * 9 / 10];
-    for (auto &x : res) {
-        x = x / p90;
-        if (std::isinf(x) || std::isnan(x)) { x = 0.5; }
-        x = std::max(x, 0.0);
-        x = std::min(x, 1.0);
+const TrackColumns &TrackFeatures::columns() {
+    if (!_hasColumns) {
+        _columns.assign(*_track);
+        _hasColumns = true;
     }
-    return res;
+    return _columns;
+}
+
+const BoundingBox &TrackFeatures::boundingBox() {
+    if (!_hasBoundingBox) {
+        _boundingBox = kernels::boundingBox(columns());
+        _hasBoundingBox = true;
+    }
+    return _boundingBox;
+}
+
+const std::vector<double> &TrackFeatures::segmentLengths() {
+    if (!_hasSegmentLengths) {
+        _segmentLengths.resize(_track->empty() ? 0 : _track->size() - 1);
+        kernels::segmentLengths(columns(), _segmentLengths.data());
+        _hasSegmentLengths = true;
+    }
+    return _segmentLengths;
+}
+
+double TrackFeatures::circumference() {
+    if (!_hasCircumference) {
+        // summed in order, so the result does not depend on kernels
+        _circumference = 0;
+        for (double length : segmentLengths()) {
+            _circumference += length;
+        }
+        _hasCircumference = true;
+    }
+    return _circumference;
+}
+
+double TrackFeatures::closedCircumference() {
+    const Track &track = *_track;
+    return circumference() + (track[0] - track[track.size() - 1]).length();
 }
 
-std::vector<int> getSpeedBreakpoints(const Track &track, const double SPEED_STOP_THRESHOLD) {
-    std::vector<double> speeds = calculateRelativeSpeeds(track);
-    if (speeds.empty()) { return std::vector<int>(); }
+const std::vector<double> &TrackFeatures::speeds() {
+    if (_hasSpeeds) { return _speeds; }
+    _hasSpeeds = true;
+    const std::vector<double> &lengths = segmentLengths();
+    _speeds.resize(lengths.size());
+    kernels::segmentSpeeds(columns(), lengths.data(), _speeds.data());
+    if (_speeds.empty()) { return _speeds; }
 
-    const double STOP_AREA = 15;
+    // only the percentile itself is needed, no need to sort everything
+    _percentiles.assign(_speeds.begin(), _speeds.end());
+    auto p90 = _percentiles.begin() + _percentiles.size() * 9 / 10;
+    nth_element(_percentiles.begin(), p90, _percentiles.end());
+    _speedPercentile90 = *p90;
+    return _speeds;
+}
+
+double TrackFeatures::speedPercentile90() {
+    speeds();
+    return _speedPercentile90;
+}
+
+const std::vector<double> &TrackFeatures::relativeSpeeds() {
+    if (_hasRelativeSpeeds) { return _relativeSpeeds; }
+    _hasRelativeSpeeds = true;
+    const std::vector<double> &speeds = this->speeds();
+    _relativeSpeeds.resize(speeds.size());
+    kernels::relativeSpeeds(speeds.data(), speeds.size(), _speedPercentile90, _relativeSpeeds.data());
+    return _relativeSpeeds;
+}
+
+// Relative speeds are compared with the threshold, raw ones are ordered: clamping of relative speeds
+// would make unequal speeds equal (e.g. negative ones of timestamps going backwards), and raw ones
+// do not depend on the percentile, which StreamingRecognizer relies on
+void getSpeedBreakpoints(const Track &track, const std::vector<double> &speeds, const std::vector<double> &relativeSpeeds,
+                         const double SPEED_STOP_THRESHOLD, const double STOP_AREA, std::vector<int> &stops) {
+    stops.clear();
+    if (speeds.empty()) { return; }
 
-    std::vector<int> stops;
     for (size_t i = 0; i < speeds.size(); i++) {
-        if (speeds[i] > SPEED_STOP_THRESHOLD) continue;
+        if (relativeSpeeds[i] > SPEED_STOP_THRESHOLD) continue;
 
+        // The point is a stop if it is the first one with the minimal speed among all consecutive points
+        // within STOP_AREA around it, i.e. points are ordered by (speed, index).
+        // Both directions are walked in turns and the walk ends on the first preceding point,
+        // so points of a dense cluster with monotonic or equal speeds do not walk the whole cluster each.
         Point current = track[i];
         int left = i, right = i;
+        bool leftOpen = true, rightOpen = true;
         bool ok = true;
-        while (left  >= 0                  && (track[left ] - current).length() <= STOP_AREA) { ok = ok && speeds[left]  >= speeds[i]; left--;  }
-        while (right <  (int)speeds.size() && (track[right] - current).length() <= STOP_AREA) { ok = ok && speeds[right] >= speeds[i]; right++; }
+        while (ok && (leftOpen || rightOpen)) {
+            if (leftOpen) {
+                leftOpen = left >= 0 && (track[left] - current).length() <= STOP_AREA;
+                if (leftOpen) { ok = speeds[left] > speeds[i] || left == (int)i; left--; }
+            }
+            if (ok && rightOpen) {
+                rightOpen = right < (int)speeds.size() && (track[right] - current).length() <= STOP_AREA;
+                if (rightOpen) { ok = speeds[right] >= speeds[i]; right++; }
+            }
+        }
         if (ok) {
             stops.push_back(i);
             while (i < track.size() && (track[i] - current).length() <= STOP_AREA) {
@@ -573,9 +894,215 @@ std::vector<int> getSpeedBreakpoints(const Track &track, const double SPEED_STOP
             i--;
         }
     }
-    return stops;
 }
 
-std::vector<int> getSpeedBreakpoints(const Track &track) {
-    return getSpeedBreakpoints(track, 0.07); // default for figures
+// Same as getSpeedBreakpoints() for stop candidates of the stop area (see StreamedTrackFeatures), takes O(their number):
+// getSpeedBreakpoints() orders raw speeds too, so its stops are the candidates which are slow enough and are not skipped
+static void selectStops(const Track &track, const std::vector<double> &speeds, double speedPercentile90, const std::vector<int> &candidates,
+                        const double SPEED_STOP_THRESHOLD, const double STOP_AREA, std::vector<int> &stops) {
+    stops.clear();
+    size_t next = 0;
+    for (int i : candidates) {
+        if ((size_t)i < next || kernels::relativeSpeed(speeds[i], speedPercentile90) > SPEED_STOP_THRESHOLD) { continue; }
+        stops.push_back(i);
+        for (next = i; next < track.size() && (track[next] - track[i]).length() <= STOP_AREA; next++) {}
+    }
+}
+
+const std::vector<int> &TrackFeatures::stops(double threshold, double stopArea) {
+    CachedStops &cached = _stops[std::make_pair(threshold, stopArea)];
+    if (!cached.valid) {
+        if (_hasStopCandidates && stopArea == _stopCandidatesArea) {
+            selectStops(*_track, _speeds, _speedPercentile90, _stopCandidates, threshold, stopArea, cached.stops);
+        } else {
+            getSpeedBreakpoints(*_track, speeds(), relativeSpeeds(), threshold, stopArea, cached.stops);
+        }
+        cached.valid = true;
+    }
+    return cached.stops;
+}
+
+constexpr size_t StreamingRecognizer::PREVIEW_GROWTH_DIVISOR;
+constexpr int StreamingRecognizer::PREVIEW_MAX_LAG_TIME;
+
+StreamingRecognizer::StreamingRecognizer(const RecognitionContext &context)
+    : _context(context), _requestedTrackSize(0), _requestedModelVersion(0), _relativeSpeedsPercentile(0) {
+    static std::atomic<size_t> lastTrackId(0);
+    _trackId = ++lastTrackId;
+    _streamed.stopArea = context.stopArea;
+}
+
+void StreamingRecognizer::reset() {
+    RecognitionScratch scratch = std::move(_scratch);
+    *this = StreamingRecognizer(_context);
+    _scratch = std::move(scratch);
+}
+
+void StreamingRecognizer::addPoint(const TrackPoint &point) {
+    BoundingBox &box = _streamed.boundingBox;
+    if (_track.empty()) {
+        box.leftUp = box.rightDown = point;
+        _track.points.push_back(point);
+        return;
+    }
+    const TrackPoint &last = _track.points.back();
+    double len = (point - last).length();
+    double speed = len / (point.time - last.time);
+    if (std::isinf(speed) || std::isnan(speed)) { speed = INFINITY; }
+
+    _streamed.circumference += len;
+    box.leftUp.x = min(box.leftUp.x, point.x);
+    box.leftUp.y = min(box.leftUp.y, point.y);
+    box.rightDown.x = max(box.rightDown.x, point.x);
+    box.rightDown.y = max(box.rightDown.y, point.y);
+
+    _streamed.speeds.push_back(speed);
+    if (!_lowerSpeeds.empty() && speed < _lowerSpeeds.top()) {
+        _lowerSpeeds.push(speed);
+    } else {
+        _upperSpeeds.push(speed);
+    }
+    size_t lowerSize = _streamed.speeds.size() * 9 / 10;
+    while (_lowerSpeeds.size() > lowerSize) {
+        _upperSpeeds.push(_lowerSpeeds.top());
+        _lowerSpeeds.pop();
+    }
+    while (_lowerSpeeds.size() < lowerSize) {
+        _lowerSpeeds.push(_upperSpeeds.top());
+        _upperSpeeds.pop();
+    }
+    _streamed.speedPercentile90 = _upperSpeeds.top();
+
+    _track.points.push_back(point);
+    updateStopCandidates();
+}
+
+void StreamingRecognizer::updateStopCandidates() {
+    const double STOP_AREA = _streamed.stopArea;
+    const std::vector<double> &speeds = _streamed.speeds;
+    std::vector<int> &candidates = _streamed.stopCandidates;
+    int last = speeds.size() - 1;
+    Point current = _track[last];
+
+    // the new point either closes stop areas of pending candidates or continues them
+    size_t kept = 0;
+    for (int i : _pendingStopCandidates) {
+        if ((current - _track[i]).length() > STOP_AREA) { continue; }
+        if (speeds[last] < speeds[i]) {
+            candidates.erase(std::lower_bound(candidates.begin(), candidates.end(), i));
+            continue;
+        }
+        _pendingStopCandidates[kept++] = i;
+    }
+    _pendingStopCandidates.resize(kept);
+
+    // the same walk as in getSpeedBreakpoints(), there are no points to the right yet
+    for (int left = last - 1; left >= 0 && (_track[left] - current).length() <= STOP_AREA; left--) {
+        if (speeds[left] <= speeds[last]) { return; }
+    }
+    candidates.push_back(last);
+    _pendingStopCandidates.push_back(last);
+}
+
+double StreamingRecognizer::closedCircumference() const {
+    if (_track.empty()) { return 0; }
+    return _streamed.circumference + (_track[0] - _track[_track.size() - 1]).length();
+}
+
+const std::vector<double> &StreamingRecognizer::relativeSpeeds() {
+    const std::vector<double> &speeds = _streamed.speeds;
+    double p90 = _streamed.speedPercentile90;
+    // the percentile keeps its value for most of the points, so usually only new ones are calculated
+    size_t known = p90 == _relativeSpeedsPercentile ? _relativeSpeeds.size() : 0;
+    _relativeSpeeds.resize(speeds.size());
+    kernels::relativeSpeeds(speeds.data() + known, speeds.size() - known, p90, _relativeSpeeds.data() + known);
+    _relativeSpeedsPercentile = p90;
+    return _relativeSpeeds;
+}
+
+void StreamingRecognizer::resetFeatures() {
+    _scratch.features.reset(_track, _streamed);
+}
+
+bool StreamingRecognizer::isOutdated(size_t calculatedSize) const {
+    if (_track.size() == calculatedSize) { return false; }
+    if (calculatedSize == 0) { return true; }
+    size_t growth = _track.size() - calculatedSize;
+    int lagTime = _track.points.back().time - _track[calculatedSize - 1].time;
+    return growth >= max((size_t)1, calculatedSize / PREVIEW_GROWTH_DIVISOR) || lagTime >= PREVIEW_MAX_LAG_TIME;
+}
+
+const std::vector<int> &StreamingRecognizer::stops() {
+    selectStops(_track, _streamed.speeds, _streamed.speedPercentile90, _streamed.stopCandidates,
+                _context.speedStopThreshold, _streamed.stopArea, _stops);
+    return _stops;
+}
+
+bool StreamingRecognizer::requestPreview(const Model &model, bool wholeTrack) {
+    bool sameModel = _requestedModelVersion == model.version() && _requestedModelSelection == model.selectedFigure;
+    bool outdated = wholeTrack ? _requestedTrackSize != _track.size() : isOutdated(_requestedTrackSize);
+    if (sameModel && !outdated) {
+        return false;
+    }
+    _requestedTrackSize = _track.size();
+    _requestedModelVersion = model.version();
+    _requestedModelSelection = model.selectedFigure;
+    return true;
+}
+
+TrackPreview StreamingRecognizer::calculatePreview(const RecognitionContext &context, size_t trackId, const Track &track, const Model &model) {
+    RecognitionScratch scratch;
+    scratch.features.reset(track);
+    return calculatePreview(context, trackId, model, scratch);
+}
+
+TrackPreview StreamingRecognizer::calculatePreview(const RecognitionContext &context, size_t trackId, const Model &model, RecognitionScratch &scratch) {
+    const Track &track = scratch.features.track();
+    TrackPreview result;
+    result.trackId = trackId;
+    result.trackSize = track.size();
+    result.modelVersion = model.version();
+    result.modelSelection = model.selectedFigure;
+    result.edit = track.empty() ? RecognizedEdit() : recognizeEdit(context, scratch, model);
+    result.preview = previewEdit(result.edit, model);
+    return result;
+}
+
+bool StreamingRecognizer::setPreview(TrackPreview preview) {
+    if (preview.trackId != _trackId || preview.trackSize > _track.size()) {
+        return false;
+    }
+    if (_preview.trackId == _trackId && preview.trackSize < _preview.trackSize) {
+        return false;
+    }
+    _preview = std::move(preview);
+    return true;
+}
+
+const EditPreview *StreamingRecognizer::lastPreview(const Model &model) const {
+    if (_preview.trackId != _trackId || !_preview.isFor(model)) {
+        return nullptr;
+    }
+    return &_preview.preview;
+}
+
+const EditPreview &StreamingRecognizer::preview(const Model &model) {
+    if (requestPreview(model)) {
+        resetFeatures();
+        setPreview(calculatePreview(_context, _trackId, model, _scratch));
+    }
+    return _preview.preview;
+}
+
+bool StreamingRecognizer::hasFinalPreview(const Model &model) const {
+    return _preview.trackId == _trackId && _preview.trackSize == _track.size() && _preview.isFor(model);
+}
+
+PFigure StreamingRecognizer::recognize(Model &model) {
+    if (_track.empty()) { return nullptr; }
+    if (hasFinalPreview(model)) {
+        return _preview.edit.apply(model);
+    }
+    resetFeatures();
+    return recognizeEdit(_context, _scratch, model).apply(model);
 }
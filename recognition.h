@@ -2,21 +2,338 @@
 #define RECOGNITION_H
 
 #include "model.h"
+#include "recognition_kernels.h"
+#include <queue>
+#include <functional>
 
 enum class RecognitionPreset {
     Mouse,
     Touch
 };
 
-void setRecognitionPreset(RecognitionPreset preset);
-int figureSelectGap();
+/*
+ * Everything recognition depends on besides the track and the model.
+ * Recognition only reads the context, so a context may be shared between threads
+ * and contexts with different presets may be used side by side.
+ */
+struct RecognitionContext {
+    RecognitionPreset preset;
+    int figureSelectGap;
+    int minClosedFigureGap;
+    // maximal relative speed at stops in corners of figures
+    double speedStopThreshold;
+    // same for breakpoints of curves
+    double curveSpeedStopThreshold;
+    // a stop is the slowest point among consecutive points within that distance around it
+    double stopArea;
+    // points of a track within that distance from a figure fit it (the gap grows with size of the track),
+    // curves are smoothed with the same precision
+    double trackFitGap;
+    // part of points of a track which should fit a figure for the figure to be drawn
+    double minFitPointsAmount;
+    // ellipses and rectangles with ratio of sides above that become circles and squares
+    double squaringMinRatio;
+    // grabbing a figure and making at least 'deletionMoveMinCount' turns sharper than
+    // 'deletionMoveMaxAngle' degrees within 'deletionMaxTime' ms deletes the figure
+    double deletionMoveMaxAngle;
+    int deletionMoveMinCount;
+    int deletionMaxTime;
+
+    explicit RecognitionContext(RecognitionPreset preset);
+};
+
+/*
+ * Edit of the model proposed by recognition. It references figures of the model
+ * it was recognized on, so it can be applied only while that model is unchanged
+ * (see Model::version()).
+ */
+struct RecognizedEdit {
+    enum class Action {
+        None,
+        Click,     // selects 'figure' (nullptr for none) and toggles arrows of it
+        Add,       // adds new 'figure' (e.g. drawn figure or connection)
+        Remove,    // removes 'figure' and its dependents
+        Translate  // translates 'figure' by 'translation'
+    };
+
+    Action action;
+    PFigure figure;
+    Point translation;
+    // Click on a segment toggles arrows on its ends, on a curve - on ends of its segment 'curveSegment'
+    bool toggleA, toggleB;
+    size_t curveSegment;
+    // Amount of points of the track fitted by the added segment, ellipse or rectangle as fitsToTrack() calculated it
+    // when choosing the figure (closed figures are fitted to the track cut to closed), NAN for other edits
+    double fit;
+
+    RecognizedEdit() : action(Action::None), toggleA(false), toggleB(false), curveSegment(0), fit(NAN) {}
+    RecognizedEdit(Action action, PFigure figure) : RecognizedEdit() {
+        this->action = action;
+        this->figure = figure;
+    }
+
+    // Returns pointer to the figure modified, same as recognize()
+    PFigure apply(Model &model) const;
+};
+
+/*
+ * How the model looks like after the edit, without copying the model.
+ * Figures of the model should be drawn with 'replaced' substituted
+ * (nullptr stands for removed ones), followed by 'added'.
+ */
+struct EditPreview {
+    std::unordered_map<PFigure, PFigure> replaced;
+    PFigure added;
+    PFigure modified; // same as the result of apply()
+    PFigure selectedFigure;
+};
+EditPreview previewEdit(const RecognizedEdit &edit, const Model &model);
+
+struct RecognitionScratch;
+
+// Does not change the model
+RecognizedEdit recognizeEdit(const RecognitionContext &context, const Track &track, const Model &model);
+// Same, but uses buffers of the scratch instead of allocating new ones
+RecognizedEdit recognizeEdit(const RecognitionContext &context, const Track &track, const Model &model, RecognitionScratch &scratch);
 
 // Returns pointer to the figure modified
-PFigure recognize(const Track &track, Model &model);
+PFigure recognize(const RecognitionContext &context, const Track &track, Model &model);
 
-PFigure findClickedFigure(const Model &model, const Point &click);
+PFigure findClickedFigure(const RecognitionContext &context, const Model &model, const Point &click);
 
 std::vector<double> calculateRelativeSpeeds(const Track &track);
-std::vector<int> getSpeedBreakpoints(const Track &track);
+std::vector<int> getSpeedBreakpoints(const RecognitionContext &context, const Track &track);
+
+// Features of a track which StreamingRecognizer maintains point by point, so recognition does not calculate them again
+struct StreamedTrackFeatures {
+    BoundingBox boundingBox;
+    double circumference;
+    std::vector<double> speeds;
+    double speedPercentile90;
+    // Points which are the first ones with minimal raw speed among consecutive points within stopArea around them, sorted.
+    // Stops of getSpeedBreakpoints() are the ones of them which are slow enough and are not skipped
+    double stopArea;
+    std::vector<int> stopCandidates;
+
+    StreamedTrackFeatures() : circumference(0), speedPercentile90(0), stopArea(0) {}
+};
+
+/*
+ * Characteristics of a track which are needed by several stages of recognition.
+ * Each of them is calculated on first use only, stops are cached for each speed threshold.
+ * The track is referenced, so it should outlive the features and should not change.
+ * reset() keeps all buffers allocated, so features may be reused for other tracks.
+ */
+class TrackFeatures {
+public:
+    TrackFeatures() : _track(nullptr) {
+        _hasColumns = _hasBoundingBox = _hasSegmentLengths = _hasCircumference = _hasSpeeds = _hasRelativeSpeeds = _hasStopCandidates = false;
+        _circumference = _speedPercentile90 = _stopCandidatesArea = 0;
+    }
+    explicit TrackFeatures(const Track &track) { reset(track); }
+    // For callers which maintain features incrementally (see StreamingRecognizer)
+    TrackFeatures(const Track &track, const StreamedTrackFeatures &streamed) { reset(track, streamed); }
+
+    void reset(const Track &track);
+    void reset(const Track &track, const StreamedTrackFeatures &streamed);
+
+    const Track &track() const { return *_track; }
+    const TrackColumns &columns();
+    const BoundingBox &boundingBox();
+    // Distances between consecutive points
+    const std::vector<double> &segmentLengths();
+    double circumference();
+    double closedCircumference();
+
+    // Raw speeds between consecutive points and their 90th percentile
+    const std::vector<double> &speeds();
+    double speedPercentile90();
+    // Same as calculateRelativeSpeeds(track())
+    const std::vector<double> &relativeSpeeds();
+    // Same as getSpeedBreakpoints(context, track()) with context.speedStopThreshold == threshold
+    // and context.stopArea == stopArea
+    const std::vector<int> &stops(double threshold, double stopArea);
+
+private:
+    struct CachedStops {
+        bool valid;
+        std::vector<int> stops;
+        CachedStops() : valid(false) {}
+    };
+
+    const Track *_track;
+    bool _hasColumns, _hasBoundingBox, _hasSegmentLengths, _hasCircumference, _hasSpeeds, _hasRelativeSpeeds, _hasStopCandidates;
+    TrackColumns _columns;
+    BoundingBox _boundingBox;
+    std::vector<double> _segmentLengths;
+    double _circumference;
+    std::vector<double> _speeds, _percentiles;
+    double _speedPercentile90;
+    std::vector<double> _relativeSpeeds;
+    double _stopCandidatesArea;
+    std::vector<int> _stopCandidates;
+    // by threshold and stop area, there are only few different ones, entries are kept on reset()
+    std::map<std::pair<double, double>, CachedStops> _stops;
+};
+
+enum class RecognitionStage {
+    Clicks,
+    Grabs,
+    Connections,
+    CutToClosed,
+    CandidateFitting,
+    CurveSmoothing,
+    Count
+};
+const char *recognitionStageName(RecognitionStage stage);
+
+// Wall time of stages of a single recognition, in nanoseconds, negative for stages which were not reached
+struct RecognitionStageTimes {
+    long long time[(size_t)RecognitionStage::Count];
+
+    RecognitionStageTimes() { clear(); }
+    void clear() { std::fill(time, time + (size_t)RecognitionStage::Count, -1LL); }
+    long long &operator[](RecognitionStage stage) { return time[(size_t)stage]; }
+};
+
+// (part of points of the track near the figure's border, -(average error)), figures are drawn if enough points fit
+std::pair<double, double> fitsToTrack(const RecognitionContext &context, TrackFeatures &features, Figure &figure);
+
+/*
+ * Buffers which recognition reuses instead of allocating them for every track,
+ * so once they have grown large enough, recognition allocates the recognized figure only.
+ * Owned by the caller (e.g. StreamingRecognizer or a worker thread),
+ * should not be used by two recognitions at once.
+ */
+struct RecognitionScratch {
+    TrackFeatures features;
+    Track cuttedTrack;
+    TrackFeatures cuttedFeatures;
+    // breakpoints of curves and their smoothed parts
+    std::vector<int> stops;
+    std::vector<Point> smoothed;
+    struct SmoothingRange {
+        size_t first, last;
+        Point lastPoint;
+        SmoothingRange(size_t first, size_t last, const Point &lastPoint) : first(first), last(last), lastPoint(lastPoint) {}
+    };
+    std::vector<SmoothingRange> smoothingRanges;
+    std::vector<Point> points;
+    std::vector<int> curveStops;
+    // figures near the start and the end of the track, see Model::figuresNear()
+    std::vector<PFigure> figuresNearStart, figuresNearEnd;
+
+    // If set, recognition measures its stages there (see benchmark.cpp)
+    RecognitionStageTimes *stageTimes;
+
+    RecognitionScratch() : stageTimes(nullptr) {}
+};
+
+double getClosedFigureGap(const RecognitionContext &context, const BoundingBox &box);
+// Douglas-Peucker simplification of points first..last of the track, appends the result
+void smoothCurve(const RecognitionContext &context, const Track &track, size_t first, size_t last,
+                 std::vector<RecognitionScratch::SmoothingRange> &ranges, std::vector<Point> &result);
+
+// Recognition result for a prefix of a track, see StreamingRecognizer
+struct TrackPreview {
+    size_t trackId, trackSize;
+    size_t modelVersion;
+    PFigure modelSelection;
+    RecognizedEdit edit;
+    EditPreview preview;
+
+    TrackPreview() : trackId(0), trackSize(0), modelVersion(0) {}
+    bool isFor(const Model &model) const {
+        return modelVersion == model.version() && modelSelection == model.selectedFigure;
+    }
+};
+
+/*
+ * Accumulates a track point by point while it is being drawn and keeps
+ * its bounding box, circumference, speeds percentile and stop candidates up to date,
+ * so nothing is recalculated over the whole track on every mouse event,
+ * and recognition of the track starts from these features.
+ * Stop candidates only within the stop area of the last point may change.
+ * Preview is requested when the track grows by a constant fraction since the last request
+ * (or the model changes), so recognition of previews takes amortized O(1) per point.
+ * Besides, it is requested at least every PREVIEW_MAX_LAG_TIME milliseconds of drawing,
+ * so it does not fall behind slow drawing, which adds at most one recognition per that time.
+ * Previews may be calculated elsewhere (e.g. in RecognitionWorker) and passed back by setPreview().
+ */
+class StreamingRecognizer {
+public:
+    explicit StreamingRecognizer(const RecognitionContext &context);
+
+    void reset();
+    void addPoint(const TrackPoint &point);
+
+    const RecognitionContext &context() const { return _context; }
+    // Unique for every track, changes on reset()
+    size_t trackId() const { return _trackId; }
+    const Track &track() const { return _track; }
+    bool empty() const { return _track.empty(); }
+    const BoundingBox &boundingBox() const { return _streamed.boundingBox; }
+    double circumference() const { return _streamed.circumference; }
+    double closedCircumference() const;
+    // Features of track() known so far, see TrackFeatures(track, streamed)
+    const StreamedTrackFeatures &streamedFeatures() const { return _streamed; }
+
+    // Same as calculateRelativeSpeeds(track()), recalculates all of them only if the percentile changes
+    const std::vector<double> &relativeSpeeds();
+    // Same as getSpeedBreakpoints(context(), track()), takes O(number of stop candidates)
+    const std::vector<int> &stops();
+
+    static constexpr size_t PREVIEW_GROWTH_DIVISOR = 8;
+    static constexpr int PREVIEW_MAX_LAG_TIME = 100;
+
+    // Returns true if a new preview should be calculated for the model, the request is remembered.
+    // 'wholeTrack' requests the preview of the whole track regardless of its growth, e.g. when the track is finished
+    bool requestPreview(const Model &model, bool wholeTrack = false);
+    static TrackPreview calculatePreview(const RecognitionContext &context, size_t trackId, const Track &track, const Model &model);
+    // Same, but scratch.features should be reset to the track by the caller (e.g. with streamedFeatures())
+    static TrackPreview calculatePreview(const RecognitionContext &context, size_t trackId, const Model &model, RecognitionScratch &scratch);
+    // Returns false if the preview is for another track or is older than the current one
+    bool setPreview(TrackPreview preview);
+    // Returns the last preview set if it was calculated for the model, nullptr otherwise
+    const EditPreview *lastPreview(const Model &model) const;
+
+    // Calculates the preview in place if requested
+    const EditPreview &preview(const Model &model);
+
+    // Returns true if the last preview set is for the whole track and the model, so recognize() applies it
+    bool hasFinalPreview(const Model &model) const;
+    // Same as recognize(context(), track(), model), reuses the final preview if there is one
+    PFigure recognize(Model &model);
+
+private:
+    RecognitionContext _context;
+    size_t _trackId;
+    Track _track;
+    // stop candidates there compare raw speeds, so they do not depend on the percentile, which changes with every point
+    StreamedTrackFeatures _streamed;
+
+    // raw speeds split by the 90th percentile: 'lower' keeps exactly size() * 9 / 10 smallest ones
+    std::priority_queue<double> _lowerSpeeds;
+    std::priority_queue<double, std::vector<double>, std::greater<double>> _upperSpeeds;
+
+    size_t _requestedTrackSize;
+    size_t _requestedModelVersion;
+    PFigure _requestedModelSelection;
+    TrackPreview _preview;
+    // Stop areas of these candidates are not closed by the track yet, so the next point may reject them
+    std::vector<int> _pendingStopCandidates;
+    std::vector<int> _stops;
+    // calculated for _relativeSpeedsPercentile
+    std::vector<double> _relativeSpeeds;
+    double _relativeSpeedsPercentile;
+    // kept on reset()
+    RecognitionScratch _scratch;
+
+    bool isOutdated(size_t calculatedSize) const;
+    // Updates stop candidates after the speed of the point before the last one becomes known
+    void updateStopCandidates();
+    // Resets _scratch.features to the track with everything known so far
+    void resetFeatures();
+};
 
 #endif // RECOGNITION_H
@@ -0,0 +1,352 @@
+#include "recognition_kernels.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(KERNELS_SSE2) && (defined(__GNUC__) || defined(__clang__))
+// AVX2 code is compiled for its functions only and called after checking the CPU
+#define KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+void TrackColumns::assign(const Track &track) {
+    x.resize(track.size());
+    y.resize(track.size());
+    time.resize(track.size());
+    for (size_t i = 0; i < track.size(); i++) {
+        x[i] = track[i].x;
+        y[i] = track[i].y;
+        time[i] = track[i].time;
+    }
+}
+
+namespace kernels {
+namespace {
+
+/*
+ * Vectorized versions handle as many points as they can and return the index
+ * the scalar version should continue from.
+ * Minimums are taken as std::min(m, p) == (p < m ? p : m), that's what
+ * _mm_min_pd(p, m) does too (same for maximums), and the order of comparisons
+ * does not matter for anything but signed zeros.
+ */
+
+void boundingBoxScalar(const TrackColumns &track, size_t from, BoundingBox &box) {
+    for (size_t i = from; i < track.size(); i++) {
+        box.addPoint(Point(track.x[i], track.y[i]));
+    }
+}
+
+void segmentLengthsScalar(const TrackColumns &track, size_t from, double *lengths) {
+    for (size_t i = from; i + 1 < track.size(); i++) {
+        double dx = track.x[i + 1] - track.x[i];
+        double dy = track.y[i + 1] - track.y[i];
+        lengths[i] = sqrt(dx * dx + dy * dy);
+    }
+}
+
+void segmentSpeedsScalar(const TrackColumns &track, const double *lengths, size_t from, double *speeds) {
+    for (size_t i = from; i + 1 < track.size(); i++) {
+        double speed = lengths[i] / (track.time[i + 1] - track.time[i]);
+        if (std::isinf(speed) || std::isnan(speed)) { speed = INFINITY; }
+        speeds[i] = speed;
+    }
+}
+
+void relativeSpeedsScalar(const double *speeds, size_t count, double percentile, size_t from, double *result) {
+    for (size_t i = from; i < count; i++) {
+        result[i] = relativeSpeed(speeds[i], percentile);
+    }
+}
+
+/*
+ * segmentMiddlesDot() is summed in DOT_LANES partial sums: the lane i % DOT_LANES gets the i-th product
+ * for i < count / DOT_LANES * DOT_LANES, lanes are added as (s0 + s1) + (s2 + s3) and the rest of products
+ * one by one after them. Halving is exact, so it is done once for the sum.
+ */
+const size_t DOT_LANES = 4;
+
+size_t segmentMiddlesDotLanes(const double *values, const double *weights, size_t count, double *sums) {
+    size_t n = count / DOT_LANES * DOT_LANES;
+    for (size_t i = 0; i < n; i += DOT_LANES) {
+        for (size_t lane = 0; lane < DOT_LANES; lane++) {
+            sums[lane] += (values[i + lane] + values[i + lane + 1]) * weights[i + lane];
+        }
+    }
+    return n;
+}
+
+double segmentMiddlesDotScalar(const double *values, const double *weights, size_t count, size_t from, const double *sums) {
+    double result = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    for (size_t i = from; i < count; i++) {
+        result += (values[i] + values[i + 1]) * weights[i];
+    }
+    return result * 0.5;
+}
+
+#ifdef KERNELS_SSE2
+size_t boundingBoxSse2(const TrackColumns &track, BoundingBox &box) {
+    size_t n = track.size() / 2 * 2;
+    if (n == 0) { return 0; }
+    __m128d minX = _mm_set1_pd(box.leftUp.x), minY = _mm_set1_pd(box.leftUp.y);
+    __m128d maxX = _mm_set1_pd(box.rightDown.x), maxY = _mm_set1_pd(box.rightDown.y);
+    for (size_t i = 0; i < n; i += 2) {
+        __m128d x = _mm_loadu_pd(&track.x[i]), y = _mm_loadu_pd(&track.y[i]);
+        minX = _mm_min_pd(x, minX);
+        minY = _mm_min_pd(y, minY);
+        maxX = _mm_max_pd(x, maxX);
+        maxY = _mm_max_pd(y, maxY);
+    }
+    double lanes[4][2];
+    _mm_storeu_pd(lanes[0], minX);
+    _mm_storeu_pd(lanes[1], minY);
+    _mm_storeu_pd(lanes[2], maxX);
+    _mm_storeu_pd(lanes[3], maxY);
+    for (int lane = 0; lane < 2; lane++) {
+        box.addPoint(Point(lanes[0][lane], lanes[1][lane]));
+        box.addPoint(Point(lanes[2][lane], lanes[3][lane]));
+    }
+    return n;
+}
+
+size_t segmentLengthsSse2(const TrackColumns &track, double *lengths) {
+    size_t count = track.size() ? track.size() - 1 : 0;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(&track.x[i + 1]), _mm_loadu_pd(&track.x[i]));
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(&track.y[i + 1]), _mm_loadu_pd(&track.y[i]));
+        _mm_storeu_pd(lengths + i, _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy))));
+    }
+    return i;
+}
+
+size_t segmentSpeedsSse2(const TrackColumns &track, const double *lengths, double *speeds) {
+    size_t count = track.size() ? track.size() - 1 : 0;
+    const __m128d zero = _mm_setzero_pd(), infinity = _mm_set1_pd(INFINITY);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d dt = _mm_sub_pd(_mm_loadu_pd(&track.time[i + 1]), _mm_loadu_pd(&track.time[i]));
+        __m128d speed = _mm_div_pd(_mm_loadu_pd(lengths + i), dt);
+        // speed - speed is zero for finite speeds only
+        __m128d finite = _mm_cmpeq_pd(_mm_sub_pd(speed, speed), zero);
+        _mm_storeu_pd(speeds + i, _mm_or_pd(_mm_and_pd(finite, speed), _mm_andnot_pd(finite, infinity)));
+    }
+    return i;
+}
+
+size_t relativeSpeedsSse2(const double *speeds, size_t count, double percentile, double *result) {
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1), half = _mm_set1_pd(0.5);
+    const __m128d divisor = _mm_set1_pd(percentile);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d x = _mm_div_pd(_mm_loadu_pd(speeds + i), divisor);
+        __m128d finite = _mm_cmpeq_pd(_mm_sub_pd(x, x), zero);
+        x = _mm_or_pd(_mm_and_pd(finite, x), _mm_andnot_pd(finite, half));
+        // std::max(x, 0.0) is (x < 0 ? 0 : x), same for std::min(x, 1.0)
+        x = _mm_min_pd(one, _mm_max_pd(zero, x));
+        _mm_storeu_pd(result + i, x);
+    }
+    return i;
+}
+
+size_t segmentMiddlesDotSse2(const double *values, const double *weights, size_t count, double *sums) {
+    size_t n = count / DOT_LANES * DOT_LANES;
+    __m128d sums01 = _mm_loadu_pd(sums), sums23 = _mm_loadu_pd(sums + 2);
+    for (size_t i = 0; i < n; i += DOT_LANES) {
+        __m128d middles01 = _mm_add_pd(_mm_loadu_pd(values + i), _mm_loadu_pd(values + i + 1));
+        __m128d middles23 = _mm_add_pd(_mm_loadu_pd(values + i + 2), _mm_loadu_pd(values + i + 3));
+        sums01 = _mm_add_pd(sums01, _mm_mul_pd(middles01, _mm_loadu_pd(weights + i)));
+        sums23 = _mm_add_pd(sums23, _mm_mul_pd(middles23, _mm_loadu_pd(weights + i + 2)));
+    }
+    _mm_storeu_pd(sums, sums01);
+    _mm_storeu_pd(sums + 2, sums23);
+    return n;
+}
+#endif
+
+#ifdef KERNELS_AVX2
+__attribute__((target("avx2")))
+size_t boundingBoxAvx2(const TrackColumns &track, BoundingBox &box) {
+    size_t n = track.size() / 4 * 4;
+    if (n == 0) { return 0; }
+    __m256d minX = _mm256_set1_pd(box.leftUp.x), minY = _mm256_set1_pd(box.leftUp.y);
+    __m256d maxX = _mm256_set1_pd(box.rightDown.x), maxY = _mm256_set1_pd(box.rightDown.y);
+    for (size_t i = 0; i < n; i += 4) {
+        __m256d x = _mm256_loadu_pd(&track.x[i]), y = _mm256_loadu_pd(&track.y[i]);
+        minX = _mm256_min_pd(x, minX);
+        minY = _mm256_min_pd(y, minY);
+        maxX = _mm256_max_pd(x, maxX);
+        maxY = _mm256_max_pd(y, maxY);
+    }
+    double lanes[4][4];
+    _mm256_storeu_pd(lanes[0], minX);
+    _mm256_storeu_pd(lanes[1], minY);
+    _mm256_storeu_pd(lanes[2], maxX);
+    _mm256_storeu_pd(lanes[3], maxY);
+    for (int lane = 0; lane < 4; lane++) {
+        box.addPoint(Point(lanes[0][lane], lanes[1][lane]));
+        box.addPoint(Point(lanes[2][lane], lanes[3][lane]));
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+size_t segmentLengthsAvx2(const TrackColumns &track, double *lengths) {
+    size_t count = track.size() ? track.size() - 1 : 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&track.x[i + 1]), _mm256_loadu_pd(&track.x[i]));
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&track.y[i + 1]), _mm256_loadu_pd(&track.y[i]));
+        _mm256_storeu_pd(lengths + i, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t segmentSpeedsAvx2(const TrackColumns &track, const double *lengths, double *speeds) {
+    size_t count = track.size() ? track.size() - 1 : 0;
+    const __m256d zero = _mm256_setzero_pd(), infinity = _mm256_set1_pd(INFINITY);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d dt = _mm256_sub_pd(_mm256_loadu_pd(&track.time[i + 1]), _mm256_loadu_pd(&track.time[i]));
+        __m256d speed = _mm256_div_pd(_mm256_loadu_pd(lengths + i), dt);
+        __m256d finite = _mm256_cmp_pd(_mm256_sub_pd(speed, speed), zero, _CMP_EQ_OQ);
+        _mm256_storeu_pd(speeds + i, _mm256_blendv_pd(infinity, speed, finite));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t relativeSpeedsAvx2(const double *speeds, size_t count, double percentile, double *result) {
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1), half = _mm256_set1_pd(0.5);
+    const __m256d divisor = _mm256_set1_pd(percentile);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = _mm256_div_pd(_mm256_loadu_pd(speeds + i), divisor);
+        __m256d finite = _mm256_cmp_pd(_mm256_sub_pd(x, x), zero, _CMP_EQ_OQ);
+        x = _mm256_blendv_pd(half, x, finite);
+        x = _mm256_min_pd(one, _mm256_max_pd(zero, x));
+        _mm256_storeu_pd(result + i, x);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t segmentMiddlesDotAvx2(const double *values, const double *weights, size_t count, double *sums) {
+    size_t n = count / DOT_LANES * DOT_LANES;
+    __m256d lanes = _mm256_loadu_pd(sums);
+    for (size_t i = 0; i < n; i += DOT_LANES) {
+        __m256d middles = _mm256_add_pd(_mm256_loadu_pd(values + i), _mm256_loadu_pd(values + i + 1));
+        lanes = _mm256_add_pd(lanes, _mm256_mul_pd(middles, _mm256_loadu_pd(weights + i)));
+    }
+    _mm256_storeu_pd(sums, lanes);
+    return n;
+}
+#endif
+
+struct Implementation {
+    const char *name;
+    // return the index the scalar version should continue from
+    size_t (*boundingBox)(const TrackColumns &track, BoundingBox &box);
+    size_t (*segmentLengths)(const TrackColumns &track, double *lengths);
+    size_t (*segmentSpeeds)(const TrackColumns &track, const double *lengths, double *speeds);
+    size_t (*relativeSpeeds)(const double *speeds, size_t count, double percentile, double *result);
+    // adds to the partial sums, see DOT_LANES
+    size_t (*segmentMiddlesDot)(const double *values, const double *weights, size_t count, double *sums);
+};
+
+size_t boundingBoxNone(const TrackColumns &, BoundingBox &) { return 0; }
+size_t segmentLengthsNone(const TrackColumns &, double *) { return 0; }
+size_t segmentSpeedsNone(const TrackColumns &, const double *, double *) { return 0; }
+size_t relativeSpeedsNone(const double *, size_t, double, double *) { return 0; }
+
+// From the best one to the worst one
+const Implementation implementations[] = {
+#ifdef KERNELS_AVX2
+    { "avx2", boundingBoxAvx2, segmentLengthsAvx2, segmentSpeedsAvx2, relativeSpeedsAvx2, segmentMiddlesDotAvx2 },
+#endif
+#ifdef KERNELS_SSE2
+    { "sse2", boundingBoxSse2, segmentLengthsSse2, segmentSpeedsSse2, relativeSpeedsSse2, segmentMiddlesDotSse2 },
+#endif
+    { "scalar", boundingBoxNone, segmentLengthsNone, segmentSpeedsNone, relativeSpeedsNone, segmentMiddlesDotLanes },
+};
+
+bool isAvailable(const Implementation &implementation) {
+#ifdef KERNELS_AVX2
+    if (!strcmp(implementation.name, "avx2")) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)implementation;
+    return true;
+}
+
+const Implementation *findBest() {
+    for (const Implementation &implementation : implementations) {
+        if (isAvailable(implementation)) {
+            return &implementation;
+        }
+    }
+    return nullptr;
+}
+
+std::atomic<const Implementation*> &current() {
+    static std::atomic<const Implementation*> result(findBest());
+    return result;
+}
+}
+
+std::vector<const char*> availableImplementations() {
+    std::vector<const char*> result;
+    for (const Implementation &implementation : implementations) {
+        if (isAvailable(implementation)) {
+            result.push_back(implementation.name);
+        }
+    }
+    return result;
+}
+
+const char *currentImplementation() {
+    return current().load()->name;
+}
+
+bool useImplementation(const char *name) {
+    for (const Implementation &implementation : implementations) {
+        if (!strcmp(implementation.name, name) && isAvailable(implementation)) {
+            current() = &implementation;
+            return true;
+        }
+    }
+    return false;
+}
+
+BoundingBox boundingBox(const TrackColumns &track) {
+    BoundingBox box;
+    boundingBoxScalar(track, current().load()->boundingBox(track, box), box);
+    return box;
+}
+
+void segmentLengths(const TrackColumns &track, double *lengths) {
+    segmentLengthsScalar(track, current().load()->segmentLengths(track, lengths), lengths);
+}
+
+void segmentSpeeds(const TrackColumns &track, const double *lengths, double *speeds) {
+    segmentSpeedsScalar(track, lengths, current().load()->segmentSpeeds(track, lengths, speeds), speeds);
+}
+
+void relativeSpeeds(const double *speeds, size_t count, double percentile, double *result) {
+    relativeSpeedsScalar(speeds, count, percentile, current().load()->relativeSpeeds(speeds, count, percentile, result), result);
+}
+
+double segmentMiddlesDot(const double *values, const double *weights, size_t count) {
+    double sums[DOT_LANES] = { 0, 0, 0, 0 };
+    size_t from = current().load()->segmentMiddlesDot(values, weights, count, sums);
+    return segmentMiddlesDotScalar(values, weights, count, from, sums);
+}
+}
@@ -0,0 +1,55 @@
+#ifndef RECOGNITION_KERNELS_H
+#define RECOGNITION_KERNELS_H
+
+#include "model.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/*
+ * Track stored as structure of arrays, so loops over its coordinates can be vectorized.
+ * Times are stored as doubles, differences of integer times are exact anyway.
+ */
+struct TrackColumns {
+    std::vector<double> x, y, time;
+
+    // Keeps buffers allocated
+    void assign(const Track &track);
+    size_t size() const { return x.size(); }
+};
+
+/*
+ * Loops over all points of a track which recognition runs on every stroke.
+ * There are SSE2 and AVX2 implementations besides the scalar one, the best one
+ * supported by the CPU is chosen at runtime. All of them give the same results
+ * to the last bit, so recognition does not depend on the CPU.
+ */
+namespace kernels {
+// Names of implementations available on this CPU, the first one is used by default
+std::vector<const char*> availableImplementations();
+const char *currentImplementation();
+// For tests only, returns false if the implementation is not available
+bool useImplementation(const char *name);
+
+// Same as adding all points to an empty BoundingBox one by one
+BoundingBox boundingBox(const TrackColumns &track);
+// lengths[i] is the distance between points i and i + 1, there are size() - 1 of them
+void segmentLengths(const TrackColumns &track, double *lengths);
+// speeds[i] = lengths[i] / (time[i + 1] - time[i]), INFINITY if that is not finite
+void segmentSpeeds(const TrackColumns &track, const double *lengths, double *speeds);
+// result[i] = relativeSpeed(speeds[i], percentile)
+void relativeSpeeds(const double *speeds, size_t count, double percentile, double *result);
+// speed / percentile clamped to [0, 1], 0.5 if that is not finite
+inline double relativeSpeed(double speed, double percentile) {
+    double x = speed / percentile;
+    if (std::isinf(x) || std::isnan(x)) { x = 0.5; }
+    x = std::max(x, 0.0);
+    x = std::min(x, 1.0);
+    return x;
+}
+// Sum of (values[i] + values[i + 1]) / 2 * weights[i] for i < count, i.e. of middles of segments weighted
+// by their lengths. Added in four interleaved partial sums on every implementation, not one by one
+double segmentMiddlesDot(const double *values, const double *weights, size_t count);
+}
+
+#endif // RECOGNITION_KERNELS_H
@@ -0,0 +1,105 @@
+#include "recognition_worker.h"
+
+RecognitionWorker::RecognitionWorker(QObject *parent) : QObject(parent), stopping(false), calculating(false), calculatingTrackId(0), calculatingTrackSize(0) {
+    thread = std::thread([this]() { run(); });
+}
+
+RecognitionWorker::~RecognitionWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requestAdded.notify_one();
+    thread.join();
+}
+
+void RecognitionWorker::request(const RecognitionContext &context, std::shared_ptr<const Model> model, size_t trackId, Track track, StreamedTrackFeatures features) {
+    std::unique_ptr<Request> newRequest(new Request { context, std::move(model), trackId, std::move(track), std::move(features) });
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the replaced request (and its model) is destroyed outside of the lock
+        pendingRequest.swap(newRequest);
+    }
+    requestAdded.notify_one();
+}
+
+void RecognitionWorker::cancel() {
+    std::unique_ptr<Request> oldRequest;
+    std::unique_ptr<TrackPreview> oldPreview;
+    std::lock_guard<std::mutex> lock(mutex);
+    oldRequest.swap(pendingRequest);
+    oldPreview.swap(finishedPreview);
+}
+
+bool RecognitionWorker::takePreview(TrackPreview &preview) {
+    std::unique_ptr<TrackPreview> result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        result.swap(finishedPreview);
+    }
+    if (!result) {
+        return false;
+    }
+    preview = std::move(*result);
+    return true;
+}
+
+bool RecognitionWorker::waitPreview(size_t trackId, size_t trackSize, TrackPreview &preview) {
+    std::unique_ptr<TrackPreview> result;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (finishedPreview && finishedPreview->trackId == trackId && finishedPreview->trackSize == trackSize) {
+                result.swap(finishedPreview);
+                break;
+            }
+            // a request after another one is not waited for, it may take longer than calculating it right away
+            bool waiting = calculating
+                ? calculatingTrackId == trackId && calculatingTrackSize == trackSize
+                : pendingRequest && pendingRequest->trackId == trackId && pendingRequest->track.size() == trackSize;
+            if (stopping || !waiting) {
+                break;
+            }
+            previewFinished.wait(lock);
+        }
+    }
+    if (!result) {
+        return false;
+    }
+    preview = std::move(*result);
+    return true;
+}
+
+void RecognitionWorker::run() {
+    // used by this thread only
+    RecognitionScratch scratch;
+    for (;;) {
+        std::unique_ptr<Request> current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            requestAdded.wait(lock, [this]() { return stopping || pendingRequest; });
+            if (stopping) {
+                return;
+            }
+            current.swap(pendingRequest);
+            calculating = true;
+            calculatingTrackId = current->trackId;
+            calculatingTrackSize = current->track.size();
+        }
+
+        scratch.features.reset(current->track, current->features);
+        std::unique_ptr<TrackPreview> preview(new TrackPreview(
+            StreamingRecognizer::calculatePreview(current->context, current->trackId, *current->model, scratch)
+        ));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            calculating = false;
+            if (stopping) {
+                return;
+            }
+            finishedPreview.swap(preview);
+        }
+        previewFinished.notify_all();
+        emit previewReady();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef RECOGNITION_WORKER_H
+#define RECOGNITION_WORKER_H
+
+#include <QObject>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include "recognition.h"
+
+/*
+ * Calculates previews of tracks in a background thread.
+ * Only the latest request matters: a pending request is replaced by a newer one
+ * and a finished preview replaces the one which was not taken yet.
+ */
+class RecognitionWorker : public QObject {
+    Q_OBJECT
+public:
+    explicit RecognitionWorker(QObject *parent = 0);
+    ~RecognitionWorker();
+
+    // The model should not be changed by anyone, i.e. it should be a snapshot, which may be shared by requests.
+    // Features are the ones of the track known so far (see StreamingRecognizer::streamedFeatures())
+    void request(const RecognitionContext &context, std::shared_ptr<const Model> model, size_t trackId, Track track, StreamedTrackFeatures features);
+    // Drops both pending request and finished preview
+    void cancel();
+    // Returns false if there is no finished preview
+    bool takePreview(TrackPreview &preview);
+    // Waits for the preview of the track of that size if it is being calculated or is requested
+    // while nothing else is calculated. Returns false without waiting otherwise
+    bool waitPreview(size_t trackId, size_t trackSize, TrackPreview &preview);
+
+signals:
+    // Emitted from the background thread
+    void previewReady();
+
+private:
+    struct Request {
+        RecognitionContext context;
+        std::shared_ptr<const Model> model;
+        size_t trackId;
+        Track track;
+        StreamedTrackFeatures features;
+    };
+
+    std::mutex mutex;
+    std::condition_variable requestAdded;
+    std::condition_variable previewFinished;
+    bool stopping;
+    // the request being calculated, if any
+    bool calculating;
+    size_t calculatingTrackId, calculatingTrackSize;
+    std::unique_ptr<Request> pendingRequest;
+    std::unique_ptr<TrackPreview> finishedPreview;
+    std::thread thread;
+
+    void run();
+};
+
+#endif // RECOGNITION_WORKER_H
@@ -2,10 +2,20 @@
 #include <QDebug>
 #include <random>
 #include <typeinfo>
+#include "allocation_counter.h"
 #include "model.h"
 #include "model_io.h"
+#include "model_ops.h"
+#include "layouting.h"
+#include "figurepainter.h"
+#include "modelwidget.h"
 #include "recognition.h"
+#include "textpainter.h"
+#include "track_corpus.h"
+#include "track_filter.h"
+#include "tracing.h"
 #include <fstream>
+#include <thread>
 
 using namespace figures;
 
@@ -232,6 +242,120 @@ bool modelsAreEqual(const Model &a, const Model &b) {
     return true;
 }
 
+// Straightforward stops detection which getSpeedBreakpoints() should agree with
+std::vector<int> naiveSpeedBreakpoints(const Track &track, double threshold) {
+    const double STOP_AREA = 15;
+    TrackFeatures features(track);
+    const std::vector<double> &speeds = features.speeds();
+    std::vector<int> stops;
+    for (size_t i = 0; i < speeds.size(); i++) {
+        if (features.relativeSpeeds()[i] > threshold) continue;
+
+        // the first point of the slowest ones within the area
+        Point current = track[i];
+        int left = i, right = i;
+        bool ok = true;
+        while (left  >= 0                  && (track[left ] - current).length() <= STOP_AREA) { ok = ok && (speeds[left] > speeds[i] || left == (int)i); left--; }
+        while (right <  (int)speeds.size() && (track[right] - current).length() <= STOP_AREA) { ok = ok && speeds[right] >= speeds[i]; right++; }
+        if (ok) {
+            stops.push_back(i);
+            while (i < track.size() && (track[i] - current).length() <= STOP_AREA) {
+                i++;
+            }
+            i--;
+        }
+    }
+    return stops;
+}
+
+// Smoothing on copies of points which smoothCurve() should agree with
+std::vector<Point> recursiveSmoothCurve(const RecognitionContext &context, std::vector<Point> current) {
+    assert(!current.empty());
+    BoundingBox box;
+    for (const Point &p : current) {
+        box.addPoint(p);
+    }
+    const double CLOSED_FIGURE_GAP = getClosedFigureGap(context, box);
+
+    Point start = current[0];
+    Point end = current.back();
+    if ((start - end).length() <= CLOSED_FIGURE_GAP) {
+        end = current.back() = start;
+    }
+    Segment segment(start, end);
+
+    std::pair<double, size_t> maxDistance(0, 0);
+    for (size_t i = 0; i < current.size(); i++) {
+        double d = segment.getApproximateDistanceToBorder(current[i]);
+        maxDistance = std::max(maxDistance, std::make_pair(d, i));
+    }
+
+    std::vector<Point> result;
+    if (maxDistance.first > context.trackFitGap) {
+        auto part1 = recursiveSmoothCurve(context, std::vector<Point>(current.begin(), current.begin() + maxDistance.second + 1));
+        auto part2 = recursiveSmoothCurve(context, std::vector<Point>(current.begin() + maxDistance.second, current.end()));
+        result.insert(result.end(), part1.begin(), part1.end());
+        result.insert(result.end(), part2.begin() + 1, part2.end());
+    } else {
+        result.push_back(start);
+        result.push_back(end);
+    }
+    return result;
+}
+
+// Tenth of the track is fast, the rest is a dense cluster which slows down
+Track makeSlowingDownTrack(int size) {
+    Track track;
+    int time = 0;
+    for (int i = 0; i < size; i++) {
+        Point p;
+        if (i < size / 10) {
+            p = Point(i * 10.0, 0);
+            time += 1;
+        } else {
+            double angle = i * 0.01;
+            p = Point(size / 10 * 10.0 + 5 * cos(angle), 5 * sin(angle));
+            time += 1 + (i - size / 10) / 10;
+        }
+        track.points.push_back(TrackPoint(p, time));
+    }
+    return track;
+}
+
+// Fast movement followed by a slow one with equal speeds (as with duplicate timestamps) and a stop,
+// all slow points are within the stop area of each other
+Track makeTiedSpeedsTrack(int size) {
+    Track track;
+    int time = 0;
+    for (int i = 0; i < size; i++) {
+        Point p;
+        if (i < size / 5) {
+            p = Point(i * 10.0, 0);
+        } else {
+            p = Point(size / 5 * 10.0 + (i - size / 5) / 8192.0, 0); // exact, so lengths are equal
+        }
+        time += i + 1 < size ? 1 : 2;
+        track.points.push_back(TrackPoint(p, time));
+    }
+    return track;
+}
+
+// Same track from an input device with 'factor' times higher rate, points are interpolated
+Track upsampleTrack(const Track &track, int factor) {
+    Track result;
+    for (size_t i = 0; i + 1 < track.size(); i++) {
+        for (int j = 0; j < factor; j++) {
+            double k = j * 1.0 / factor;
+            Point p = track[i] + (track[i + 1] - track[i]) * k;
+            result.points.push_back(TrackPoint(p, track[i].time + (int)((track[i + 1].time - track[i].time) * k)));
+        }
+    }
+    if (!track.empty()) {
+        result.points.push_back(track[track.size() - 1]);
+    }
+    return result;
+}
+
 class Tests : public QObject {
     Q_OBJECT
 private slots:
@@ -382,6 +506,170 @@ private slots:
         }
     }
 
+    void testSpatialIndex() {
+        const int PASSES = 5;
+        const double GAP = 1000;
+        for (int pass = 0; pass < PASSES; pass++) {
+            Model model;
+            ModelModifier modifier(model, pass);
+            std::default_random_engine generator(pass);
+            std::uniform_real_distribution<> coordGen(-1e5, 1e5);
+            for (int iteration = 0; iteration < 200; iteration++) {
+                modifier.doRandom();
+                if (model.size() > 0 && iteration % 10 == 0) {
+                    model.translate(*model.begin(), Point(coordGen(generator), coordGen(generator)));
+                }
+
+                Point p(coordGen(generator), coordGen(generator));
+                std::vector<PFigure> expected;
+                for (PFigure figure : model) {
+                    if (figure->getApproximateDistanceToBorder(p) <= GAP || figure->isInsideOrOnBorder(p)) {
+                        expected.push_back(figure);
+                    }
+                }
+                std::vector<PFigure> found = model.figuresNear(p, GAP);
+                auto it = found.begin();
+                for (PFigure figure : expected) {
+                    it = std::find(it, found.end(), figure);
+                    QVERIFY(it != found.end());
+                }
+            }
+        }
+    }
+
+    void testRemoveFigureCascade() {
+        Model model;
+        auto hub = make_shared<Rectangle>(BoundingBox({ Point(0, 0), Point(10, 10) }));
+        model.addFigure(hub);
+        std::vector<PBoundedFigure> leaves;
+        for (int i = 0; i < 100; i++) {
+            auto leaf = make_shared<Ellipse>(BoundingBox({ Point(20 * i, 50), Point(20 * i + 10, 60) }));
+            model.addFigure(leaf);
+            leaves.push_back(leaf);
+            model.addFigure(make_shared<SegmentConnection>(hub, leaf));
+        }
+        auto between = make_shared<SegmentConnection>(leaves[0], leaves[1]);
+        model.addFigure(between);
+        model.selectedFigure = between;
+
+        model.removeFigure(model.find(leaves[1]));
+        QCOMPARE(model.size(), (size_t)(1 + 99 + 99));
+        QVERIFY(!model.selectedFigure);
+        QVERIFY(model.find(between) == model.end());
+
+        model.removeFigure(model.find(hub));
+        QCOMPARE(model.size(), (size_t)99);
+        for (PFigure figure : model) {
+            QVERIFY(!!dynamic_pointer_cast<Ellipse>(figure));
+        }
+    }
+
+    void testSnapshots() {
+        Model model;
+        auto hub = make_shared<Rectangle>(BoundingBox({ Point(0, 0), Point(10, 10) }));
+        model.addFigure(hub);
+        for (int i = 0; i < 10; i++) {
+            auto leaf = make_shared<Ellipse>(BoundingBox({ Point(20 * i, 50), Point(20 * i + 10, 60) }));
+            model.addFigure(leaf);
+            model.addFigure(make_shared<SegmentConnection>(hub, leaf));
+        }
+        model.selectedFigure = hub;
+        size_t alive = Figure::figuresAlive();
+
+        Model snapshot = model.snapshot();
+        QCOMPARE(Figure::figuresAlive(), alive);
+        Model copyOfSnapshot = snapshot;
+        QVERIFY(modelsAreEqual(snapshot, copyOfSnapshot));
+
+        // moved figure and its connections are copied, others are shared
+        PFigure moved = model.translate(hub, Point(100, 0));
+        QVERIFY(moved != hub);
+        QVERIFY(model.selectedFigure == moved);
+        QCOMPARE(Figure::figuresAlive(), alive + 21 + 11);
+        QVERIFY(modelsAreEqual(snapshot, copyOfSnapshot));
+        for (PFigure figure : model) {
+            if (auto connection = dynamic_pointer_cast<SegmentConnection>(figure)) {
+                QVERIFY(connection->getFigureA() == moved);
+                QVERIFY(connection->getA().x >= 100);
+            }
+        }
+
+        // the figure is owned by the model now
+        QVERIFY(model.translate(moved, Point(1, 0)) == moved);
+        QCOMPARE(Figure::figuresAlive(), alive + 21 + 11);
+
+        model.removeFigure(model.find(moved));
+        QCOMPARE(model.size(), (size_t)10);
+        QCOMPARE(snapshot.size(), (size_t)21);
+        QVERIFY(modelsAreEqual(snapshot, copyOfSnapshot));
+    }
+
+    void testSnapshotsShareStructure() {
+        const size_t FIGURES = 10000;
+        Model model;
+        PFigure middle;
+        for (size_t i = 0; i < FIGURES; i++) {
+            auto figure = make_shared<Rectangle>(BoundingBox({ Point(20 * i, 0), Point(20 * i + 10, 10) }));
+            model.addFigure(figure);
+            if (i == FIGURES / 2) {
+                middle = figure;
+            }
+        }
+
+        // neither the snapshot nor the change depends on the number of figures (which is much larger)
+        size_t allocations = allocationsCount;
+        Model snapshot = model.snapshot();
+        QVERIFY(allocationsCount - allocations < 10);
+        allocations = allocationsCount;
+        PFigure moved = model.translate(middle, Point(0, 100));
+        QVERIFY(allocationsCount - allocations < FIGURES / 10);
+
+        QVERIFY(snapshot.find(middle) != snapshot.end());
+        QVERIFY(model.find(middle) == model.end());
+        auto isNear = [](const Model &model, const PFigure &figure, const Point &p) {
+            std::vector<PFigure> found = model.figuresNear(p, 1);
+            return std::find(found.begin(), found.end(), figure) != found.end();
+        };
+        Point p = middle->getBoundingBox().center();
+        QVERIFY(isNear(snapshot, middle, p));
+        QVERIFY(!isNear(model, middle, p));
+        QVERIFY(!isNear(model, moved, p));
+        QVERIFY(isNear(model, moved, moved->getBoundingBox().center()));
+        QCOMPARE(model.size(), FIGURES);
+        QCOMPARE(snapshot.size(), FIGURES);
+    }
+
+    void testModelChanges() {
+        const int PASSES = 5;
+        for (int pass = 0; pass < PASSES; pass++) {
+            Model model;
+            ModelModifier modifier(model, pass);
+            std::vector<ModelChange> changes;
+            std::vector<Model> states { model };
+            for (int iteration = 0; iteration < 50; iteration++) {
+                model.beginRecording();
+                for (int i = 0; i < 3; i++) {
+                    modifier.doRandom();
+                }
+                if (model.size() > 0) {
+                    PFigure figure = model.translate(*model.begin(), Point(10, 20));
+                    model.modify(figure)->setLabel("changed");
+                    model.selectedFigure = figure;
+                }
+                changes.push_back(model.endRecording());
+                states.push_back(model);
+            }
+            for (int i = changes.size() - 1; i >= 0; i--) {
+                model.undo(changes[i]);
+                QVERIFY(modelsAreEqual(model, states[i]));
+            }
+            for (size_t i = 0; i < changes.size(); i++) {
+                model.redo(changes[i]);
+                QVERIFY(modelsAreEqual(model, states[i + 1]));
+            }
+        }
+    }
+
     void testRecognition() {
         std::pair<const char*, const std::type_info&> types[] = {
             { "segment", typeid(figures::Segment) },
@@ -389,28 +677,21 @@ private slots:
             { "rectangle", typeid(figures::Rectangle) },
             { "curve", typeid(figures::Curve) },
         };
-        setRecognitionPreset(RecognitionPreset::Mouse);
+        RecognitionContext context(RecognitionPreset::Mouse);
         int passed = 0, total = 0;
         for (const auto &currentType : types) {
             qDebug() << currentType.first;
-            int testId = 1;
-            for (;; testId++) {
-                char resourceName[64];
-                snprintf(resourceName, sizeof resourceName, ":/tests/tracks/mouse/%s/%02d.track", currentType.first, testId);
-                QFile file(resourceName);
-                if (!file.open(QFile::ReadOnly | QFile::Text)) {
-                    break;
-                }
-
-                QByteArray inData = file.readAll();
-                std::stringstream inDataStream;
-                inDataStream << inData.toStdString();
-
-                Track track;
-                inDataStream >> track;
-
+            std::vector<Track> tracks = loadCorpusTracks(currentType.first);
+            for (size_t testId = 1; testId <= tracks.size(); testId++) {
+                const Track &track = tracks[testId - 1];
                 Model model;
-                PFigure figure = recognize(track, model);
+                // the fit the figure was chosen by is reported, curves are not fitted
+                RecognizedEdit edit = recognizeEdit(context, track, model);
+                bool isFitted = edit.action == RecognizedEdit::Action::Add && !dynamic_pointer_cast<Curve>(edit.figure);
+                QCOMPARE(std::isnan(edit.fit), !isFitted);
+                QVERIFY(!isFitted || edit.fit >= context.minFitPointsAmount);
+
+                PFigure figure = recognize(context, track, model);
                 if (!figure || typeid(*figure) != currentType.second) {
                     qDebug() << "Failed" << currentType.first << testId;
                     //qDebug() << "Received: " << figure->str().c_str();
@@ -419,9 +700,936 @@ private slots:
                 }
                 total++;
             }
-            QVERIFY(testId > 1);
+            QVERIFY(!tracks.empty());
+        }
+        QCOMPARE(passed, total);
+    }
+
+    void testRecognitionContextParameters() {
+        Model model;
+        model.addFigure(std::make_shared<figures::Segment>(Point(0, 0), Point(100, 0)));
+        Track zigzag;
+        for (int i = 0; i < 10; i++) {
+            zigzag.points.push_back(TrackPoint(Point(50 + i, i % 2 ? 20 : 0), i * 10));
+        }
+
+        RecognitionContext context(RecognitionPreset::Mouse);
+        QVERIFY(recognizeEdit(context, zigzag, model).action == RecognizedEdit::Action::Remove);
+        context.deletionMoveMinCount = 20;
+        QVERIFY(recognizeEdit(context, zigzag, model).action != RecognizedEdit::Action::Remove);
+        context = RecognitionContext(RecognitionPreset::Mouse);
+        context.deletionMaxTime = 50;
+        QVERIFY(recognizeEdit(context, zigzag, model).action != RecognizedEdit::Action::Remove);
+    }
+
+    void testTrackFilter() {
+        std::pair<const char*, const std::type_info&> types[] = {
+            { "segment", typeid(figures::Segment) },
+            { "ellipse", typeid(figures::Ellipse) },
+            { "rectangle", typeid(figures::Rectangle) },
+            { "curve", typeid(figures::Curve) },
+        };
+        // mouse tracks were stored with this scale factor, their points are whole pixels apart
+        const double SCALE_FACTOR = 1.25;
+        const int UPSAMPLE_FACTOR = 8;
+        RecognitionContext context(RecognitionPreset::Mouse);
+        TrackFilter filter((TrackFilterSettings()));
+        auto isRecognized = [&context](const Track &track, const std::type_info &type) {
+            Model model;
+            PFigure figure = recognize(context, track, model);
+            return figure && typeid(*figure) == type;
+        };
+        int passed = 0, upsampledPassed = 0, filteredPassed = 0, total = 0;
+        size_t upsampledSize = 0, filteredSize = 0;
+        for (const auto &currentType : types) {
+            for (const Track &track : loadCorpusTracks(currentType.first)) {
+                // nothing to drop in tracks from a mouse
+                Track filtered = filter.apply(track, SCALE_FACTOR);
+                QCOMPARE(filtered.size(), track.size());
+                passed += isRecognized(filtered, currentType.second);
+
+                Track upsampled = upsampleTrack(track, UPSAMPLE_FACTOR);
+                filtered = filter.apply(upsampled, SCALE_FACTOR);
+                QCOMPARE(filtered[0].time, upsampled[0].time);
+                QCOMPARE(filtered[filtered.size() - 1].time, upsampled[upsampled.size() - 1].time);
+                upsampledSize += upsampled.size();
+                filteredSize += filtered.size();
+                upsampledPassed += isRecognized(upsampled, currentType.second);
+                filteredPassed += isRecognized(filtered, currentType.second);
+                total++;
+            }
         }
         QCOMPARE(passed, total);
+        QVERIFY(filteredPassed >= upsampledPassed);
+        QVERIFY(filteredSize * 3 < upsampledSize);
+
+        // jitter of a slow movement is smoothed
+        TrackFilterSettings settings;
+        settings.minDistance = 0;
+        settings.smoothJitter = true;
+        filter.setSettings(settings);
+        Track jittered;
+        for (int i = 0; i < 100; i++) {
+            jittered.points.push_back(TrackPoint(Point(i * 0.1, i % 2 ? 1 : -1), i * 8));
+        }
+        Track smoothed = filter.apply(jittered, 1);
+        QCOMPARE(smoothed.size(), jittered.size());
+        for (size_t i = jittered.size() / 2; i < jittered.size(); i++) {
+            QVERIFY(fabs(smoothed[i].y) < 0.2);
+            QCOMPARE(smoothed[i].time, jittered[i].time);
+        }
+    }
+
+    void testConcurrentRecognition() {
+        std::vector<Track> tracks = loadCorpusTracks();
+        const RecognitionContext contexts[] = {
+            RecognitionContext(RecognitionPreset::Mouse),
+            RecognitionContext(RecognitionPreset::Touch)
+        };
+        auto recognizeAll = [&tracks](const RecognitionContext &context) {
+            std::vector<std::string> result;
+            for (const Track &track : tracks) {
+                Model model;
+                PFigure figure = recognize(context, track, model);
+                result.push_back(figure ? figure->str() : "");
+            }
+            return result;
+        };
+        std::vector<std::string> expected[] = { recognizeAll(contexts[0]), recognizeAll(contexts[1]) };
+
+        const int THREADS = 8;
+        std::vector<std::vector<std::string>> results(THREADS);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREADS; i++) {
+            threads.push_back(std::thread([&, i]() {
+                results[i] = recognizeAll(contexts[i % 2]);
+            }));
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < THREADS; i++) {
+            QVERIFY(results[i] == expected[i % 2]);
+        }
+    }
+
+    void testConcurrentRecognitionOnSharedModel() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        std::default_random_engine generator(1);
+        auto randint = [&generator](int l, int r) {
+            return std::uniform_int_distribution<>(l, r)(generator);
+        };
+        Model model;
+        ModelModifier modifier(model, 1);
+        for (int i = 0; i < 200; i++) {
+            modifier.addFigure();
+        }
+
+        // clicks, moves and zigzags near random figures
+        std::vector<PFigure> figures(model.begin(), model.end());
+        std::vector<Track> tracks;
+        for (int i = 0; i < 300; i++) {
+            PFigure target = figures[randint(0, figures.size() - 1)];
+            Point start = target->getApproximateNearestPointOnBorder(Point(randint(-1e5, 1e5), randint(-1e5, 1e5)));
+            Point end = start + Point(randint(-100, 100), randint(-100, 100));
+            Track track;
+            int kind = randint(0, 2);
+            int points = kind == 0 ? 1 : 10;
+            for (int j = 0; j < points; j++) {
+                double k = kind == 2 ? j % 2 : (points > 1 ? j * 1.0 / (points - 1) : 0);
+                track.points.push_back(TrackPoint(start + (end - start) * k, j * 10));
+            }
+            tracks.push_back(track);
+        }
+
+        // all threads read the same model, nothing is built on the first use
+        const Model &shared = model;
+        auto recognizeAll = [&]() {
+            RecognitionScratch scratch;
+            std::vector<std::string> result;
+            for (const Track &track : tracks) {
+                RecognizedEdit edit = recognizeEdit(context, track, shared, scratch);
+                std::stringstream description;
+                description << (int)edit.action << " " << (edit.figure ? edit.figure->str() : "")
+                            << " " << edit.translation.x << " " << edit.translation.y;
+                result.push_back(description.str());
+            }
+            return result;
+        };
+        size_t version = model.version();
+        std::vector<std::string> expected = recognizeAll();
+
+        const int THREADS = 8;
+        std::vector<std::vector<std::string>> results(THREADS);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREADS; i++) {
+            threads.push_back(std::thread([&, i]() {
+                results[i] = recognizeAll();
+            }));
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < THREADS; i++) {
+            QVERIFY(results[i] == expected);
+        }
+        QCOMPARE(model.version(), version);
+    }
+
+    void testViewportCulling() {
+        Model model;
+        model.addFigure(make_shared<Rectangle>(BoundingBox({ Point(10, 10), Point(50, 50) })));
+        model.addFigure(make_shared<Segment>(Point(-100, 20), Point(20, 20)));
+        model.addFigure(make_shared<Ellipse>(BoundingBox({ Point(1000, 1000), Point(1100, 1100) })));
+        model.addFigure(make_shared<Curve>(std::vector<Point>({ Point(-500, 0), Point(-400, 50), Point(-300, 0) })));
+
+        // the widget shows (0, 0)--(200, 200) of the model
+        Ui::ModelWidget widget;
+        widget.setModel(model);
+        widget.resize(200, 200);
+        widget.grab();
+        QCOMPARE(widget.paintStatistics().drawnFigures, (size_t)2);
+        QCOMPARE(widget.paintStatistics().culledFigures, (size_t)2);
+
+        widget.setScaleFactor(0.1);
+        widget.grab();
+        QCOMPARE(widget.paintStatistics().drawnFigures, (size_t)3);
+        QCOMPARE(widget.paintStatistics().culledFigures, (size_t)1);
+    }
+
+    void testModelCache() {
+        Model model;
+        auto segment = make_shared<Segment>(Point(10, 10), Point(50, 50));
+        model.addFigure(segment);
+
+        // a figure being drawn is painted over the cached model, other edits change its figures
+        auto added = make_shared<Ellipse>(BoundingBox({ Point(60, 60), Point(90, 90) }));
+        QVERIFY(isModelUnchanged(EditPreview(), model));
+        QVERIFY(isModelUnchanged(previewEdit(RecognizedEdit(RecognizedEdit::Action::Add, added), model), model));
+        QVERIFY(!isModelUnchanged(previewEdit(RecognizedEdit(RecognizedEdit::Action::Remove, segment), model), model));
+        QVERIFY(!isModelUnchanged(previewEdit(RecognizedEdit(RecognizedEdit::Action::Click, segment), model), model));
+
+        Ui::ModelWidget widget;
+        widget.setModel(model);
+        widget.resize(200, 200);
+        widget.grab();
+        QVERIFY(!widget.paintStatistics().fromCache);
+        widget.grab();
+        QVERIFY(widget.paintStatistics().fromCache);
+
+        widget.getModel().addFigure(make_shared<Segment>(Point(20, 10), Point(60, 50)));
+        widget.grab();
+        QVERIFY(!widget.paintStatistics().fromCache);
+        QCOMPARE(widget.paintStatistics().drawnFigures, (size_t)2);
+        widget.grab();
+        QVERIFY(widget.paintStatistics().fromCache);
+
+        widget.setScaleFactor(2);
+        widget.grab();
+        QVERIFY(!widget.paintStatistics().fromCache);
+
+        widget.resize(300, 200);
+        widget.grab();
+        QVERIFY(!widget.paintStatistics().fromCache);
+        widget.grab();
+        QVERIFY(widget.paintStatistics().fromCache);
+    }
+
+    void testCurvePaintCache() {
+        auto curve = make_shared<Curve>(std::vector<Point>({ Point(0, 0), Point(10, 20), Point(30, 0) }));
+        curve->arrowEnd[1] = true;
+        QImage image(100, 100, QImage::Format_ARGB32);
+        QPainter painter(&image);
+        FigurePainter fpainter(painter);
+        curve->visit(fpainter);
+        QVERIFY(curve->paintCache.data);
+        QVERIFY(!curve->paintCache.data->path.isEmpty());
+        // segments and arrow branches are separate subpaths, so they are not joined
+        const QPainterPath &path = curve->paintCache.data->path;
+        int subpaths = 0;
+        for (int i = 0; i < path.elementCount(); i++) {
+            subpaths += path.elementAt(i).isMoveTo();
+        }
+        QCOMPARE(subpaths, 2 + 2);
+
+        // it is not copied
+        QVERIFY(!Curve(*curve).paintCache.data);
+        auto isReset = [&curve, &fpainter](std::function<void()> change) {
+            curve->visit(fpainter);
+            change();
+            return !curve->paintCache.data;
+        };
+        QVERIFY(isReset([&]() { curve->translate(Point(1, 1)); }));
+        QVERIFY(isReset([&]() { makeHorizontallySymmetric(curve); }));
+        QVERIFY(isReset([&]() { makeVerticallySymmetric(curve); }));
+        Model model;
+        model.addFigure(curve);
+        curve.reset();
+        curve = std::dynamic_pointer_cast<Curve>(*model.begin());
+        QVERIFY(isReset([&]() { GridAlignLayouter(7).updateLayout(model, curve); }));
+    }
+
+    void testPainterBatching() {
+        Model model;
+        auto segment = make_shared<Segment>(Point(10, 10), Point(150, 60));
+        segment->setArrowedA(true);
+        segment->setArrowedB(true);
+        segment->setLabel("segment");
+        model.addFigure(segment);
+        model.addFigure(make_shared<Rectangle>(BoundingBox({ Point(20, 80), Point(120, 150) })));
+        model.addFigure(make_shared<Ellipse>(BoundingBox({ Point(60, 100), Point(180, 190) })));
+        auto curve = make_shared<Curve>(std::vector<Point>({ Point(10, 200), Point(80, 260), Point(150, 210), Point(190, 290) }));
+        curve->arrowBegin[0] = curve->arrowEnd[2] = true;
+        curve->setLabel("curve");
+        model.addFigure(curve);
+        model.addFigure(make_shared<Segment>(Point(300, 250), Point(301, 251)));
+        auto selected = make_shared<Rectangle>(BoundingBox({ Point(250, 20), Point(380, 120) }));
+        selected->setLabel("selected\nfigure");
+        model.addFigure(selected);
+        // overlapping figures of different colors: the later ones are drawn over the earlier ones
+        model.addFigure(make_shared<Rectangle>(BoundingBox({ Point(200, 150), Point(300, 250) })));
+        auto crossing = make_shared<Segment>(Point(180, 200), Point(320, 200));
+        model.addFigure(crossing);
+        model.addFigure(make_shared<Segment>(Point(250, 160), Point(250, 240)));
+        auto figureColor = [&](const PFigure &figure) {
+            return figure == selected || figure == crossing ? QColor(Qt::blue) : QColor(Qt::black);
+        };
+
+        for (double scaleFactor : { 1.0, 0.2 }) {
+            auto draw = [&](bool batching, bool perFigure) {
+                QImage image(400, 300, QImage::Format_ARGB32);
+                image.fill(Qt::white);
+                QPainter painter(&image);
+                QFont font;
+                font.setPointSizeF(10 * scaleFactor);
+                painter.setFont(font);
+                QPen pen(Qt::black);
+                pen.setWidthF(scaleFactor);
+                painter.setPen(pen);
+                Scaler scaler(Point(), scaleFactor);
+                if (perFigure) {
+                    // the reference: every figure by itself in the model order
+                    for (PFigure figure : model) {
+                        FigurePainter fpainter(painter, scaler);
+                        fpainter.setColor(figureColor(figure));
+                        figure->visit(fpainter);
+                    }
+                } else {
+                    FigurePainter fpainter(painter, scaler, batching);
+                    for (PFigure figure : model) {
+                        fpainter.setColor(figureColor(figure));
+                        figure->visit(fpainter);
+                    }
+                    fpainter.flush();
+                }
+                painter.end();
+                return image;
+            };
+            QImage expected = draw(false, true);
+            QImage blank(expected.size(), expected.format());
+            blank.fill(Qt::white);
+            QVERIFY(expected != blank);
+            QCOMPARE(draw(true, false), expected);
+            QCOMPARE(draw(false, false), expected);
+            if (scaleFactor == 1.0) {
+                // where the blue segment crosses the black rectangle it is on top, the black segment is over it
+                QCOMPARE(expected.pixel(200, 200), QColor(Qt::blue).rgb());
+                QCOMPARE(expected.pixel(250, 200), QColor(Qt::black).rgb());
+            }
+        }
+    }
+
+    void testTextMetricsCache() {
+        clearTextMetricsCache();
+        auto rectangle = make_shared<Rectangle>(BoundingBox({ Point(0, 0), Point(100, 50) }));
+        rectangle->setLabel("label");
+        auto segment = make_shared<Segment>(Point(0, 0), Point(100, 20));
+        segment->setLabel("two\nlines");
+        TextPosition expected[] = { getTextPosition(*rectangle), getTextPosition(*segment) };
+        size_t size = getTextMetricsCacheSize();
+        QVERIFY(size > 0);
+
+        // labels of moved segments are not measured again
+        for (int i = 0; i < 10; i++) {
+            segment->translate(Point(1, 1));
+            getTextPosition(*segment);
+            getTextPosition(*rectangle);
+        }
+        QCOMPARE(getTextMetricsCacheSize(), size);
+        segment->translate(Point(-10, -10));
+
+        for (size_t i = 0; i < 2 * TEXT_METRICS_CACHE_SIZE; i++) {
+            Rectangle other(BoundingBox({ Point(0, 0), Point(100, 50) }));
+            other.setLabel(std::to_string(i));
+            getTextPosition(other);
+        }
+        QCOMPARE(getTextMetricsCacheSize(), TEXT_METRICS_CACHE_SIZE);
+
+        // evicted sizes are measured again
+        TextPosition actual[] = { getTextPosition(*rectangle), getTextPosition(*segment) };
+        for (int i = 0; i < 2; i++) {
+            QVERIFY(actual[i].leftUp == expected[i].leftUp);
+            QCOMPARE(actual[i].width, expected[i].width);
+            QCOMPARE(actual[i].height, expected[i].height);
+            QCOMPARE(actual[i].rotation, expected[i].rotation);
+        }
+    }
+
+    void testTracing() {
+        if (!tracing::isAvailable()) {
+            QSKIP("Tracing is compiled out");
+        }
+        Track track;
+        for (int i = 0; i < 50; i++) {
+            track.points.push_back(TrackPoint(Point(i * 4, 0), i * 10));
+        }
+        RecognitionContext context(RecognitionPreset::Mouse);
+        auto recognizeTrack = [&]() {
+            Model model;
+            recognize(context, track, model);
+        };
+        auto countEvents = [](const std::string &trace, const std::string &name) {
+            size_t count = 0;
+            for (size_t pos = 0; (pos = trace.find("{\"name\":\"" + name + "\"", pos)) != std::string::npos; pos++) {
+                count++;
+            }
+            return count;
+        };
+        auto writeTrace = []() {
+            std::stringstream out;
+            tracing::writeTrace(out);
+            return out.str();
+        };
+
+        recognizeTrack();
+        QCOMPARE(countEvents(writeTrace(), "recognizeEdit"), (size_t)0);
+
+        tracing::start();
+        recognizeTrack();
+        std::thread thread(recognizeTrack);
+        thread.join();
+        tracing::stop();
+        recognizeTrack();
+        std::string trace = writeTrace();
+        QCOMPARE(countEvents(trace, "recognizeEdit"), (size_t)2);
+        QCOMPARE(countEvents(trace, recognitionStageName(RecognitionStage::Grabs)), (size_t)2);
+        QCOMPARE(countEvents(trace, "thread_name"), (size_t)2);
+        QVERIFY(trace.find("\"droppedEvents\":0") != std::string::npos);
+
+        // a new recording drops events of the previous one
+        tracing::start();
+        recognizeTrack();
+        tracing::stop();
+        QCOMPARE(countEvents(writeTrace(), "recognizeEdit"), (size_t)1);
+    }
+
+    void testStreamingRecognizer() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        std::vector<Track> tracks = loadCorpusTracks();
+        // timestamps going backwards give negative speeds, repeated ones give infinite speeds
+        Track backwards = tracks[0];
+        for (size_t i = 1; i < backwards.size(); i += 2) {
+            backwards.points[i].time = backwards[i - 1].time - (i % 7);
+        }
+        tracks.push_back(backwards);
+        tracks.push_back(makeTiedSpeedsTrack(300));
+        for (const Track &track : tracks) {
+            Model previewModel;
+            StreamingRecognizer recognizer(context);
+            Track prefix;
+            for (const TrackPoint &point : track.points) {
+                recognizer.addPoint(point);
+                prefix.points.push_back(point);
+                QVERIFY(recognizer.relativeSpeeds() == calculateRelativeSpeeds(prefix));
+                QVERIFY(recognizer.stops() == getSpeedBreakpoints(context, prefix));
+                recognizer.preview(previewModel);
+            }
+            QCOMPARE(previewModel.size(), (size_t)0);
+
+            Model expectedModel, model;
+            PFigure expected = recognize(context, track, expectedModel);
+            // the preview of the finished track (e.g. by RecognitionWorker) is applied as is
+            QVERIFY(recognizer.requestPreview(model, true));
+            QVERIFY(!recognizer.requestPreview(model, true));
+            QVERIFY(recognizer.setPreview(StreamingRecognizer::calculatePreview(context, recognizer.trackId(), recognizer.track(), model)));
+            QVERIFY(recognizer.hasFinalPreview(model));
+            PFigure figure = recognizer.recognize(model);
+            QCOMPARE(!!figure, !!expected);
+            if (figure) {
+                QCOMPARE(figure->str(), expected->str());
+            }
+
+            // recognition without a final preview starts from the streamed features
+            Model streamedModel;
+            recognizer.preview(streamedModel);
+            recognizer.addPoint(track.points.back());
+            Track extended = track;
+            extended.points.push_back(track.points.back());
+            Model extendedModel;
+            PFigure extendedExpected = recognize(context, extended, extendedModel);
+            QVERIFY(!recognizer.hasFinalPreview(streamedModel));
+            PFigure streamed = recognizer.recognize(streamedModel);
+            QCOMPARE(!!streamed, !!extendedExpected);
+            if (streamed) {
+                QCOMPARE(streamed->str(), extendedExpected->str());
+            }
+        }
+    }
+
+    void testSmoothCurve() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        std::vector<Track> tracks = loadCorpusTracks();
+        QVERIFY(!tracks.empty());
+
+        // random walks, some of them return to the start
+        std::default_random_engine generator(1);
+        std::uniform_real_distribution<double> stepGen(-20, 20);
+        for (int i = 0; i < 1000; i++) {
+            Track track;
+            Point p(0, 0);
+            int size = 1 + i % 100;
+            for (int j = 0; j < size; j++) {
+                track.points.push_back(TrackPoint(p, j * 10));
+                p = p + Point(stepGen(generator), stepGen(generator));
+            }
+            if (i % 3 == 0) {
+                track.points.push_back(TrackPoint(track[0] + Point(1, 1), size * 10));
+            }
+            tracks.push_back(track);
+        }
+
+        std::vector<RecognitionScratch::SmoothingRange> ranges;
+        auto unique = [](std::vector<Point> points) {
+            points.erase(std::unique(points.begin(), points.end()), points.end());
+            return points;
+        };
+        for (const Track &track : tracks) {
+            // the whole track and its parts between stops, as curves are recognized
+            std::vector<std::pair<size_t, size_t>> parts { std::make_pair(0, track.size() - 1) };
+            std::vector<int> stops = getSpeedBreakpoints(context, track);
+            stops.insert(stops.begin(), 0);
+            stops.push_back(track.size() - 1);
+            for (size_t i = 0; i + 1 < stops.size(); i++) {
+                if (stops[i] < stops[i + 1]) {
+                    parts.push_back(std::make_pair(stops[i], stops[i + 1]));
+                }
+            }
+            for (const auto &part : parts) {
+                size_t first = part.first, last = part.second;
+                std::vector<Point> result;
+                smoothCurve(context, track, first, last, ranges, result);
+                std::vector<Point> points(track.points.begin() + first, track.points.begin() + last + 1);
+                QVERIFY(unique(result) == unique(recursiveSmoothCurve(context, points)));
+            }
+        }
+    }
+
+    void testTrackFeatures() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        for (const Track &track : loadCorpusTracks()) {
+            TrackFeatures features(track);
+            std::vector<double> sorted = features.speeds();
+            std::sort(sorted.begin(), sorted.end());
+            QCOMPARE(features.speedPercentile90(), sorted[sorted.size() * 9 / 10]);
+
+            BoundingBox box = features.boundingBox();
+            for (Point p : track.points) {
+                QVERIFY(box.leftUp.x <= p.x && p.x <= box.rightDown.x);
+                QVERIFY(box.leftUp.y <= p.y && p.y <= box.rightDown.y);
+            }
+
+            // stops for one threshold are not recalculated when another one is requested
+            const std::vector<int> &stops = features.stops(context.speedStopThreshold, context.stopArea);
+            const std::vector<int> &curveStops = features.stops(context.curveSpeedStopThreshold, context.stopArea);
+            QVERIFY(&features.stops(context.speedStopThreshold, context.stopArea) == &stops);
+
+            StreamingRecognizer recognizer(context);
+            for (const TrackPoint &point : track.points) {
+                recognizer.addPoint(point);
+            }
+            TrackFeatures streamingFeatures(recognizer.track(), recognizer.streamedFeatures());
+            QCOMPARE(streamingFeatures.speedPercentile90(), features.speedPercentile90());
+            QVERIFY(streamingFeatures.relativeSpeeds() == features.relativeSpeeds());
+            QVERIFY(streamingFeatures.stops(context.speedStopThreshold, context.stopArea) == stops);
+            QVERIFY(streamingFeatures.stops(context.curveSpeedStopThreshold, context.stopArea) == curveStops);
+        }
+    }
+
+    void testRecognitionAllocations() {
+        std::vector<Track> tracks = loadCorpusTracks();
+        QVERIFY(!tracks.empty());
+
+        // the model is populated around the tracks, so figures are found near their ends
+        RecognitionContext context(RecognitionPreset::Mouse);
+        Model model;
+        std::default_random_engine generator(1);
+        std::uniform_real_distribution<double> offset(-300, 300);
+        for (int i = 0; i < 300; i++) {
+            Point center(200 + offset(generator), 200 + offset(generator));
+            if (i % 2) {
+                model.addFigure(make_shared<Segment>(center, center + Point(offset(generator) / 10, offset(generator) / 10)));
+            } else {
+                model.addFigure(make_shared<Ellipse>(BoundingBox({ center, center + Point(5, 5) })));
+            }
+        }
+        std::vector<Track> probes = tracks;
+        for (const PFigure &figure : model) {
+            Point border = figure->getApproximateNearestPointOnBorder(Point(0, 0));
+            Track click;
+            click.points.push_back(TrackPoint(border, 0));
+            probes.push_back(click);
+        }
+
+        RecognitionScratch scratch;
+        for (const Track &track : probes) {
+            recognizeEdit(context, track, model, scratch);
+        }
+        // once buffers of the scratch have grown, everything allocated is kept by the recognized figure
+        size_t added = 0, found = 0;
+        for (const Track &track : probes) {
+            size_t allocationsBefore = allocationsCount;
+            long long liveBefore = liveAllocations;
+            {
+                RecognizedEdit edit = recognizeEdit(context, track, model, scratch);
+                QCOMPARE((long long)(allocationsCount - allocationsBefore), liveAllocations - liveBefore);
+                bool isAdded = edit.action == RecognizedEdit::Action::Add;
+                QCOMPARE(allocationsCount > allocationsBefore, isAdded);
+                added += isAdded;
+                found += edit.figure && !isAdded;
+            }
+            QCOMPARE(liveAllocations, liveBefore);
+        }
+        QVERIFY(added > 0);
+        QVERIFY(found > 0);
+
+        // measuring stages does not allocate either
+        RecognitionStageTimes times;
+        scratch.stageTimes = &times;
+        for (const Track &track : tracks) {
+            size_t allocationsBefore = allocationsCount;
+            long long liveBefore = liveAllocations;
+            RecognizedEdit edit = recognizeEdit(context, track, model, scratch);
+            QCOMPARE((long long)(allocationsCount - allocationsBefore), liveAllocations - liveBefore);
+            bool isCurve = !!dynamic_pointer_cast<Curve>(edit.figure);
+            QVERIFY(times[RecognitionStage::Clicks] < 0);
+            QVERIFY(times[RecognitionStage::Grabs] >= 0);
+            QCOMPARE(times[RecognitionStage::CurveSmoothing] >= 0, isCurve);
+        }
+        Track click;
+        click.points.push_back(TrackPoint(Point(10, 10), 0));
+        recognizeEdit(context, click, model, scratch);
+        QVERIFY(times[RecognitionStage::Clicks] >= 0);
+        QVERIFY(times[RecognitionStage::Grabs] < 0);
+    }
+
+    void testNearestPointsOnBorder() {
+        std::default_random_engine generator(1);
+        std::uniform_real_distribution<double> coordGen(-100, 100);
+        auto randomPoint = [&]() { return Point(coordGen(generator), coordGen(generator)); };
+        std::vector<PFigure> figures {
+            make_shared<Segment>(randomPoint(), randomPoint()),
+            make_shared<Segment>(Point(1, 1), Point(1, 1)),
+            make_shared<Ellipse>(BoundingBox({ randomPoint(), randomPoint() })),
+            make_shared<Ellipse>(BoundingBox({ Point(-10, -20), Point(10, 20) })),
+            make_shared<Rectangle>(BoundingBox({ randomPoint(), randomPoint() })),
+            make_shared<Rectangle>(BoundingBox({ Point(-10, -20), Point(10, 20) })),
+            make_shared<Rectangle>(BoundingBox({ Point(-10, 5), Point(10, 5) })),
+            make_shared<Curve>(std::vector<Point> { randomPoint(), randomPoint(), randomPoint(), randomPoint() }),
+        };
+        std::vector<double> x, y;
+        for (int i = 0; i < 1000; i++) {
+            Point p = randomPoint();
+            x.push_back(p.x);
+            y.push_back(p.y);
+        }
+        x.push_back(0); // center of the second ellipse and rectangle
+        y.push_back(0);
+
+        for (PFigure figure : figures) {
+            std::vector<double> nearestX(x.size()), nearestY(y.size());
+            size_t processed = figure->getApproximateNearestPointsOnBorder(x.data(), y.data(), x.size(), INFINITY, INFINITY, nearestX.data(), nearestY.data());
+            QCOMPARE(processed, x.size());
+            for (size_t i = 0; i < x.size(); i++) {
+                Point expected = figure->getApproximateNearestPointOnBorder(Point(x[i], y[i]));
+                QVERIFY(nearestX[i] == expected.x);
+                QVERIFY(nearestY[i] == expected.y);
+            }
+
+            // figures may stop after the first failed point, but not before it
+            for (double failDistance : { 0.0, 1.0, 10.0, 50.0 }) {
+                size_t firstFailed = x.size();
+                for (size_t i = 0; i < x.size() && firstFailed == x.size(); i++) {
+                    if (fabs(x[i] - nearestX[i]) > failDistance || fabs(y[i] - nearestY[i]) > failDistance * 2) {
+                        firstFailed = i;
+                    }
+                }
+                std::vector<double> failedX(x.size()), failedY(y.size());
+                processed = figure->getApproximateNearestPointsOnBorder(x.data(), y.data(), x.size(), failDistance, failDistance * 2, failedX.data(), failedY.data());
+                if (firstFailed == x.size()) {
+                    QCOMPARE(processed, x.size());
+                } else {
+                    QVERIFY(processed > firstFailed);
+                    QVERIFY(processed == x.size() || processed == firstFailed + 1);
+                }
+                for (size_t i = 0; i < std::min(processed, firstFailed + 1); i++) {
+                    QVERIFY(failedX[i] == nearestX[i]);
+                    QVERIFY(failedY[i] == nearestY[i]);
+                }
+            }
+        }
+
+        // points outside of a rectangle are moved to its border, points inside are moved to the nearest side
+        Rectangle rectangle(BoundingBox({ Point(-10, -20), Point(10, 20) }));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(-15, -30)) == Point(-10, -20));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(5, 30)) == Point(5, 20));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(15, 3)) == Point(10, 3));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(2, 3)) == Point(10, 3));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(-2, 17)) == Point(-2, 20));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(0, 15)) == Point(0, 20));
+        QVERIFY(rectangle.getApproximateNearestPointOnBorder(Point(0, 0)) == Point(-10, 0)); // the left side wins a tie
+    }
+
+    void testRecognitionKernels() {
+        std::default_random_engine generator(1);
+        std::uniform_real_distribution<double> coordGen(-1000, 1000);
+        std::uniform_int_distribution<int> timeGen(0, 3); // zero time differences give infinite speeds
+        std::vector<Track> tracks;
+        for (int size : { 1, 2, 3, 4, 5, 6, 7, 8, 9, 17, 5000 }) {
+            Track track;
+            int time = 0;
+            for (int i = 0; i < size; i++) {
+                time += timeGen(generator);
+                track.points.push_back(TrackPoint(Point(coordGen(generator), coordGen(generator)), time));
+            }
+            tracks.push_back(track);
+        }
+
+        std::vector<const char*> implementations = kernels::availableImplementations();
+        QVERIFY(!implementations.empty());
+        std::vector<double> dots;
+        for (const char *implementation : implementations) {
+            qDebug() << implementation;
+            QVERIFY(kernels::useImplementation(implementation));
+            std::vector<double> currentDots;
+            for (const Track &track : tracks) {
+                TrackColumns columns;
+                columns.assign(track);
+                BoundingBox box;
+                for (Point p : track.points) {
+                    box.addPoint(p);
+                }
+                QVERIFY(kernels::boundingBox(columns) == box);
+
+                std::vector<double> lengths(track.size() - 1), speeds(track.size() - 1);
+                kernels::segmentLengths(columns, lengths.data());
+                kernels::segmentSpeeds(columns, lengths.data(), speeds.data());
+                for (size_t i = 0; i + 1 < track.size(); i++) {
+                    double length = (track[i + 1] - track[i]).length();
+                    double speed = length / (track[i + 1].time - track[i].time);
+                    if (std::isinf(speed) || std::isnan(speed)) { speed = INFINITY; }
+                    QVERIFY(lengths[i] == length);
+                    QVERIFY(speeds[i] == speed);
+                }
+
+                for (double percentile : { 0.0, 0.5, 7.0, (double)INFINITY }) {
+                    std::vector<double> relativeSpeeds(speeds.size());
+                    kernels::relativeSpeeds(speeds.data(), speeds.size(), percentile, relativeSpeeds.data());
+                    for (size_t i = 0; i < speeds.size(); i++) {
+                        double x = speeds[i] / percentile;
+                        if (std::isinf(x) || std::isnan(x)) { x = 0.5; }
+                        QVERIFY(relativeSpeeds[i] == std::min(std::max(x, 0.0), 1.0));
+                    }
+                }
+
+                // partial sums are added in another order than one by one
+                double dot = kernels::segmentMiddlesDot(columns.x.data(), lengths.data(), lengths.size());
+                double expected = 0, absolute = 0;
+                for (size_t i = 0; i + 1 < track.size(); i++) {
+                    expected += (track[i].x + track[i + 1].x) * 0.5 * lengths[i];
+                    absolute += fabs(track[i].x + track[i + 1].x) * 0.5 * lengths[i];
+                }
+                QVERIFY(fabs(dot - expected) <= absolute * 1e-12);
+                currentDots.push_back(dot);
+            }
+            // but the order is the same for all implementations
+            if (dots.empty()) {
+                dots = currentDots;
+            }
+            QVERIFY(currentDots == dots);
+        }
+        QVERIFY(kernels::useImplementation(implementations[0]));
+    }
+
+    void testSpeedBreakpoints() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        std::default_random_engine generator(1);
+        std::uniform_real_distribution<double> stepGen(-3, 3);
+        std::uniform_int_distribution<int> timeGen(0, 20);
+        for (int testId = 0; testId < 1000; testId++) {
+            Track track;
+            Point p;
+            int time = 0;
+            for (int i = 0; i < 300; i++) {
+                p += Point(stepGen(generator), stepGen(generator));
+                time += timeGen(generator);
+                track.points.push_back(TrackPoint(p, time));
+            }
+            QVERIFY(getSpeedBreakpoints(context, track) == naiveSpeedBreakpoints(track, context.speedStopThreshold));
+        }
+        for (const Track &track : { makeSlowingDownTrack(1000), makeTiedSpeedsTrack(1000) }) {
+            std::vector<int> stops = getSpeedBreakpoints(context, track);
+            QVERIFY(stops == naiveSpeedBreakpoints(track, context.speedStopThreshold));
+            QVERIFY(!stops.empty());
+        }
+    }
+
+    void benchmarkSpeedBreakpoints_data() {
+        QTest::addColumn<int>("size");
+        QTest::addColumn<bool>("tied");
+        QTest::newRow("1k") << 1000 << false;
+        QTest::newRow("10k") << 10000 << false;
+        QTest::newRow("100k") << 100000 << false;
+        QTest::newRow("tied 1k") << 1000 << true;
+        QTest::newRow("tied 10k") << 10000 << true;
+        QTest::newRow("tied 100k") << 100000 << true;
+    }
+
+    void benchmarkSpeedBreakpoints() {
+        QFETCH(int, size);
+        QFETCH(bool, tied);
+        Track track = tied ? makeTiedSpeedsTrack(size) : makeSlowingDownTrack(size);
+        RecognitionContext context(RecognitionPreset::Touch);
+        std::vector<int> stops;
+        QBENCHMARK {
+            stops = getSpeedBreakpoints(context, track);
+        }
+        QVERIFY(!stops.empty());
+    }
+
+    void testStreamingRecognizerPreviews() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        Model model;
+        model.addFigure(make_shared<Rectangle>(BoundingBox({ Point(0, 0), Point(100, 100) })));
+
+        StreamingRecognizer recognizer(context);
+        std::vector<TrackPreview> previews;
+        for (int i = 0; i < 20; i++) {
+            recognizer.addPoint(TrackPoint(Point(200 + i * 10, 50), i * 10));
+            if (recognizer.requestPreview(model)) {
+                previews.push_back(StreamingRecognizer::calculatePreview(context, recognizer.trackId(), recognizer.track(), model));
+            }
+        }
+        QVERIFY(previews.size() >= 2);
+        QVERIFY(!recognizer.lastPreview(model));
+        QVERIFY(recognizer.setPreview(previews[1]));
+        QVERIFY(!recognizer.setPreview(previews[0])); // older than the current one
+        QVERIFY(recognizer.lastPreview(model));
+
+        StreamingRecognizer other(context);
+        other.addPoint(recognizer.track()[0]);
+        QVERIFY(!other.setPreview(previews.back())); // another track
+
+        Model snapshot = model.snapshot();
+        QCOMPARE(snapshot.version(), model.version());
+        model.addFigure(make_shared<Rectangle>(BoundingBox({ Point(0, 200), Point(100, 300) })));
+        QVERIFY(snapshot.version() != model.version());
+        QVERIFY(!recognizer.lastPreview(model));
+        QVERIFY(recognizer.requestPreview(model));
+
+        // previews of long tracks fall behind by a fraction of their size at most,
+        // so their total size is linear in the track size besides the ones requested by time
+        StreamingRecognizer longRecognizer(context);
+        const int LONG_SIZE = 10000, POINTS_PER_MS = 10;
+        size_t requestedSize = 0, requestedTotal = 0;
+        for (int i = 0; i < LONG_SIZE; i++) {
+            longRecognizer.addPoint(TrackPoint(Point(200 + i, 50 + i % 7), i / POINTS_PER_MS));
+            if (longRecognizer.requestPreview(model)) {
+                QVERIFY(longRecognizer.track().size() - requestedSize <= std::max((size_t)1, requestedSize / StreamingRecognizer::PREVIEW_GROWTH_DIVISOR));
+                requestedSize = longRecognizer.track().size();
+                requestedTotal += requestedSize;
+            }
+        }
+        QVERIFY(longRecognizer.track().size() - requestedSize < std::max((size_t)1, requestedSize / StreamingRecognizer::PREVIEW_GROWTH_DIVISOR));
+        size_t timeRequests = LONG_SIZE / POINTS_PER_MS / StreamingRecognizer::PREVIEW_MAX_LAG_TIME;
+        QVERIFY(requestedTotal <= (StreamingRecognizer::PREVIEW_GROWTH_DIVISOR + 2 + timeRequests) * LONG_SIZE);
+
+        // slow drawing is bounded by time
+        StreamingRecognizer slowRecognizer(context);
+        QVERIFY(slowRecognizer.requestPreview(model));
+        for (int i = 0; i < 1000; i++) {
+            slowRecognizer.addPoint(TrackPoint(Point(200 + i, 50), i * StreamingRecognizer::PREVIEW_MAX_LAG_TIME));
+            if (i >= 1) {
+                QVERIFY(slowRecognizer.requestPreview(model));
+            }
+        }
+    }
+
+    void testRecognizedEdit() {
+        RecognitionContext context(RecognitionPreset::Mouse);
+        std::default_random_engine generator(1);
+        auto randint = [&generator](int l, int r) {
+            return std::uniform_int_distribution<>(l, r)(generator);
+        };
+        for (int pass = 0; pass < 5; pass++) {
+            Model model;
+            ModelModifier modifier(model, pass);
+            for (int i = 0; i < 30; i++) {
+                modifier.addFigure();
+            }
+            for (int iteration = 0; iteration < 100; iteration++) {
+                std::vector<PFigure> figures(model.begin(), model.end());
+                PFigure target = figures[randint(0, figures.size() - 1)];
+                Point start = target->getApproximateNearestPointOnBorder(Point(randint(-1e5, 1e5), randint(-1e5, 1e5)));
+                Point end = start + Point(randint(-100, 100), randint(-100, 100));
+                if (randint(0, 1)) {
+                    model.selectedFigure = target;
+                }
+
+                // click, straight move or zigzag (deletion)
+                Track track;
+                int kind = randint(0, 2);
+                int points = kind == 0 ? 1 : 10;
+                for (int i = 0; i < points; i++) {
+                    double k = kind == 2 ? i % 2 : (points > 1 ? i * 1.0 / (points - 1) : 0);
+                    track.points.push_back(TrackPoint(start + (end - start) * k, i * 10));
+                }
+
+                Model expected(model);
+                PFigure expectedFigure = recognize(context, track, expected);
+
+                size_t version = model.version();
+                RecognizedEdit edit = recognizeEdit(context, track, model);
+                QCOMPARE(model.version(), version);
+
+                EditPreview preview = previewEdit(edit, model);
+                Model previewed;
+                for (PFigure figure : model) {
+                    auto replaced = preview.replaced.find(figure);
+                    if (replaced != preview.replaced.end()) {
+                        figure = replaced->second;
+                    }
+                    if (figure) {
+                        previewed.addFigure(figure);
+                    }
+                }
+                if (preview.added) {
+                    previewed.addFigure(preview.added);
+                }
+                QVERIFY(modelsAreEqual(previewed, expected));
+
+                PFigure figure = edit.apply(model);
+                QVERIFY(modelsAreEqual(model, expected));
+                QCOMPARE(!!figure, !!expectedFigure);
+                QCOMPARE(!!model.selectedFigure, !!expected.selectedFigure);
+                if (model.selectedFigure) {
+                    QCOMPARE(model.selectedFigure->str(), expected.selectedFigure->str());
+                    QVERIFY(preview.selectedFigure && preview.selectedFigure->str() == model.selectedFigure->str());
+                }
+                if (model.size() < 10) {
+                    modifier.addFigure();
+                }
+            }
+        }
     }
 };
 
@@ -1,9 +1,87 @@
 #include "figurepainter.h"
 #include "textpainter.h"
+#include "tracing.h"
 #include <QString>
 #include <QPointF>
 #include <QFontMetrics>
 #include <QDebug>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// Measuring text with QFontMetrics is slow, while labels are laid out on every paint,
+// so bounding rects of recently measured labels are kept
+class TextMetricsCache {
+public:
+    // baseRect's top left corner should be (0, 0)
+    QRect boundingRect(const QRect &baseRect, int flags, const std::string &text) {
+        Key key { text, baseRect.width(), baseRect.height(), flags };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                entries.splice(entries.begin(), entries, it->second);
+                return it->second->second;
+            }
+        }
+
+        QFont font;
+        font.setPointSizeF(10);
+        QFontMetrics metrics(font);
+        QRect rect = metrics.boundingRect(baseRect, flags, QString::fromStdString(text));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.count(key)) {
+            return rect;
+        }
+        entries.emplace_front(key, rect);
+        index[key] = entries.begin();
+        if (entries.size() > TEXT_METRICS_CACHE_SIZE) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return rect;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        index.clear();
+        entries.clear();
+    }
+
+private:
+    struct Key {
+        std::string text;
+        int width, height;
+        int flags;
+
+        bool operator==(const Key &other) const {
+            return text == other.text && width == other.width && height == other.height && flags == other.flags;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            size_t result = std::hash<std::string>()(key.text);
+            for (int value : { key.width, key.height, key.flags }) {
+                result = result * 31 + std::hash<int>()(value);
+            }
+            return result;
+        }
+    };
+    typedef std::list<std::pair<Key, QRect>> Entries;
+
+    std::mutex mutex;
+    Entries entries; // the most recently used go first
+    std::unordered_map<Key, Entries::iterator, KeyHash> index;
+};
+
+TextMetricsCache textMetricsCache;
 
 class TextPositionVisitor : public FigureVisitor {
 public:
@@ -13,7 +91,6 @@ public:
         const std::string &label = figure.label();
 
         Scaler scaler;
-        QString text = QString::fromStdString(label);
         QPointF a = scaler(figure.getA());
         QPointF b = scaler(figure.getB());
         if (a.x() > b.x()) {
@@ -29,11 +106,8 @@ public:
         const int BIG_SIZE = 1e6; // used in QFontMetrics call when there are no limits
         int length = (int)QVector2D(direction).length();
 
-        QFont font;
-        font.setPointSizeF(10);
-        QFontMetrics metrics(font);
         QRect baseRect(QRect(QPoint(0, 0), QPoint(BIG_SIZE, BIG_SIZE)));
-        QRect rect = metrics.boundingRect(baseRect, Qt::AlignTop | Qt::AlignLeft, text);
+        QRect rect = textMetricsCache.boundingRect(baseRect, Qt::AlignTop | Qt::AlignLeft, label);
 
         result.width = rect.width();
         result.height = rect.height();
@@ -54,22 +128,18 @@ public:
         const double REQUIRED_GAP = 0.8;
         const int BIG_SIZE = 1e6; // used in QFontMetrics call when there are no limits
 
-        QString text = QString::fromStdString(label);
         BoundingBox box = figure.getBoundingBox();
         QPointF leftUp = scaler(box.leftUp);
         QPointF rightDown = scaler(box.rightDown);
 
-        QFont font;
-        font.setPointSizeF(10);
-        QFontMetrics metrics(font);
         QPointF baseRectSize = rightDown - leftUp;
         QRect baseRect(QPoint(), QPoint((int)baseRectSize.x(), (int)baseRectSize.y()));
-        QRectF rect = metrics.boundingRect(baseRect, Qt::AlignCenter, text);
+        QRectF rect = textMetricsCache.boundingRect(baseRect, Qt::AlignCenter, label);
         if (rect.width() <= REQUIRED_GAP * baseRect.width() && rect.height() <= REQUIRED_GAP * baseRect.height()) {
             rect.translate(leftUp);
         } else {
             baseRect.setSize(QSize(BIG_SIZE, BIG_SIZE));
-            rect = metrics.boundingRect(baseRect, Qt::AlignHCenter, text);
+            rect = textMetricsCache.boundingRect(baseRect, Qt::AlignHCenter, label);
             rect.translate(QPointF(baseRectSize.x() / 2 - BIG_SIZE / 2, 0));
             rect.translate(scaler(box.leftDown()));
         }
@@ -96,8 +166,30 @@ private:
     TextPosition result;
 };
 
+BoundingBox getBoundingBox(const TextPosition &position) {
+    Point width(position.width, 0);
+    Point height(0, position.height);
+    width.rotateBy(position.rotation * PI / 180);
+    height.rotateBy(position.rotation * PI / 180);
+    BoundingBox box;
+    for (int dx = 0; dx < 2; dx++)
+        for (int dy = 0; dy < 2; dy++) {
+            box.addPoint(position.leftUp + width * dx + height * dy);
+        }
+    return box;
+}
+
 TextPosition getTextPosition(Figure &figure) {
+    TRACE_SCOPE("getTextPosition");
     TextPositionVisitor visitor;
     figure.visit(visitor);
     return visitor.textPosition();
 }
+
+size_t getTextMetricsCacheSize() {
+    return textMetricsCache.size();
+}
+
+void clearTextMetricsCache() {
+    textMetricsCache.clear();
+}
@@ -10,6 +10,14 @@ struct TextPosition {
     TextPosition() : leftUp(), width(0), height(0), rotation(0) {}
 };
 
+// Sizes of labels are cached, see TEXT_METRICS_CACHE_SIZE
 TextPosition getTextPosition(Figure &figure);
+// Box of the rotated text
+BoundingBox getBoundingBox(const TextPosition &position);
+
+// The least recently used sizes are dropped
+const size_t TEXT_METRICS_CACHE_SIZE = 4096;
+size_t getTextMetricsCacheSize();
+void clearTextMetricsCache();
 
 #endif // TEXTPAINTER_H
@@ -0,0 +1,171 @@
+#include "tracing.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tracing {
+#if ENABLE_TRACING == 1
+std::atomic<bool> recording(false);
+
+namespace {
+const size_t EVENTS_PER_THREAD = 1 << 16;
+
+struct Event {
+    const char *name;
+    long long start, duration;
+};
+
+// Written by its thread only, 'count' events are published with release
+struct ThreadBuffer {
+    int threadId;
+    std::atomic<unsigned> session;
+    std::atomic<size_t> count, dropped;
+    std::unique_ptr<Event[]> events;
+
+    explicit ThreadBuffer(int threadId) : threadId(threadId), session(0), count(0), dropped(0), events(new Event[EVENTS_PER_THREAD]) {}
+};
+
+const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+// each start() begins a new session, buffers of previous ones are cleared lazily by their threads
+std::atomic<unsigned> currentSession(0);
+// buffers outlive their threads, so events of finished threads are written too
+std::mutex buffersMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+thread_local ThreadBuffer *threadBuffer = nullptr;
+
+ThreadBuffer *registerThread() {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffers.emplace_back(new ThreadBuffer(buffers.size()));
+    return buffers.back().get();
+}
+
+void writeEscaped(std::ostream &out, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            out << '\\';
+        }
+        out << *s;
+    }
+}
+}
+
+long long now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void addEvent(const char *name, long long start, long long duration) {
+    ThreadBuffer *buffer = threadBuffer;
+    if (!buffer) {
+        buffer = threadBuffer = registerThread();
+    }
+    unsigned session = currentSession.load(std::memory_order_relaxed);
+    if (buffer->session.load(std::memory_order_relaxed) != session) {
+        buffer->count.store(0, std::memory_order_relaxed);
+        buffer->dropped.store(0, std::memory_order_relaxed);
+        buffer->session.store(session, std::memory_order_release);
+    }
+    size_t id = buffer->count.load(std::memory_order_relaxed);
+    if (id == EVENTS_PER_THREAD) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer->events[id] = { name, start, duration };
+    buffer->count.store(id + 1, std::memory_order_release);
+}
+
+bool isAvailable() {
+    return true;
+}
+
+bool isRecording() {
+    return recording.load(std::memory_order_relaxed);
+}
+
+void start() {
+    currentSession++;
+    recording = true;
+}
+
+void stop() {
+    recording = false;
+}
+
+size_t droppedEventsCount() {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    size_t result = 0;
+    for (const auto &buffer : buffers) {
+        if (buffer->session.load(std::memory_order_acquire) == currentSession) {
+            result += buffer->dropped.load(std::memory_order_relaxed);
+        }
+    }
+    return result;
+}
+
+void writeTrace(std::ostream &out) {
+    size_t dropped = droppedEventsCount();
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : buffers) {
+        if (buffer->session.load(std::memory_order_acquire) != currentSession) {
+            continue;
+        }
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        if (count == 0) {
+            continue;
+        }
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+            << ",\"args\":{\"name\":\"thread " << buffer->threadId << "\"}}";
+        for (size_t i = 0; i < count; i++) {
+            const Event &event = buffer->events[i];
+            // timestamps are in microseconds
+            char times[64];
+            snprintf(times, sizeof times, "\"ts\":%.3f,\"dur\":%.3f", event.start / 1000.0, event.duration / 1000.0);
+            out << ",\n{\"name\":\"";
+            writeEscaped(out, event.name);
+            out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId << "," << times << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":" << dropped << "}}\n";
+}
+#else
+bool isAvailable() { return false; }
+bool isRecording() { return false; }
+void start() {}
+void stop() {}
+size_t droppedEventsCount() { return 0; }
+void writeTrace(std::ostream &out) {
+    out << "{\"traceEvents\":[]}\n";
+}
+#endif
+
+bool writeTrace(const std::string &fileName) {
+    std::ofstream out(fileName);
+    if (!out) {
+        return false;
+    }
+    writeTrace(out);
+    return static_cast<bool>(out);
+}
+
+void startFromEnvironment() {
+    const char *fileName = getenv("MANUGRAM_TRACE");
+    if (fileName && *fileName) {
+        start();
+    }
+}
+
+void finishFromEnvironment() {
+    const char *fileName = getenv("MANUGRAM_TRACE");
+    if (fileName && *fileName) {
+        stop();
+        writeTrace(std::string(fileName));
+    }
+}
+}
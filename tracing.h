@@ -0,0 +1,76 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+/*
+ * Scoped tracing of hot paths, written in Chrome trace event format
+ * (open it in chrome://tracing or ui.perfetto.dev).
+ * Everything is compiled out unless ENABLE_TRACING is 1, otherwise a scope costs
+ * a relaxed atomic load while nothing is recorded. Every thread appends events
+ * to its own fixed-size buffer without locks, events which do not fit are dropped.
+ * start(), stop() and writeTrace() are called from a single thread.
+ */
+namespace tracing {
+bool isAvailable();
+bool isRecording();
+// Drops events recorded before
+void start();
+void stop();
+size_t droppedEventsCount();
+void writeTrace(std::ostream &out);
+bool writeTrace(const std::string &fileName);
+
+// Recording is started at startup if MANUGRAM_TRACE environment variable is set,
+// the trace is written to the file it names at exit
+void startFromEnvironment();
+void finishFromEnvironment();
+
+#if ENABLE_TRACING == 1
+extern std::atomic<bool> recording;
+long long now(); // in nanoseconds
+void addEvent(const char *name, long long start, long long duration);
+
+// 'name' should live till the trace is written, e.g. a string literal
+class Scope {
+public:
+    explicit Scope(const char *name) : name(recording.load(std::memory_order_relaxed) ? name : nullptr), start(0) {
+        if (this->name) {
+            start = now();
+        }
+    }
+    Scope(const Scope&) = delete;
+    Scope &operator=(const Scope&) = delete;
+    ~Scope() { end(); }
+
+    void end() {
+        if (name) {
+            addEvent(name, start, now() - start);
+            name = nullptr;
+        }
+    }
+
+private:
+    const char *name;
+    long long start;
+};
+#else
+class Scope {
+public:
+    explicit Scope(const char*) {}
+    void end() {}
+};
+#endif
+}
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#if ENABLE_TRACING == 1
+#define TRACE_SCOPE(name) tracing::Scope TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+#endif // TRACING_H
@@ -0,0 +1,106 @@
+#include "track_corpus.h"
+#include "model_io.h"
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+#include <cstdio>
+
+using namespace figures;
+
+using std::dynamic_pointer_cast;
+
+bool readFile(const QString &fileName, std::stringstream &data) {
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly | QFile::Text)) {
+        return false;
+    }
+    data << file.readAll().toStdString();
+    return true;
+}
+
+std::string loadModel(const QString &fileName, Model &model) {
+    std::stringstream data;
+    if (!readFile(fileName, data)) {
+        return "unable to open file for reading";
+    }
+    try {
+        data >> model;
+    } catch (model_format_error &e) {
+        return e.what();
+    }
+    return std::string();
+}
+
+std::vector<LabelledTrack> loadLabelledTracks(const QString &directory) {
+    std::vector<LabelledTrack> result;
+    QDirIterator it(directory, QStringList() << "*.track", QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        QString path = it.next();
+        LabelledTrack labelled;
+        labelled.path = path.toStdString();
+        labelled.expected = QFileInfo(path).dir().dirName().toStdString();
+
+        std::stringstream data;
+        if (!readFile(path, data)) {
+            labelled.error = "unable to open file for reading";
+        } else {
+            try {
+                data >> labelled.track;
+                if (labelled.track.empty()) {
+                    labelled.error = "empty track";
+                }
+            } catch (model_format_error &e) {
+                labelled.error = e.what();
+            }
+        }
+        result.push_back(std::move(labelled));
+    }
+    std::sort(result.begin(), result.end(), [](const LabelledTrack &a, const LabelledTrack &b) {
+        return a.path < b.path;
+    });
+    return result;
+}
+
+const char *const CORPUS_TRACK_TYPES[4] = { "segment", "ellipse", "rectangle", "curve" };
+
+std::vector<Track> loadCorpusTracks(const char *type) {
+    std::vector<Track> result;
+    for (int testId = 1;; testId++) {
+        char resourceName[64];
+        snprintf(resourceName, sizeof resourceName, ":/tests/tracks/mouse/%s/%02d.track", type, testId);
+        std::stringstream data;
+        if (!readFile(resourceName, data)) {
+            break;
+        }
+        result.push_back(Track());
+        data >> result.back();
+    }
+    return result;
+}
+
+std::vector<Track> loadCorpusTracks() {
+    std::vector<Track> result;
+    for (const char *type : CORPUS_TRACK_TYPES) {
+        std::vector<Track> tracks = loadCorpusTracks(type);
+        result.insert(result.end(), tracks.begin(), tracks.end());
+    }
+    return result;
+}
+
+const char *recognizedType(const RecognizedEdit &edit) {
+    switch (edit.action) {
+    case RecognizedEdit::Action::None: return "none";
+    case RecognizedEdit::Action::Click: return "click";
+    case RecognizedEdit::Action::Remove: return "deletion";
+    case RecognizedEdit::Action::Translate: return "translation";
+    case RecognizedEdit::Action::Add: break;
+    }
+    const PFigure &figure = edit.figure;
+    if (dynamic_pointer_cast<SegmentConnection>(figure)) { return "connection"; }
+    if (dynamic_pointer_cast<Segment>(figure)) { return "segment"; }
+    if (dynamic_pointer_cast<Ellipse>(figure)) { return "ellipse"; }
+    if (dynamic_pointer_cast<Rectangle>(figure)) { return "rectangle"; }
+    if (dynamic_pointer_cast<Curve>(figure)) { return "curve"; }
+    return "unknown";
+}
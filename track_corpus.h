@@ -0,0 +1,40 @@
+#ifndef TRACK_CORPUS_H
+#define TRACK_CORPUS_H
+
+#include <QString>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "recognition.h"
+
+/*
+ * Track of a corpus sorted by hand: name of the directory containing the track
+ * is its expected type (like resources/tests/tracks/mouse/ellipse/01.track).
+ */
+struct LabelledTrack {
+    std::string path;
+    std::string expected;
+    Track track;
+    std::string error; // empty if the track was read
+};
+
+// All .track files in the directory tree, sorted by path
+std::vector<LabelledTrack> loadLabelledTracks(const QString &directory);
+
+// Types of figures in the corpus of mouse tracks in resources (see resources-tests.qrc)
+extern const char *const CORPUS_TRACK_TYPES[4];
+// Tracks :/tests/tracks/mouse/<type>/01.track, 02.track and so on while the files exist
+std::vector<Track> loadCorpusTracks(const char *type);
+// Tracks of all types in order of CORPUS_TRACK_TYPES
+std::vector<Track> loadCorpusTracks();
+
+// Type of the figure drawn (e.g. "ellipse") or name of the action (e.g. "click")
+const char *recognizedType(const RecognizedEdit &edit);
+
+// Returns false if the file cannot be read
+bool readFile(const QString &fileName, std::stringstream &data);
+// Returns error message, empty one if the model was loaded
+std::string loadModel(const QString &fileName, Model &model);
+
+#endif // TRACK_CORPUS_H
@@ -0,0 +1,107 @@
+#include "track_filter.h"
+#include <cmath>
+
+namespace {
+// points exactly minDistance apart are kept despite rounding errors of scaling
+const double DISTANCE_TOLERANCE = 1e-6;
+
+double smoothingFactor(double dt, double cutoff) {
+    double tau = 1 / (2 * PI * cutoff);
+    return 1 / (1 + tau / dt);
+}
+}
+
+double OneEuroFilter::filter(double value, double dt) {
+    if (!initialized) {
+        initialized = true;
+        lastValue = value;
+        lastDerivative = 0;
+        return value;
+    }
+    if (dt <= 0) {
+        // events with the same timestamp, nothing to estimate the speed with
+        return lastValue;
+    }
+    double derivative = (value - lastValue) / dt;
+    lastDerivative += smoothingFactor(dt, derivativeCutoff) * (derivative - lastDerivative);
+    double cutoff = minCutoff + beta * fabs(lastDerivative);
+    lastValue += smoothingFactor(dt, cutoff) * (value - lastValue);
+    return lastValue;
+}
+
+TrackFilter::TrackFilter(const TrackFilterSettings &settings)
+    : _settings(settings)
+    , _filterX(settings.minCutoff, settings.beta, settings.derivativeCutoff)
+    , _filterY(settings.minCutoff, settings.beta, settings.derivativeCutoff)
+    , _empty(true), _hasDropped(false) {
+}
+
+void TrackFilter::setSettings(const TrackFilterSettings &settings) {
+    _settings = settings;
+    _filterX = OneEuroFilter(settings.minCutoff, settings.beta, settings.derivativeCutoff);
+    _filterY = OneEuroFilter(settings.minCutoff, settings.beta, settings.derivativeCutoff);
+    reset();
+}
+
+void TrackFilter::reset() {
+    _filterX.reset();
+    _filterY.reset();
+    _empty = true;
+    _hasDropped = false;
+}
+
+TrackPoint TrackFilter::smooth(const TrackPoint &point) {
+    if (!_settings.smoothJitter) {
+        return point;
+    }
+    double dt = _empty ? 0 : (point.time - _lastInput.time) / 1000.0;
+    return TrackPoint(Point(_filterX.filter(point.x, dt), _filterY.filter(point.y, dt)), point.time);
+}
+
+void TrackFilter::keep(const TrackPoint &point) {
+    // the pointer stayed near the last kept point either before or after the dropped one
+    if (_hasDropped && (_lastDropped.time - _lastKept.time >= _settings.minDwellTime
+                        || point.time - _lastDropped.time >= _settings.minDwellTime)) {
+        _output.push_back(_lastDropped);
+    }
+    _output.push_back(point);
+    _lastKept = point;
+    _hasDropped = false;
+}
+
+const std::vector<TrackPoint> &TrackFilter::addPoint(const TrackPoint &point, double scaleFactor) {
+    _output.clear();
+    TrackPoint smoothed = smooth(point);
+    bool first = _empty;
+    _empty = false;
+    _lastInput = point;
+    if (!first && (smoothed - _lastKept).length() * scaleFactor < _settings.minDistance - DISTANCE_TOLERANCE) {
+        _lastDropped = smoothed;
+        _hasDropped = true;
+    } else {
+        keep(smoothed);
+    }
+    return _output;
+}
+
+const std::vector<TrackPoint> &TrackFilter::finish(const TrackPoint &point, double scaleFactor) {
+    _output.clear();
+    TrackPoint smoothed = smooth(point);
+    if (!_empty && (smoothed - _lastKept).length() * scaleFactor < _settings.minDistance - DISTANCE_TOLERANCE) {
+        // the last point is kept anyway, so the time of the stop before it is kept too
+        _hasDropped = false;
+    }
+    keep(smoothed);
+    reset();
+    return _output;
+}
+
+Track TrackFilter::apply(const Track &track, double scaleFactor) {
+    reset();
+    Track result;
+    for (size_t i = 0; i < track.size(); i++) {
+        const std::vector<TrackPoint> &points = i + 1 < track.size() ? addPoint(track[i], scaleFactor) : finish(track[i], scaleFactor);
+        result.points.insert(result.points.end(), points.begin(), points.end());
+    }
+    return result;
+}
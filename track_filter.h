@@ -0,0 +1,80 @@
+#ifndef TRACK_FILTER_H
+#define TRACK_FILTER_H
+
+#include "model.h"
+#include <vector>
+
+struct TrackFilterSettings {
+    // points closer than that to the last kept one are dropped, in screen pixels
+    double minDistance;
+    // if the pointer stayed that long (in ms) near the last kept point, the last dropped point
+    // is kept too, so the stop is not averaged with the movement after it
+    int minDwellTime;
+    // smooth jitter with the 1€ filter, frequencies below are in Hz
+    bool smoothJitter;
+    double minCutoff;
+    double beta;
+    double derivativeCutoff;
+
+    // Drops sub-pixel movements only, without smoothing
+    TrackFilterSettings()
+        : minDistance(1), minDwellTime(50), smoothJitter(false), minCutoff(1.0), beta(0.007), derivativeCutoff(1.0) {}
+};
+
+/*
+ * 1€ filter of a single coordinate (Casiez, Roussel, Vogel, 2012): low-pass filter
+ * with cutoff frequency growing with speed, so slow movements have little jitter
+ * and fast ones have little lag.
+ */
+class OneEuroFilter {
+public:
+    OneEuroFilter(double minCutoff, double beta, double derivativeCutoff)
+        : minCutoff(minCutoff), beta(beta), derivativeCutoff(derivativeCutoff) {
+        reset();
+    }
+
+    void reset() { initialized = false; }
+    // 'dt' is the time since the previous value in seconds
+    double filter(double value, double dt);
+
+private:
+    double minCutoff, beta, derivativeCutoff;
+    bool initialized;
+    double lastValue, lastDerivative;
+};
+
+/*
+ * Stage between input events and a track: drops points which are too close
+ * to the last kept one and optionally smoothes jitter. Kept points keep
+ * their timestamps, and the last point before leaving the neighbourhood
+ * of a stop is kept, so stops are still slow (see getSpeedBreakpoints()).
+ */
+class TrackFilter {
+public:
+    explicit TrackFilter(const TrackFilterSettings &settings);
+
+    const TrackFilterSettings &settings() const { return _settings; }
+    void setSettings(const TrackFilterSettings &settings);
+
+    void reset();
+    // 'scaleFactor' is the one of Scaler, i.e. screen distance is model distance multiplied by it.
+    // Returns points which should be added to the track (none if the point is dropped).
+    const std::vector<TrackPoint> &addPoint(const TrackPoint &point, double scaleFactor);
+    // Same for the last point of the track, it is never dropped, so the track ends where the input ends
+    const std::vector<TrackPoint> &finish(const TrackPoint &point, double scaleFactor);
+
+    // Filters the whole track as if it was drawn point by point, resets the filter
+    Track apply(const Track &track, double scaleFactor);
+
+private:
+    TrackFilterSettings _settings;
+    OneEuroFilter _filterX, _filterY;
+    bool _empty, _hasDropped;
+    TrackPoint _lastInput, _lastKept, _lastDropped;
+    std::vector<TrackPoint> _output;
+
+    TrackPoint smooth(const TrackPoint &point);
+    void keep(const TrackPoint &point);
+};
+
+#endif // TRACK_FILTER_H